@@ -24,14 +24,25 @@
 
 #include "AngleHistogram.h"
 
+#include <omp.h>
+
 #include <cmath>
 #include <sstream>
 
 namespace sedeen {
 namespace image {
 
+namespace {
+//Minimax-like (Chebyshev) coefficients of atan(a) / a as a polynomial in a^2, for a from 0 to 1
+const double AtanCoefficients[8] = { 0.99999988199649230, -0.33331812655625560, 0.19966961829580465,
+    -0.14003290184666506, 0.098688654583183320, -0.058829753147211505, 0.023780518600887035, -0.0045597919873330280 };
+//The number of rows whose bins are found before they are counted, so the bin computation can be vectorized
+const int KernelChunkRows = 256;
+} // namespace
+
 AngleHistogram::AngleHistogram(int nbins /*= 128 */, std::array<float, 2> range /* -CV_PI to CV_PI */) :
-    m_numHistogramBins(nbins), m_histRange(range) {
+    m_numHistogramBins(nbins), m_histRange(range),
+    m_workerCounts(), m_numCountWorkers(0), m_numCountBins(0), m_numProjectedPoints(0) {
 }//end constructor
 
 AngleHistogram::~AngleHistogram(void) {
@@ -50,6 +61,144 @@ void AngleHistogram::FillHistogram(cv::InputArray inVals, cv::OutputArray outHis
     FillHistogram(inVals, outHist, nbins, rangeArray);
 }//end FillHistogram (public 2-parameter)
 
+void AngleHistogram::AccumulateHistogram(cv::InputArray inVals, cv::InputOutputArray hist) {
+    if (inVals.empty()) { return; }
+    std::array<float, 2> rangeArray = this->GetHistogramRange();
+    if (rangeArray[1] <= rangeArray[0]) { return; }
+    int nbins = this->GetNumHistogramBins();
+    if (nbins <= 0) { return; }
+
+    //Histogram this set of values, then add the counts to the running histogram
+    cv::Mat partialHist;
+    FillHistogram(inVals, partialHist, nbins, rangeArray);
+    if (partialHist.empty()) { return; }
+    if (hist.empty()) {
+        hist.assign(partialHist);
+    }
+    else {
+        cv::Mat runningHist = hist.getMat();
+        cv::add(runningHist, partialHist, runningHist);
+    }
+}//end AccumulateHistogram
+
+void AngleHistogram::AccumulateProjectedAngles(cv::InputArray points, const double (&basisVectors)[6],
+    const int numThreads /*= 1*/) {
+    if (points.empty()) { return; }
+    std::array<float, 2> rangeArray = this->GetHistogramRange();
+    if (rangeArray[1] <= rangeArray[0]) { return; }
+    const int nbins = this->GetNumHistogramBins();
+    if (nbins <= 0) { return; }
+    cv::Mat pointsMat = points.getMat();
+    if ((pointsMat.cols != 3) || (pointsMat.type() != cv::DataType<double>::type)) { return; }
+
+    //Size the private counts on the first call, or if the bins changed; they persist until cleared.
+    //Adding workers keeps the counts of the existing ones
+    const int numWorkers = (numThreads < 1) ? 1 : numThreads;
+    if (nbins != m_numCountBins) {
+        m_workerCounts.clear();
+        m_numCountWorkers = 0;
+        m_numCountBins = nbins;
+        m_numProjectedPoints = 0;
+    }
+    if (numWorkers > m_numCountWorkers) {
+        m_workerCounts.resize(static_cast<size_t>(numWorkers) * (nbins + 1), 0);
+        m_numCountWorkers = numWorkers;
+    }
+
+    //Map angles to bins as cv::calcHist does for a uniform histogram: bin = floor((angle - low) * nbins / (high - low))
+    const double binScale = static_cast<double>(nbins) / (static_cast<double>(rangeArray[1]) - static_cast<double>(rangeArray[0]));
+    const double binOffset = -static_cast<double>(rangeArray[0]) * binScale;
+    const double b00 = basisVectors[0], b01 = basisVectors[1], b02 = basisVectors[2];
+    const double b10 = basisVectors[3], b11 = basisVectors[4], b12 = basisVectors[5];
+    const double *firstRow = pointsMat.ptr<double>(0);
+    const size_t rowStep = pointsMat.step1();
+    const int numRows = pointsMat.rows;
+
+    //Count rows [begin, end) into one worker's private histogram
+    auto countRows = [&](const int begin, const int end, std::uint64_t *counts) {
+        int binIndices[KernelChunkRows];
+        for (int chunkStart = begin; chunkStart < end; chunkStart += KernelChunkRows) {
+            const int chunkRows = ((end - chunkStart) < KernelChunkRows) ? (end - chunkStart) : KernelChunkRows;
+            //Project, find the angle and its bin. Points whose projection is (near) zero have no angle, and they and
+            //angles outside the range go to the extra bin nbins, so that the counting loop below has no branches
+            for (int i = 0; i < chunkRows; i++) {
+                const double *od = firstRow + static_cast<size_t>(chunkStart + i) * rowStep;
+                const double x = b00 * od[0] + b01 * od[1] + b02 * od[2];
+                const double y = b10 * od[0] + b11 * od[1] + b12 * od[2];
+                const bool angleUndef = (std::abs(x) < 1e-6) && (std::abs(y) < 1e-6); //Same threshold as VectorsToAngles
+                const double binValue = std::floor(FastAtan2(y, x) * binScale + binOffset);
+                const bool inRange = !angleUndef && (binValue >= 0.0) && (binValue < static_cast<double>(nbins));
+                binIndices[i] = inRange ? static_cast<int>(binValue) : nbins;
+            }
+            for (int i = 0; i < chunkRows; i++) {
+                counts[binIndices[i]]++;
+            }
+        }
+    };
+
+    //Each worker takes a contiguous run of the rows
+    const int maxWorkers = numRows / MinRowsPerWorker;
+    const int blockWorkers = (maxWorkers < 1) ? 1 : ((maxWorkers < numWorkers) ? maxWorkers : numWorkers);
+    if (blockWorkers == 1) {
+        countRows(0, numRows, m_workerCounts.data());
+    }
+    else {
+#pragma omp parallel num_threads(blockWorkers)
+        {
+            int worker = omp_get_thread_num();
+            int numBlockWorkers = omp_get_num_threads();
+            int firstRowIndex = static_cast<int>((static_cast<std::int64_t>(numRows) * worker) / numBlockWorkers);
+            int endRowIndex = static_cast<int>((static_cast<std::int64_t>(numRows) * (worker + 1)) / numBlockWorkers);
+            countRows(firstRowIndex, endRowIndex, m_workerCounts.data() + static_cast<size_t>(worker) * (nbins + 1));
+        }//end parallel region
+    }
+    m_numProjectedPoints += static_cast<std::uint64_t>(numRows);
+}//end AccumulateProjectedAngles
+
+void AngleHistogram::GetProjectedAngleHistogram(cv::OutputArray hist) const {
+    if ((m_numProjectedPoints == 0) || (m_numCountBins <= 0)) {
+        hist.release();
+        return;
+    }
+    //Merge the private counts of the workers, dropping the extra bin
+    cv::Mat theHist = cv::Mat::zeros(m_numCountBins, 1, cv::DataType<float>::type);
+    for (int bin = 0; bin < m_numCountBins; bin++) {
+        std::uint64_t binCount = 0;
+        for (int w = 0; w < m_numCountWorkers; w++) {
+            binCount += m_workerCounts[static_cast<size_t>(w) * (m_numCountBins + 1) + bin];
+        }
+        theHist.at<float>(bin, 0) = static_cast<float>(binCount);
+    }
+    hist.assign(theHist);
+}//end GetProjectedAngleHistogram
+
+void AngleHistogram::ClearProjectedAngles() {
+    m_workerCounts.clear();
+    m_numCountWorkers = 0;
+    m_numCountBins = 0;
+    m_numProjectedPoints = 0;
+}//end ClearProjectedAngles
+
+double AngleHistogram::FastAtan2(const double y, const double x) {
+    //Reduce to a ratio a from 0 to 1, evaluate the polynomial, then restore the octant and quadrant.
+    //Written with selects rather than branches so that loops calling it can be vectorized
+    const double ax = std::abs(x);
+    const double ay = std::abs(y);
+    const double maxXY = (ax > ay) ? ax : ay;
+    const double minXY = (ax > ay) ? ay : ax;
+    const double a = (maxXY > 0.0) ? (minXY / maxXY) : 0.0;
+    const double s = a * a;
+    double p = AtanCoefficients[7];
+    for (int c = 6; c >= 0; c--) {
+        p = p * s + AtanCoefficients[c];
+    }
+    double angle = p * a;
+    const double pi = 3.14159265358979323846;
+    angle = (ay > ax) ? (0.5 * pi - angle) : angle;
+    angle = (x < 0.0) ? (pi - angle) : angle;
+    return (y < 0.0) ? -angle : angle;
+}//end FastAtan2
+
 void AngleHistogram::FillHistogram(cv::InputArray inVals, cv::OutputArray outHist,
     int nbins, std::array<float, 2> rangeArray) {
     if (inVals.empty()) { return; }
@@ -26,6 +26,8 @@
 #define STAINANALYSIS_ANGLEHISTOGRAM_H
 
 #include <array>
+#include <cstdint>
+#include <vector>
 
  //OpenCV include
 #include <opencv2/core/core.hpp>
@@ -44,6 +46,20 @@ public:
 
     ///Populate a histogram from an input array of single-column data, get histogram configuration from member variables
     void FillHistogram(cv::InputArray inVals, cv::OutputArray outHist);
+    ///Add an input array of single-column data to an existing histogram (or create it if empty), get histogram configuration from member variables
+    void AccumulateHistogram(cv::InputArray inVals, cv::InputOutputArray hist);
+
+    ///Project rows of 3-element double points onto two basis vectors (basisVectors holds them as rows) and count the
+    ///angles of the projections, in one fused pass with no intermediate matrices. Workers take contiguous runs of the
+    ///rows and count into private histograms, kept between calls and merged by GetProjectedAngleHistogram
+    void AccumulateProjectedAngles(cv::InputArray points, const double (&basisVectors)[6], const int numThreads = 1);
+    ///Get the histogram of the projected angles counted so far (nbins x 1 float, as FillHistogram creates); empty if no points were added
+    void GetProjectedAngleHistogram(cv::OutputArray hist) const;
+    ///Discard the projected angle counts
+    void ClearProjectedAngles();
+
+    ///A fast arctangent of y/x, from -pi to pi, with an error below 1e-7 radians
+    static double FastAtan2(const double y, const double x);
 
 public:
     ///Convert a set of 2D vectors to float angles between -pi and pi using the arctan2 function
@@ -73,9 +89,21 @@ protected:
     ///Populate a histogram from an input array of single-column data, histogram configuration set by 3rd and 4th arguments
     void FillHistogram(cv::InputArray inVals, cv::OutputArray outHist, int nbins, std::array<float, 2> range);
 
+private:
+    ///Blocks with fewer rows per worker than this are counted by one worker, as threading would cost more than it saves
+    static const int MinRowsPerWorker = 16384;
+
 private:
     int m_numHistogramBins;
     std::array<float, 2> m_histRange;
+
+    ///Private projected angle counts of each worker, nbins + 1 each (the last counts points outside the range)
+    std::vector<std::uint64_t> m_workerCounts;
+    ///The number of workers and bins the counts were sized for
+    int m_numCountWorkers;
+    int m_numCountBins;
+    ///The number of points added to the projected angle counts
+    std::uint64_t m_numProjectedPoints;
 };
 
 } // namespace image
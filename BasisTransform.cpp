@@ -23,6 +23,7 @@
  *=============================================================================*/
 
 #include "BasisTransform.h"
+#include "SymmetricEigen3x3.h"
 
 #include <vector>
 #include <cmath>
@@ -32,15 +33,32 @@
 namespace sedeen {
 namespace image {
 
+namespace {
+//Read an element of a floating point matrix as a double
+inline double ElementAsDouble(const cv::Mat &m, const int row, const int col) {
+    return (m.depth() == cv::DataType<float>::type) ? static_cast<double>(m.at<float>(row, col)) : m.at<double>(row, col);
+}
+} // namespace
+
 BasisTransform::BasisTransform(cv::InputArray sourcePoints, const bool &optimizeDirections /*= true */,
-    const bool &useMean /*=false */, const VectorDirection &sourcePointDir /*= VectorDirection::ROWVECTORS */) 
-    : m_numTestingPixels(10), m_rgen((std::random_device())()) //Initialize random number generation
+    const bool &useMean /*=false */, const VectorDirection &sourcePointDir /*= VectorDirection::ROWVECTORS */,
+    const std::uint64_t &seed /*= 0 */) 
+    : m_numTestingPixels(10), m_rgen(seed, RandomStream) //Initialize random number generation
 {
     cv::Mat theBasisVectors;
     computeBasisVectors(sourcePoints, theBasisVectors, optimizeDirections, useMean, sourcePointDir);
     SetBasisVectors(theBasisVectors, sourcePointDir);
 }//end constructor
 
+BasisTransform::BasisTransform(cv::InputArray covarianceMatrix, cv::InputArray pointMean, cv::InputArray signTestPoints,
+    const bool &optimizeDirections /*= true */, const bool &useMean /*=false */, const std::uint64_t &seed /*= 0 */)
+    : m_numTestingPixels(10), m_rgen(seed, RandomStream) //Initialize random number generation
+{
+    cv::Mat theBasisVectors;
+    computeBasisVectorsFromCovariance(covarianceMatrix, pointMean, signTestPoints, theBasisVectors, optimizeDirections, useMean);
+    SetBasisVectors(theBasisVectors, VectorDirection::ROWVECTORS);
+}//end covariance constructor
+
 BasisTransform::~BasisTransform(void) {
 }//end destructor
 
@@ -75,6 +93,28 @@ void BasisTransform::computeBasisVectors(cv::InputArray sourcePoints, cv::Output
     //We will only consider over-determined cases in this class: numPoints > numElements
     if (numPoints <= numElements) { return; }
 
+    //Points of three double elements (OD pixels): one pass over the data for the six unique covariance terms,
+    //kept in fixed-size storage, with the Mat headers below wrapping them rather than allocating
+    if ((numElements == 3) && (sourceMat.type() == cv::DataType<double>::type)) {
+        PointMoments3 moments;
+        const double *firstElement = sourceMat.ptr<double>(0);
+        const std::uint64_t step = static_cast<std::uint64_t>(sourceMat.step1());
+        if (sourcePointDir == VectorDirection::ROWVECTORS) {
+            moments.AddPoints(firstElement, static_cast<std::uint64_t>(numPoints), step, 1);
+        }
+        else {
+            moments.AddPoints(firstElement, static_cast<std::uint64_t>(numPoints), 1, step);
+        }
+        double meanValues[3], covarTerms[6], covarValues[9];
+        moments.GetMean(meanValues);
+        moments.GetCovariance(covarTerms);
+        SymmetricEigen3x3::Expand(covarTerms, covarValues);
+        cv::Mat elementMeans(sizeOfMean, ctype, meanValues);
+        cv::Mat covar(3, 3, ctype, covarValues);
+        computeBasisVectorsFromCovariance(covar, elementMeans, sourceMat, basisVectors, optimizeDirections, useMean);
+        return;
+    }
+
     //Define matrix for element means
     cv::Mat elementMeans(sizeOfMean, ctype);
     //Define and allocate space for covariance matrix
@@ -83,30 +123,79 @@ void BasisTransform::computeBasisVectors(cv::InputArray sourcePoints, cv::Output
     //Calculate the covariance matrix
     cv::calcCovarMatrix(sourceMat, covar, elementMeans, covar_flags, ctype);
 
-    //Calculate the eigenvalues and eigenvectors
+    //Find the eigenvectors of the covariance matrix, and the basis vectors
+    computeBasisVectorsFromCovariance(covar, elementMeans, sourceMat, basisVectors, optimizeDirections, useMean);
+}//end computeBasisVectors
+
+void BasisTransform::computeBasisVectorsFromCovariance(cv::InputArray covarianceMatrix, cv::InputArray pointMean,
+    cv::InputArray signTestPoints, cv::OutputArray basisVectors, const bool &optimizeDirections /*= true */,
+    const bool &useMean /*=false */) {
+    if (covarianceMatrix.empty() || pointMean.empty()) { return; }
+
+    //Calculate the eigenvalues and eigenvectors. A 3x3 double matrix is solved in closed form in stack storage,
+    //with the eigenvalues as a column and the eigenvectors as rows, as cv::eigen returns them
+    cv::Mat covarMat(covarianceMatrix.getMat());
     cv::Mat eigenvalues, eigenvectors;
-    cv::eigen(covar, eigenvalues, eigenvectors);
+    double evalValues[3], evecValues[9];
+    if ((covarMat.rows == 3) && (covarMat.cols == 3) && (covarMat.type() == cv::DataType<double>::type)) {
+        const double covarTerms[6] = { covarMat.at<double>(0, 0), covarMat.at<double>(0, 1), covarMat.at<double>(0, 2),
+            covarMat.at<double>(1, 1), covarMat.at<double>(1, 2), covarMat.at<double>(2, 2) };
+        if (!SymmetricEigen3x3::Solve(covarTerms, evalValues, evecValues)) { return; }
+        eigenvalues = cv::Mat(3, 1, cv::DataType<double>::type, evalValues);
+        eigenvectors = cv::Mat(3, 3, cv::DataType<double>::type, evecValues);
+    }
+    else {
+        cv::eigen(covarMat, eigenvalues, eigenvectors);
+    }
 
     //Set the mean, eigenvalues, and eigenvectors using covar and eigen outputs
-    SetPointMean(elementMeans);
+    SetPointMean(pointMean);
     SetEigenvalues(eigenvalues);
     SetEigenvectors(eigenvectors);
 
     //Retrieve the required number of eigenvectors to form the basis
     cv::Mat unadjustedBasisVectors = GetEigenvectors(m_reqdBasisVectors, GetEigenvectorElementsDirection());
-    if (optimizeDirections) {
+    if (optimizeDirections && !signTestPoints.empty()) {
         cv::Mat optSignBasisVectors;
-        optimizeBasisVectorSigns(sourcePoints, unadjustedBasisVectors, optSignBasisVectors, useMean, GetEigenvectorElementsDirection());
+        optimizeBasisVectorSigns(signTestPoints, unadjustedBasisVectors, optSignBasisVectors, useMean, GetEigenvectorElementsDirection());
         basisVectors.assign(optSignBasisVectors);
     }
     else {
         basisVectors.assign(unadjustedBasisVectors);
     }
-}//end computeBasisVectors
+}//end computeBasisVectorsFromCovariance
 
 bool BasisTransform::projectPoints(cv::InputArray sourcePoints, cv::OutputArray projectedPoints, const bool &subtractMean /*= false*/) const {
-    cv::Mat basisVecs, means, tempProjPoints;
     //Need the basis vectors and point element means
+    if (m_basisVectors.empty() || m_pointMean.empty()) { return false; }
+
+    //Double points are projected by the view version straight into the output matrix, with no intermediates.
+    //The orientation of the mean gives the orientation of the points: rows if it is a row vector, otherwise columns
+    cv::Mat sourceMat(sourcePoints.getMat());
+    if ((sourceMat.type() == cv::DataType<double>::type) && !sourceMat.empty()) {
+        const bool pointsAsRows = (m_pointMean.rows == 1);
+        const int numPoints = pointsAsRows ? sourceMat.rows : sourceMat.cols;
+        const std::ptrdiff_t sourceStep = static_cast<std::ptrdiff_t>(sourceMat.step1());
+        ConstView sourceView = pointsAsRows
+            ? ConstView(sourceMat.ptr<double>(0), numPoints, sourceMat.cols, sourceStep, 1)
+            : ConstView(sourceMat.ptr<double>(0), numPoints, sourceMat.rows, 1, sourceStep);
+        if (pointsAsRows) {
+            projectedPoints.create(numPoints, GetNumBasisVectors(), cv::DataType<double>::type);
+        }
+        else {
+            projectedPoints.create(GetNumBasisVectors(), numPoints, cv::DataType<double>::type);
+        }
+        cv::Mat projectedMat = projectedPoints.getMat();
+        const std::ptrdiff_t projectedStep = static_cast<std::ptrdiff_t>(projectedMat.step1());
+        MutableView projectedView = pointsAsRows
+            ? MutableView(projectedMat.ptr<double>(0), numPoints, GetNumBasisVectors(), projectedStep, 1)
+            : MutableView(projectedMat.ptr<double>(0), numPoints, GetNumBasisVectors(), 1, projectedStep);
+        bool projectSuccess = this->projectPoints(sourceView, projectedView, subtractMean);
+        if (!projectSuccess) { projectedPoints.release(); }
+        return projectSuccess;
+    }
+
+    cv::Mat basisVecs, means, tempProjPoints;
     this->GetPointMean(means);
     bool getVecsSuccess = this->GetBasisVectors(basisVecs);
     if (!getVecsSuccess || means.empty()) { return false; }
@@ -144,23 +233,17 @@ void BasisTransform::projectPoints(cv::InputArray sourcePoints, cv::OutputArray
     cv::Mat basisMat, _basisMat(basisVectors.getMat());
     _basisMat.convertTo(basisMat, sourceType);
 
-    //If subtractMean is true, fill a matrix with the mean values to subtract from data elements
-    //If subtractMean is false, fill the matrix with zeros
-    int yReps = sourceMat.rows / meansMat.rows;
-    int xReps = sourceMat.cols / meansMat.cols;
-    cv::Mat repeatedMeans;
+    //If subtractMean is true, subtract the mean values from the data elements; otherwise project the data as it is
+    cv::Mat sourceMinusMeans;
     if (subtractMean) {
-        repeatedMeans = cv::repeat(meansMat, yReps, xReps);
+        int yReps = sourceMat.rows / meansMat.rows;
+        int xReps = sourceMat.cols / meansMat.cols;
+        cv::subtract(sourceMat, cv::repeat(meansMat, yReps, xReps), sourceMinusMeans);
     }
     else {
-        cv::Mat zeroVals = cv::Mat::zeros(meansMat.rows, meansMat.cols, meansMat.type());
-        repeatedMeans = cv::repeat(zeroVals, yReps, xReps);
+        sourceMinusMeans = sourceMat;
     }
 
-    //Subtract the means from the source data matrix
-    cv::Mat sourceMinusMeans;
-    cv::subtract(sourceMat, repeatedMeans, sourceMinusMeans);
-
     //Determine the multiplication order by the orientation of the mean matrix
     if (meansMat.rows == 1) {
         cv::gemm(sourceMinusMeans, basisMat, 1, cv::Mat(), 0, projectedPoints, cv::GemmFlags::GEMM_2_T);
@@ -171,16 +254,40 @@ void BasisTransform::projectPoints(cv::InputArray sourcePoints, cv::OutputArray
 }//end projectPoints, protected 4-argument version
 
 bool BasisTransform::backProjectPoints(cv::InputArray projectedPoints, cv::OutputArray backProjPoints, const bool &addMean /*= false*/) const {
+    //Need the basis vectors and point element means (the mean also gives the orientation of the points)
+    if (m_basisVectors.empty() || m_pointMean.empty()) { return false; }
+
+    //Double points are back-projected by the view version straight into the output matrix, with no intermediates
+    cv::Mat projMat(projectedPoints.getMat());
+    if ((projMat.type() == cv::DataType<double>::type) && !projMat.empty()) {
+        const bool pointsAsRows = (m_pointMean.rows == 1);
+        const int numPoints = pointsAsRows ? projMat.rows : projMat.cols;
+        const std::ptrdiff_t projStep = static_cast<std::ptrdiff_t>(projMat.step1());
+        ConstView projView = pointsAsRows
+            ? ConstView(projMat.ptr<double>(0), numPoints, projMat.cols, projStep, 1)
+            : ConstView(projMat.ptr<double>(0), numPoints, projMat.rows, 1, projStep);
+        if (pointsAsRows) {
+            backProjPoints.create(numPoints, GetNumBasisElements(), cv::DataType<double>::type);
+        }
+        else {
+            backProjPoints.create(GetNumBasisElements(), numPoints, cv::DataType<double>::type);
+        }
+        cv::Mat backProjMat = backProjPoints.getMat();
+        const std::ptrdiff_t backProjStep = static_cast<std::ptrdiff_t>(backProjMat.step1());
+        MutableView backProjView = pointsAsRows
+            ? MutableView(backProjMat.ptr<double>(0), numPoints, GetNumBasisElements(), backProjStep, 1)
+            : MutableView(backProjMat.ptr<double>(0), numPoints, GetNumBasisElements(), 1, backProjStep);
+        bool backProjectSuccess = this->backProjectPoints(projView, backProjView, addMean);
+        if (!backProjectSuccess) { backProjPoints.release(); }
+        return backProjectSuccess;
+    }
+
     cv::Mat basisVecs, means, tempBackProjPoints;
-    //Need the basis vectors and point element means
     this->GetPointMean(means);
-    //If addMean is true, check that the means matrix is not empty
-    if (addMean && means.empty()) { return false; }
-    //Check that basis vectors are not empty
     bool getVecsSuccess = this->GetBasisVectors(basisVecs);
     if (!getVecsSuccess || means.empty()) { return false; }
 
-    this->backProjectPoints(projectedPoints, tempBackProjPoints, basisVecs, means);
+    this->backProjectPoints(projectedPoints, tempBackProjPoints, basisVecs, means, addMean);
     if (tempBackProjPoints.empty()) {
         return false;
     }
@@ -213,8 +320,7 @@ void BasisTransform::backProjectPoints(cv::InputArray projectedPoints, cv::Outpu
     cv::Mat basisMat, _basisMat(basisVectors.getMat());
     _basisMat.convertTo(basisMat, projType);
 
-    //If addMean is true, fill a matrix with mean values to add after back projection
-    //If addMean is false, fill the matrix with zeros
+    //If addMean is true, add the mean values after back projection; otherwise back-project without a translation term
     if (addMean) {
         //Determine the multiplication order by the orientation of the mean matrix
         if (meansMat.rows == 1) {
@@ -227,19 +333,65 @@ void BasisTransform::backProjectPoints(cv::InputArray projectedPoints, cv::Outpu
         }
     }
     else {
-        cv::Mat zeroVals = cv::Mat::zeros(meansMat.rows, meansMat.cols, meansMat.type());
         //Determine the multiplication order by the orientation of the mean matrix
         if (meansMat.rows == 1) {
-            cv::Mat repeatedMeans = cv::repeat(zeroVals, projMat.rows, 1);
-            cv::gemm(projMat, basisMat, 1, repeatedMeans, 1, backProjPoints, 0);
+            cv::gemm(projMat, basisMat, 1, cv::noArray(), 0, backProjPoints, 0);
         }
         else if (meansMat.cols == 1) {
-            cv::Mat repeatedMeans = cv::repeat(zeroVals, 1, projMat.cols);
-            cv::gemm(basisMat, projMat, 1, repeatedMeans, 1, backProjPoints, cv::GemmFlags::GEMM_1_T);
+            cv::gemm(basisMat, projMat, 1, cv::noArray(), 0, backProjPoints, cv::GemmFlags::GEMM_1_T);
         }
     }
 }//end backProjectPoints, protected 4-argument version
 
+bool BasisTransform::projectPoints(const ConstView &sourcePoints, const MutableView &projectedPoints,
+    const bool &subtractMean /*= true*/) const {
+    const int numBasis = GetNumBasisVectors();
+    const int numElements = GetNumBasisElements();
+    if ((numBasis == 0) || (sourcePoints.data == nullptr) || (projectedPoints.data == nullptr)) { return false; }
+    if ((sourcePoints.cols != numElements) || (projectedPoints.rows != sourcePoints.rows)
+        || (projectedPoints.cols != numBasis)) { return false; }
+    if (subtractMean && (m_meanValues.size() != static_cast<size_t>(numElements))) { return false; }
+
+    //projected(p, k) = sum over e of basis(k, e) * (source(p, e) - mean(e)), with the mean broadcast across the points
+    const double *basis = m_basisValues.data();
+    const double *mean = subtractMean ? m_meanValues.data() : nullptr;
+    for (int p = 0; p < sourcePoints.rows; p++) {
+        for (int k = 0; k < numBasis; k++) {
+            const double *basisRow = basis + static_cast<size_t>(k) * numElements;
+            double sum = 0.0;
+            for (int e = 0; e < numElements; e++) {
+                double value = (mean == nullptr) ? sourcePoints.at(p, e) : (sourcePoints.at(p, e) - mean[e]);
+                sum += basisRow[e] * value;
+            }
+            projectedPoints.at(p, k) = sum;
+        }
+    }
+    return true;
+}//end projectPoints, view version
+
+bool BasisTransform::backProjectPoints(const ConstView &projectedPoints, const MutableView &backProjPoints,
+    const bool &addMean /*= true*/) const {
+    const int numBasis = GetNumBasisVectors();
+    const int numElements = GetNumBasisElements();
+    if ((numBasis == 0) || (projectedPoints.data == nullptr) || (backProjPoints.data == nullptr)) { return false; }
+    if ((projectedPoints.cols != numBasis) || (backProjPoints.rows != projectedPoints.rows)
+        || (backProjPoints.cols != numElements)) { return false; }
+    if (addMean && (m_meanValues.size() != static_cast<size_t>(numElements))) { return false; }
+
+    //backProjected(p, e) = sum over k of projected(p, k) * basis(k, e), plus mean(e) if adding the mean
+    const double *basis = m_basisValues.data();
+    for (int p = 0; p < projectedPoints.rows; p++) {
+        for (int e = 0; e < numElements; e++) {
+            double sum = addMean ? m_meanValues[e] : 0.0;
+            for (int k = 0; k < numBasis; k++) {
+                sum += projectedPoints.at(p, k) * basis[static_cast<size_t>(k) * numElements + e];
+            }
+            backProjPoints.at(p, e) = sum;
+        }
+    }
+    return true;
+}//end backProjectPoints, view version
+
 void BasisTransform::optimizeBasisVectorSigns(cv::InputArray sourcePoints, /*assume sourcePoints to be row vectors */
     cv::InputArray inputVectors, cv::OutputArray outputVectors, const bool &useMean /*= false*/,
     const VectorDirection &basisVecDir /*= VectorDirection::COLUMNVECTORS*/) {
@@ -405,6 +557,14 @@ void BasisTransform::SetBasisVectors(cv::InputArray basisVectors,
         }
     }
     this->m_basisVectors = bVecs;
+
+    //Keep the values as doubles, row-major, for the view methods
+    m_basisValues.resize(static_cast<size_t>(bVecs.rows) * static_cast<size_t>(bVecs.cols));
+    for (int row = 0; row < bVecs.rows; row++) {
+        for (int col = 0; col < bVecs.cols; col++) {
+            m_basisValues[static_cast<size_t>(row) * bVecs.cols + col] = ElementAsDouble(bVecs, row, col);
+        }
+    }
 }//end SetBasisVectors
 
 bool BasisTransform::GetBasisVectors(cv::OutputArray basisVectors) const {
@@ -422,10 +582,28 @@ cv::Mat BasisTransform::GetBasisVectors() const {
     return bVecs;
 }//end GetBasisVectors
 
+bool BasisTransform::GetBasisVectors(const MutableView &basisVectors) const {
+    if (m_basisValues.empty() || (basisVectors.data == nullptr)) { return false; }
+    if ((basisVectors.rows != GetNumBasisVectors()) || (basisVectors.cols != GetNumBasisElements())) { return false; }
+    for (int row = 0; row < basisVectors.rows; row++) {
+        for (int col = 0; col < basisVectors.cols; col++) {
+            basisVectors.at(row, col) = m_basisValues[static_cast<size_t>(row) * basisVectors.cols + col];
+        }
+    }
+    return true;
+}//end GetBasisVectors, view version
+
 void BasisTransform::SetPointMean(cv::InputArray mean) {
     cv::Mat meanMat = mean.getMat();
     if (!meanMat.empty()) {
-        this->m_pointMean = meanMat.clone();
+        meanMat.copyTo(this->m_pointMean);
+        //Keep the values as doubles for the view methods (the mean is a row or a column)
+        m_meanValues.resize(meanMat.total());
+        for (int row = 0; row < meanMat.rows; row++) {
+            for (int col = 0; col < meanMat.cols; col++) {
+                m_meanValues[static_cast<size_t>(row) * meanMat.cols + col] = ElementAsDouble(meanMat, row, col);
+            }
+        }
     }
 }//end SetPointMean
 
@@ -440,17 +618,27 @@ cv::Mat BasisTransform::GetPointMean() const {
     return mean;
 }//end GetPointMean
 
+bool BasisTransform::GetPointMean(const MutableView &mean) const {
+    if (m_meanValues.empty() || (mean.data == nullptr)) { return false; }
+    if ((mean.rows != 1) || (mean.cols != static_cast<int>(m_meanValues.size()))) { return false; }
+    for (int col = 0; col < mean.cols; col++) {
+        mean.at(0, col) = m_meanValues[col];
+    }
+    return true;
+}//end GetPointMean, view version
+
 void BasisTransform::SetEigenvalues(cv::InputArray evals) {
     cv::Mat evalsMat = evals.getMat();
     if (!evalsMat.empty()) {
-        this->m_eigenvalues = evalsMat.clone();
+        evalsMat.copyTo(this->m_eigenvalues);
     }
 }//end SetEigenvalues
 
 void BasisTransform::GetEigenvalues(cv::OutputArray evals, const int &nVals /*= -1*/) const {
-    cv::Mat tempVals = m_eigenvalues.clone();
+    //Copy only the requested values out of the member matrix
+    const cv::Mat &tempVals = m_eigenvalues;
     if (tempVals.empty() || nVals < 0) {
-        evals.assign(tempVals);
+        tempVals.copyTo(evals);
         return; 
     }
     else {
@@ -466,7 +654,7 @@ void BasisTransform::GetEigenvalues(cv::OutputArray evals, const int &nVals /*=
             int endRow = (nVals > nRows) ? nRows : nVals;
             subMatrix = tempVals.rowRange(0, endRow);
         }
-        evals.assign(subMatrix);
+        subMatrix.copyTo(evals);
         return;
     }
 }//end GetEigenvalues
@@ -479,7 +667,7 @@ cv::Mat BasisTransform::GetEigenvalues(const int &nVals /*= -1*/) const {
 
 const BasisTransform::VectorDirection BasisTransform::GetEigenvectorElementsDirection() const {
     //Use the eigenvalue axial orientation to determine the orientation of the eigenvectors
-    cv::Mat tempVals = m_eigenvalues.clone();
+    const cv::Mat &tempVals = m_eigenvalues;
     VectorDirection direction;
     if (tempVals.empty()) {
         direction = VectorDirection::UNDETERMINED;
@@ -503,7 +691,7 @@ const BasisTransform::VectorDirection BasisTransform::GetEigenvectorElementsDire
 void BasisTransform::SetEigenvectors(cv::InputArray evecs) {
     cv::Mat evecsMat = evecs.getMat();
     if (!evecsMat.empty()) {
-        this->m_eigenvectors = evecsMat.clone();
+        evecsMat.copyTo(this->m_eigenvectors);
     }
 }//end SetEigenvectors
 
@@ -511,10 +699,11 @@ void BasisTransform::GetEigenvectors(cv::OutputArray evecs, const int &nVecs /*=
     const VectorDirection &evecDir /*= VectorDirection::ROWVECTORS*/) const {
     //evecDir allows user to specify the vector direction in the Mat
     //The default direction is vectors as rows
-    cv::Mat tempVals = m_eigenvectors.clone();
+    //Copy only the requested vectors out of the member matrix
+    const cv::Mat &tempVals = m_eigenvectors;
     cv::Mat subMatrix;
     if (tempVals.empty() || nVecs < 0) {
-        evecs.assign(tempVals);
+        tempVals.copyTo(evecs);
         return;
     }
     else {
@@ -523,22 +712,22 @@ void BasisTransform::GetEigenvectors(cv::OutputArray evecs, const int &nVecs /*=
         if (evecDir == VectorDirection::ROWVECTORS) {
             int endRow = (nVecs > nRows) ? nRows : nVecs;
             subMatrix = tempVals.rowRange(0, endRow);
-            evecs.assign(subMatrix);
+            subMatrix.copyTo(evecs);
             return;
         }
         else if (evecDir == VectorDirection::COLUMNVECTORS) {
             int endCol = (nVecs > nCols) ? nCols : nVecs;
             subMatrix = tempVals.colRange(0, endCol);
-            evecs.assign(subMatrix);
+            subMatrix.copyTo(evecs);
             return;
         }
         else {
             //Error case: return full matrix
-            evecs.assign(tempVals);
+            tempVals.copyTo(evecs);
             return;
         }
     }
-    evecs.assign(tempVals);
+    tempVals.copyTo(evecs);
 }//end GetEigenvectors
 
 cv::Mat BasisTransform::GetEigenvectors(const int &nVecs /*= -1*/,
@@ -25,7 +25,12 @@
 #ifndef STAINANALYSIS_BASISTRANSFORM_H
 #define STAINANALYSIS_BASISTRANSFORM_H
 
+#include <cstddef>
+#include <cstdint>
 #include <random>
+#include <vector>
+
+#include "PhiloxRandom.h"
 
 //OpenCV include
 #include <opencv2/core/core.hpp>
@@ -42,9 +47,44 @@ public:
         UNDETERMINED
     };
 
+    ///The random number stream of the seed used to choose the points that test basis vector signs
+    static const std::uint64_t RandomStream = 2;
+
+    ///A non-owning view of a matrix of doubles in caller memory. Element (row, col) is data[row * rowStride + col * colStride],
+    ///so row-major and column-major storage, and sub-blocks of either, are viewed without copying
+    template <typename T>
+    struct MatrixView {
+        MatrixView(T *d = nullptr, const int r = 0, const int c = 0, const std::ptrdiff_t rs = 0, const std::ptrdiff_t cs = 1)
+            : data(d), rows(r), cols(c), rowStride(rs), colStride(cs) {}
+        ///A view of mutable data can be used as a view of const data
+        template <typename U>
+        MatrixView(const MatrixView<U> &other)
+            : data(other.data), rows(other.rows), cols(other.cols), rowStride(other.rowStride), colStride(other.colStride) {}
+        ///View rows x cols values stored row by row
+        static MatrixView RowMajor(T *d, const int r, const int c) { return MatrixView(d, r, c, c, 1); }
+        ///View rows x cols values stored column by column
+        static MatrixView ColumnMajor(T *d, const int r, const int c) { return MatrixView(d, r, c, 1, r); }
+        ///Get an element
+        inline T &at(const int row, const int col) const { return data[row * rowStride + col * colStride]; }
+
+        T *data;
+        int rows;
+        int cols;
+        std::ptrdiff_t rowStride;
+        std::ptrdiff_t colStride;
+    };
+    ///A view of input data
+    typedef MatrixView<const double> ConstView;
+    ///A view of an output buffer
+    typedef MatrixView<double> MutableView;
+
 public:
     BasisTransform(cv::InputArray sourcePoints, const bool &optimizeDirections = true, 
-        const bool &useMean = false, const VectorDirection &sourcePointDir = VectorDirection::ROWVECTORS);
+        const bool &useMean = false, const VectorDirection &sourcePointDir = VectorDirection::ROWVECTORS,
+        const std::uint64_t &seed = 0);
+    ///Construct from a precomputed covariance matrix and point mean (row vector), with a set of row vector points to test basis vector signs
+    BasisTransform(cv::InputArray covarianceMatrix, cv::InputArray pointMean, cv::InputArray signTestPoints,
+        const bool &optimizeDirections = true, const bool &useMean = false, const std::uint64_t &seed = 0);
     virtual ~BasisTransform();
 
     ///Use the member variable basis vectors to create a set of points projected into a new basis. Set subtractMean to translate before projection.
@@ -53,20 +93,39 @@ public:
     ///Given a 2D projected point set, backproject to the original basis using the stored basis vectors. Set addMean to translate after back-projection.
     bool backProjectPoints(cv::InputArray projectedPoints, cv::OutputArray backProjPoints, const bool &addMean = true) const;
 
+    ///Project points (the rows of a view) into the basis, writing one row per point and one column per basis vector
+    ///to a caller-provided buffer. Set subtractMean to translate before projection; the mean is subtracted element by
+    ///element, not materialized. Returns false if there is no basis or the view sizes do not match. Does not allocate.
+    bool projectPoints(const ConstView &sourcePoints, const MutableView &projectedPoints, const bool &subtractMean = true) const;
+    ///Backproject projected points (the rows of a view) to the original basis, writing one row per point to a
+    ///caller-provided buffer. Set addMean to translate after back-projection. Returns false on a size mismatch. Does not allocate.
+    bool backProjectPoints(const ConstView &projectedPoints, const MutableView &backProjPoints, const bool &addMean = true) const;
+
     ///Set/Get the numTestingPixels member variable
     inline void SetNumTestingPixels(const int &n) { m_numTestingPixels = n; }
     ///Set/Get the numTestingPixels member variable
     inline const int GetNumTestingPixels() const { return m_numTestingPixels; }
 
+    ///Get the seed of the random number generator
+    inline const std::uint64_t GetSeed() const { return m_rgen.GetSeed(); }
+
     ///Get the basis vectors computed in this class, if not empty. Returns true on success, false if member Mat is empty.
     bool GetBasisVectors(cv::OutputArray basisVectors) const;
     ///Get the basis vectors computed in this class. Returns a possibly-empty matrix
     cv::Mat GetBasisVectors() const;
+    ///Copy the basis vectors (one per row) to a caller-provided buffer. Returns false if empty or the view size does not match
+    bool GetBasisVectors(const MutableView &basisVectors) const;
+    ///Get the number of basis vectors (0 if there are none)
+    inline const int GetNumBasisVectors() const { return m_basisVectors.rows; }
+    ///Get the number of elements of each basis vector (0 if there are none)
+    inline const int GetNumBasisElements() const { return m_basisVectors.cols; }
 
     ///Get the member point mean
     void GetPointMean(cv::OutputArray mean) const;
     ///Get the member point mean
     cv::Mat GetPointMean() const;
+    ///Copy the point mean to a caller-provided buffer of one row. Returns false if empty or the view size does not match
+    bool GetPointMean(const MutableView &mean) const;
     ///Get some or all of the member eigenvalues (nVals = -1 to return all)
     void GetEigenvalues(cv::OutputArray evals, const int &nVals = -1) const;
     ///Get some or all of the member eigenvalues (nVals = -1 to return all)
@@ -84,6 +143,10 @@ protected:
     ///Find the eigenvectors and basis vectors from a set of source points, with option to optimize the vector directions/signs.
     void computeBasisVectors(cv::InputArray sourcePoints, cv::OutputArray basisVectors, const bool &optimizeDirections = true,
         const bool &useMean = false, const VectorDirection &sourcePointDir = VectorDirection::ROWVECTORS);
+    ///Find the eigenvectors and basis vectors from a covariance matrix and mean, optionally testing basis vector signs with a set of source points.
+    void computeBasisVectorsFromCovariance(cv::InputArray covarianceMatrix, cv::InputArray pointMean, 
+        cv::InputArray signTestPoints, cv::OutputArray basisVectors, const bool &optimizeDirections = true,
+        const bool &useMean = false);
     ///Given points and a set of basis vectors, create a set of points projected into the new basis. Set subtractMean to translate before projection.
     void projectPoints(cv::InputArray sourcePoints, cv::OutputArray projectedPoints, 
         cv::InputArray basisVectors, cv::InputArray means, const bool &subtractMean = false) const;
@@ -106,8 +169,8 @@ protected:
     void SetEigenvectors(cv::InputArray evecs);
 
 protected:
-    ///Allow derived classes access to the random number generator (64-bit Mersenne Twister)
-    std::mt19937_64 m_rgen; //64-bit Mersenne Twister
+    ///Allow derived classes access to the random number generator (counter-based, Philox4x32-10)
+    PhiloxEngine m_rgen;
 
 private:
     //We specifically want two basis vectors
@@ -124,6 +187,10 @@ private:
     cv::Mat m_eigenvalues;
     ///All eigenvectors of the covariance matrix, in eigenvalue descending order
     cv::Mat m_eigenvectors;
+
+    ///The basis vectors (row-major, one per row) and point mean as doubles, read by the view methods without conversion
+    std::vector<double> m_basisValues;
+    std::vector<double> m_meanValues;
 };
 
 } // namespace image
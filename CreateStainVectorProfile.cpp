@@ -27,6 +27,10 @@
 // Primary header
 #include "CreateStainVectorProfile.h"
 #include "StainVectorPixelROI.h"
+#include "RegionODCache.h"
+#include "IntegralODCache.h"
+#include "RGBSampleStore.h"
+#include "TileODConverter.h"
 #include "StainVectorMacenko.h"
 #include "StainVectorNMF.h"
 
@@ -37,6 +41,10 @@
 #include <iostream>
 #include <iomanip>
 #include <cmath>
+#include <filesystem>
+#include <climits>
+#include <random>
+#include <chrono>
 
 // Sedeen headers
 #include "Algorithm.h"
@@ -64,17 +72,32 @@ CreateStainVectorProfile::CreateStainVectorProfile()
     m_nameOfStainProfile(),
     m_numberOfStainComponents(),
     m_nameOfStainOne(),
-    m_regionStainOne(),
+    m_regionListStainOne(),
     m_nameOfStainTwo(),
-    m_regionStainTwo(),
+    m_regionListStainTwo(),
     m_nameOfStainThree(),
-    m_regionStainThree(),
+    m_regionListStainThree(),
     m_stainAnalysisModel(),
     m_stainSeparationAlgorithm(),
     m_useSubsampleOfPixels(),
     m_subsamplePixelsMantissa(),
     m_subsamplePixelsMagnitude(),
+    m_samplingLevel(),
     m_preComputationThreshold(),
+    m_algorithmPercentile(),
+    m_algorithmHistogramBins(),
+    m_progressivePreview(),
+    m_progressiveStopAngle(),
+    m_autoSampleSize(),
+    m_autoSamplePrecision(),
+    m_useTimeBudget(),
+    m_timeBudgetSeconds(),
+    m_numberOfThreads(),
+    m_sampleTissueOnly(),
+    m_countForegroundPixels(),
+    m_cacheSampledPixels(),
+    m_randomSeed(),
+    m_regionAngleTolerance(),
     m_stainToDisplay(),
     m_applyDisplayThreshold(),
     m_displayThreshold(),
@@ -92,7 +115,16 @@ CreateStainVectorProfile::CreateStainVectorProfile()
     m_displayThresholdMaxVal(300.0),
     m_algorithmPercentileDefaultVal(1.0),
     m_algorithmHistogramBinsDefaultVal(1024),
+    m_progressivePilotSampleSize(10000),
+    m_progressiveGrowthFactor(4),
 	m_colorDeconvolution_factory(nullptr),
+    m_stainVectorsComputed(false),
+    m_regionODCache(nullptr),
+    m_integralODCache(nullptr),
+    m_stainVectorMacenko(nullptr),
+    m_stainVectorNMF(nullptr),
+    m_latencyPlanner(),
+    m_latencyPlan(),
     //Define the numberOfStainComponents options
     m_numComponentsOptions({"0", "1", "2", "3"})
 {
@@ -122,6 +154,10 @@ CreateStainVectorProfile::CreateStainVectorProfile()
     //Lists of available analysis models and separation algorithms are defined in its constructor
     m_localStainProfile = std::make_shared<StainProfile>();
 
+    //Region OD sums are kept for the life of the plugin, which is bound to one image
+    m_regionODCache = std::make_shared<image::RegionODCache>();
+    m_integralODCache = std::make_shared<image::IntegralODCache>();
+
 }//end constructor
 
 ///Destructor
@@ -168,6 +204,13 @@ void CreateStainVectorProfile::init(const image::ImageHandle& image) {
         "The number of pixels to include in a sub-sample for stain vector computation is set using two values: the mantissa and the order of magnitude (m x 10^n)",
         magDefaultVal, 0, maxPower, false);
 
+    //The resolution level to sample from. When not using a sub-sample, every pixel on this level is streamed once
+    int maxLevel = static_cast<int>(image->getFactory()->getNumLevels()) - 1;
+    maxLevel = (maxLevel < 0) ? 0 : maxLevel;
+    m_samplingLevel = createIntegerParameter(*this, "Resolution level for pixels",
+        "The image pyramid level pixels are taken from (0 is the highest resolution). If Use sub-sample of pixels is not checked, every pixel on this level is used, with memory use that does not grow with the size of the slide",
+        0, 0, maxLevel, false);
+
     //Set the threshold applied before computing the stain vectors (by whichever method)
     m_preComputationThreshold = createDoubleParameter(*this,
         "OD x100 Threshold (for computation)",   // Widget label
@@ -177,27 +220,84 @@ void CreateStainVectorProfile::init(const image::ImageHandle& image) {
         m_computationThresholdMaxVal,     // maximum value
         false);
 
+    //The Macenko method takes the stain directions at the low and high percentiles of the histogram of angles
+    m_algorithmPercentile = createDoubleParameter(*this, "Histogram range percentile",
+        "The Macenko method takes the stain directions at this percentile from each end of the histogram of pixel angles. Changing it does not re-read the slide",
+        m_algorithmPercentileDefaultVal, 0.01, 50.0, false);
+    m_algorithmHistogramBins = createIntegerParameter(*this, "Number of histogram bins",
+        "The number of bins in the histogram of pixel angles of the Macenko method. Changing it does not re-read the slide",
+        m_algorithmHistogramBinsDefaultVal, 16, 65536, false);
+
+    //Show an estimate from a small sample at once, then refine it while the display updates
+    m_progressivePreview = createBoolParameter(*this, "Progressive preview",
+        "If checked, the Macenko and NMF methods first compute stain vectors from a small sample and display them, then refine them with samples growing up to the requested number of pixels",
+        false, false); //default value, optional
+    m_progressiveStopAngle = createDoubleParameter(*this, "Progressive stop angle (degrees)",
+        "Progressive refinement stops before reaching the requested number of pixels when no stain vector moves by more than this angle between successive estimates",
+        0.5, 0.0, 10.0, false);
+
+    //Let the sample grow only until the stain vectors are precise enough
+    m_autoSampleSize = createBoolParameter(*this, "Choose sample size automatically",
+        "If checked, the Macenko and NMF methods sample in growing batches, up to the number of pixels set above, until a bootstrap estimate of the error of the stain vectors is below the precision set below. Progressive preview is not used in this mode",
+        false, false); //default value, optional
+    m_autoSamplePrecision = createDoubleParameter(*this, "Automatic sample precision (degrees)",
+        "The automatic sample stops growing when 95% of bootstrap resamples give stain vectors within this angle of the estimate",
+        1.0, 0.05, 10.0, false);
+
+    //Plan the level, sample size and bin count from the measured cost of earlier runs
+    m_useTimeBudget = createBoolParameter(*this, "Finish within a time budget",
+        "If checked, the Macenko and NMF methods choose the resolution level, number of pixels (up to the number set above) and histogram bins predicted to finish within the time budget, from the speed measured in earlier runs. Automatic sample size and progressive preview are not used in this mode",
+        false, false); //default value, optional
+    m_timeBudgetSeconds = createDoubleParameter(*this, "Time budget (seconds)",
+        "The time the stain vector computation should finish within",
+        30.0, 1.0, 3600.0, false);
+
+    //Tiles are sampled in parallel, one thread per available processor by default
+    int numProcessors = omp_get_num_procs();
+    m_numberOfThreads = createIntegerParameter(*this, "Number of threads",
+        "The number of threads to use to fetch and convert tiles when sampling pixels from the whole slide image",
+        numProcessors, 1, numProcessors, false);
+
+    //Use a low resolution view of the slide to avoid sampling tiles of background glass
+    m_sampleTissueOnly = createBoolParameter(*this, "Sample tissue tiles only",
+        "If checked, a low resolution prepass finds the tiles containing tissue, and pixels are only sampled from those tiles",
+        true, false); //default value, optional
+
+    //Keep drawing pixels until the requested number are above the threshold
+    m_countForegroundPixels = createBoolParameter(*this, "Count only pixels above threshold",
+        "If checked, the number of pixels to sample counts only pixels above the computation threshold: further pixels are drawn in rounds, sized from the fraction accepted so far, until that many are found",
+        false, false); //default value, optional
+
+    //Save sampled pixels so that changing only the percentile or the algorithm does not re-read the slide
+    m_cacheSampledPixels = createBoolParameter(*this, "Cache sampled pixels",
+        "If checked, sampled pixels are saved in a temporary folder and reloaded when the slide and sampling parameters (including the random seed) are unchanged. Not used when the random seed is 0. The least recently used samples are deleted when the folder exceeds 2 GB",
+        false, false); //default value, optional
+
+    //A fixed seed makes the sample, and so the stain vectors, reproducible from run to run
+    m_randomSeed = createIntegerParameter(*this, "Random seed",
+        "The seed of the random number generator used to sample pixels. Runs with the same seed and parameters give the same result. Set to 0 to use a different random seed for every run",
+        1, 0, INT_MAX, false);
+
+    //Large regions are measured at the coarsest resolution that keeps the error of their mean OD within the tolerance
+    m_regionAngleTolerance = createDoubleParameter(*this, "Region error tolerance (degrees)",
+        "The error allowed in the direction of each stain region's mean optical density. Each region is measured at the coarsest resolution level whose estimated error is below this angle. Set to 0 to measure every region at full resolution",
+        0.5, 0.0, 10.0, false);
+
     //Names of stains and ROIs associated with them
     m_nameOfStainOne = createTextFieldParameter(*this, "Name of Stain 1",
         "Enter the name of a stain in the image", "", true);
-    //m_regionListStainOne = createRegionListParameter(*this, "Stain 1 Regions", 
-    //    "List of Regions of Interest for Stain 1", true);
-	m_regionStainOne = createGraphicItemParameter(*this, "Stain 1 Region",
-		"Region of Interest for Stain 1", true);
+    m_regionListStainOne = createRegionListParameter(*this, "Stain 1 Regions",
+        "List of Regions of Interest for Stain 1. The stain vector is the mean optical density of all the pixels in the regions", true);
 
     m_nameOfStainTwo = createTextFieldParameter(*this, "Name of Stain 2",
         "Enter the name of a stain in the image", "", true);
-    //m_regionListStainTwo = createRegionListParameter(*this, "Stain 2 Regions", 
-    //    "List of Regions of Interest for Stain 2", true);
-	m_regionStainTwo = createGraphicItemParameter(*this, "Stain 2 Region",
-		"Region of Interest for Stain 2", true);
+    m_regionListStainTwo = createRegionListParameter(*this, "Stain 2 Regions",
+        "List of Regions of Interest for Stain 2. The stain vector is the mean optical density of all the pixels in the regions", true);
 
     m_nameOfStainThree = createTextFieldParameter(*this, "Name of Stain 3",
         "Enter the name of a stain in the image", "", true);
-    //m_regionListStainThree = createRegionListParameter(*this, "Stain 3 Regions", 
-    //    "List of Regions of Interest for Stain 3", true);
-	m_regionStainThree = createGraphicItemParameter(*this, "Stain 3 Region",
-		"Region of Interest for Stain 3", true);
+    m_regionListStainThree = createRegionListParameter(*this, "Stain 3 Regions",
+        "List of Regions of Interest for Stain 3. The stain vector is the mean optical density of all the pixels in the regions", true);
 
     //List of options of the stains currently defined, to show in preview
     m_stainToDisplay = createOptionParameter(*this, "Show Separated Stain", 
@@ -250,11 +350,11 @@ void CreateStainVectorProfile::init(const image::ImageHandle& image) {
 //    m_preComputationThreshold.setVisible(true);
 //
 //    m_nameOfStainOne.setVisible(true);
-//    m_regionStainOne.setVisible(true);
+//    m_regionListStainOne.setVisible(true);
 //    m_nameOfStainTwo.setVisible(true);
-//    m_regionStainTwo.setVisible(true);
+//    m_regionListStainTwo.setVisible(true);
 //    m_nameOfStainThree.setVisible(true);
-//    m_regionStainThree.setVisible(true);
+//    m_regionListStainThree.setVisible(true);
 //
 //    m_stainToDisplay.setVisible(true);
 //    m_applyDisplayThreshold.setVisible(true);
@@ -267,16 +367,21 @@ void CreateStainVectorProfile::run() {
     //Get the reference to the localStainProfile
     auto theProfile = this->GetLocalStainProfile();
 
+    //Parameters are split by what they invalidate. Only changes to the parameters that determine the stain vectors
+    //recompute them (a full sampling pass); names and output options only update the profile; display options only
+    //rebuild the color deconvolution factory from the stain profile; panning and zooming only update the view
+    bool compute_changed = checkComputeParametersChanged() || !m_stainVectorsComputed;
+    bool metadata_changed = checkMetadataParametersChanged();
+    bool display_changed = checkDisplayParametersChanged() || (nullptr == m_colorDeconvolution_factory);
 	// Has display area changed
-	bool display_changed = m_displayArea.isChanged();
-    //Have the states of the many parameters changed
-    bool parameters_changed = checkParametersChanged(false);
+	bool view_changed = m_displayArea.isChanged();
 
 	// Update results
-	if (parameters_changed || display_changed) {
+	if (compute_changed || metadata_changed || display_changed || view_changed) {
         //Check whether to write to file, that the field is not blank,
         //and that the file can be created or written to
-        if (m_showPreviewOnly == false) {
+        bool profile_changed = compute_changed || metadata_changed;
+        if (profile_changed && (m_showPreviewOnly == false)) {
             //Get the full path file name from the file dialog parameter
             sedeen::algorithm::parameter::SaveFileDialog::DataType fileDialogDataType = this->m_saveFileAs;
             std::string theFile = fileDialogDataType.getFilename();
@@ -293,80 +398,113 @@ void CreateStainVectorProfile::run() {
             }
         }
 
-        //Clear the values in the StainProfile
-        theProfile->ClearProfile();
-        //Assign values from the parameters to the local stain profile object
-        //Take advantage of the implicit conversion operators in the parameter definitions
-        theProfile->SetNameOfStainProfile(m_nameOfStainProfile);
-        theProfile->SetNumberOfStainComponents(m_numberOfStainComponents);
-        theProfile->SetNameOfStainOne(m_nameOfStainOne);
-        theProfile->SetNameOfStainTwo(m_nameOfStainTwo);
-        theProfile->SetNameOfStainThree(m_nameOfStainThree);
-
-        //The implicit conversion for m_stainAnalysisModel is an int of the option number
-        //Get the text of the name of the stain analysis model from the vector of
-        //names stored in the localStainProfile
-        int stainModelNumber = m_stainAnalysisModel;
-        std::string stainModelName = theProfile->GetStainAnalysisModelName(stainModelNumber);
-        theProfile->SetNameOfStainAnalysisModel(stainModelName);
-
-        //The implicit conversion for m_stainSeparationAlgorithm is an int of the option number
-        //Get the text of the name of the stain separation algorithm from the vector of
-        //names stored in the localStainProfile
-        int stainAlgNumber = m_stainSeparationAlgorithm;
-        std::string stainAlgName = theProfile->GetStainSeparationAlgorithmName(stainAlgNumber);
-        theProfile->SetNameOfStainSeparationAlgorithm(stainAlgName);
-
-        //number of pixels and the threshold can both be obtained from the GUI parameters
-        //It is possible for this value to exceed the size of a 32-bit int, so use long
-        double numPixelsDouble = m_subsamplePixelsMantissa * std::pow(10.0, m_subsamplePixelsMagnitude);
-        long int numPixels = static_cast<long int>(numPixelsDouble);
-        double compThreshold = m_preComputationThreshold / 100.0;
-
-        //For the Macenko (and Niethammer) method, set the percentile limit 
-        //and number of bins in the histogram from the default values set in this class
-        double percentileThreshold = m_algorithmPercentileDefaultVal;
-        int numHistoBins = m_algorithmHistogramBinsDefaultVal;
-
-        //Set the analysis model and separation algorithm parameters
-        //The parameters required depend on the model/algorithm used
-
-        //There is currently only one analysis model, and it does not require any parameters
-        //analysis model 0: "Ruifrok+Johnston Deconvolution"
-        if (stainModelNumber == 0) {
-            //No parameters
-        }
-        else {
-            //No parameters
-        }
+        if (compute_changed) {
+            m_stainVectorsComputed = false;
+            //Clear the values in the StainProfile
+            theProfile->ClearProfile();
+            //Assign values from the parameters to the local stain profile object
+            //Take advantage of the implicit conversion operators in the parameter definitions
+            theProfile->SetNumberOfStainComponents(m_numberOfStainComponents);
+            setProfileNames(theProfile);
+
+            //The implicit conversion for m_stainAnalysisModel is an int of the option number
+            //Get the text of the name of the stain analysis model from the vector of
+            //names stored in the localStainProfile
+            int stainModelNumber = m_stainAnalysisModel;
+            std::string stainModelName = theProfile->GetStainAnalysisModelName(stainModelNumber);
+            theProfile->SetNameOfStainAnalysisModel(stainModelName);
+
+            //The implicit conversion for m_stainSeparationAlgorithm is an int of the option number
+            //Get the text of the name of the stain separation algorithm from the vector of
+            //names stored in the localStainProfile
+            int stainAlgNumber = m_stainSeparationAlgorithm;
+            std::string stainAlgName = theProfile->GetStainSeparationAlgorithmName(stainAlgNumber);
+            theProfile->SetNameOfStainSeparationAlgorithm(stainAlgName);
+
+            //number of pixels and the threshold can both be obtained from the GUI parameters
+            //It is possible for this value to exceed the size of a 32-bit int, so use long
+            double numPixelsDouble = m_subsamplePixelsMantissa * std::pow(10.0, m_subsamplePixelsMagnitude);
+            long int numPixels = static_cast<long int>(numPixelsDouble);
+            double compThreshold = m_preComputationThreshold / 100.0;
+
+            //For the Macenko (and Niethammer) method, set the percentile limit 
+            //and number of bins in the histogram from the GUI parameters
+            double percentileThreshold = m_algorithmPercentile;
+            int numHistoBins = m_algorithmHistogramBins;
+
+            //Set the analysis model and separation algorithm parameters
+            //The parameters required depend on the model/algorithm used
+
+            //There is currently only one analysis model, and it does not require any parameters
+            //analysis model 0: "Ruifrok+Johnston Deconvolution"
+            if (stainModelNumber == 0) {
+                //No parameters
+            }
+            else {
+                //No parameters
+            }
 
-        //There are currently three separation algorithms
-        //analysis model 0: "Region-of-Interest Selection"
-        //analysis model 1: "Macenko Decomposition"
-        //analysis model 2: "Non-Negative Matrix Factorization"
-        if (stainAlgNumber == 0) { //"Region-of-Interest Selection"
-            //No parameters
-        }
-        else if (stainAlgNumber == 1) { //"Macenko Decomposition"
-            theProfile->SetSeparationAlgorithmNumPixelsParameter(numPixels);
-            theProfile->SetSeparationAlgorithmThresholdParameter(compThreshold);
-            theProfile->SetSeparationAlgorithmPercentileParameter(percentileThreshold);
-            theProfile->SetSeparationAlgorithmHistogramBinsParameter(numHistoBins);
-        }
-        else if (stainAlgNumber == 2) { //"Non-Negative Matrix Factorization"
-            theProfile->SetSeparationAlgorithmNumPixelsParameter(numPixels);
-            theProfile->SetSeparationAlgorithmThresholdParameter(compThreshold);
+            //There are currently three separation algorithms
+            //analysis model 0: "Region-of-Interest Selection"
+            //analysis model 1: "Macenko Decomposition"
+            //analysis model 2: "Non-Negative Matrix Factorization"
+            if (stainAlgNumber == 0) { //"Region-of-Interest Selection"
+                //No parameters
+            }
+            else if (stainAlgNumber == 1) { //"Macenko Decomposition"
+                theProfile->SetSeparationAlgorithmNumPixelsParameter(numPixels);
+                theProfile->SetSeparationAlgorithmThresholdParameter(compThreshold);
+                theProfile->SetSeparationAlgorithmPercentileParameter(percentileThreshold);
+                theProfile->SetSeparationAlgorithmHistogramBinsParameter(numHistoBins);
+            }
+            else if (stainAlgNumber == 2) { //"Non-Negative Matrix Factorization"
+                theProfile->SetSeparationAlgorithmNumPixelsParameter(numPixels);
+                theProfile->SetSeparationAlgorithmThresholdParameter(compThreshold);
+            }
+            else {
+                //No parameters
+            }
+
+            //In time budget mode, the sampled methods take the level, sample size and bin count from the latency planner
+            m_latencyPlan = image::LatencyPlanner::Plan();
+            bool sampledMethod = m_useSubsampleOfPixels && ((stainAlgNumber == 1) || (stainAlgNumber == 2));
+            if (m_useTimeBudget && sampledMethod) {
+                m_latencyPlan = m_latencyPlanner.MakePlan(getPyramidLevels(), m_timeBudgetSeconds, stainAlgNumber, numPixels, numHistoBins);
+                if (m_latencyPlan.level >= 0) {
+                    theProfile->SetSeparationAlgorithmNumPixelsParameter(static_cast<long int>(m_latencyPlan.sampleSize));
+                    if (stainAlgNumber == 1) {
+                        theProfile->SetSeparationAlgorithmHistogramBinsParameter(m_latencyPlan.numHistogramBins);
+                    }
+                }
+            }
+            bool usePlan = (m_latencyPlan.level >= 0);
+
+            //Calculate the stain vectors
+            std::shared_ptr<std::string> errorMessage = std::make_shared<std::string>();
+            //Progressive refinement applies to the methods that take a sub-sample of the pixels
+            //(an automatic sample size or a time budget already sets the sample, so they are not combined)
+            bool progressive = m_progressivePreview && sampledMethod && !m_autoSampleSize && !usePlan;
+            auto computeStart = std::chrono::steady_clock::now();
+            bool computeSuccessful = progressive ? computeStainVectorsProgressively(theProfile, errorMessage)
+                : computeStainVectors(theProfile, errorMessage);
+            double computeSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - computeStart).count();
+            if (!computeSuccessful) {
+                m_outputText.sendText(*errorMessage);
+                return;
+            }
+            if (usePlan) {
+                m_report += generateLatencyReport(m_latencyPlan, m_timeBudgetSeconds, computeSeconds);
+            }
+            m_stainVectorsComputed = !askedToStop();
         }
-        else {
-            //No parameters
+        else if (metadata_changed) {
+            //The stain vectors are unchanged; only the names in the profile are updated
+            setProfileNames(theProfile);
         }
 
-        //Calculate the stain vectors and build the operational pipeline
-        std::shared_ptr<std::string> errorMessage = std::make_shared<std::string>();
-        bool buildSuccessful = buildPipeline(theProfile, errorMessage);
-        if (!buildSuccessful) {
-            m_outputText.sendText(*errorMessage);
-            return;
+        //Rebuild the operational pipeline when the stain vectors or display options change
+        if (compute_changed || display_changed) {
+            buildPipeline(theProfile);
         }
 
         //A previous version included an "intermediate result" here, to display
@@ -378,13 +516,13 @@ void CreateStainVectorProfile::run() {
         }
 
         // Update the output text report
-        if (false == askedToStop()) {
+        if (profile_changed && (false == askedToStop())) {
             auto report = generateCompleteReport();
             m_outputText.sendText(report); 
         }
 
-        //If an output file should be written and the algorithm ran successfully, save the localStainProfile to file
-        if ((m_showPreviewOnly == false) && (buildSuccessful == true)) {
+        //If an output file should be written and the profile changed, save the localStainProfile to file
+        if (profile_changed && (m_showPreviewOnly == false) && m_stainVectorsComputed) {
             //Send the contents of the localStainProfile to the given file
             bool saveResult = SaveStainProfileToFile();
 
@@ -394,41 +532,70 @@ void CreateStainVectorProfile::run() {
                 return;
             }
         }
-        else { //m_showPreviewOnly == true
+        else { //m_showPreviewOnly == true, or only the display changed
             //do nothing 
         }
-	}//end if (pipeline_changed || display_changed)
+	}//end if (anything changed)
 
     // Ensure we run again after an abort
-    // a small kludge that causes buildPipeline() to return TRUE
+    // a small kludge that causes the stain vectors and the pipeline to be rebuilt
     if (askedToStop() && (nullptr != m_colorDeconvolution_factory)) {
         m_colorDeconvolution_factory.reset();
+        m_stainVectorsComputed = false;
     }
 }//end run
 
-bool CreateStainVectorProfile::checkParametersChanged(bool somethingChanged) {
-    //Check if any of the parameters changed, plus an external value to check
-    if (somethingChanged
-        || m_nameOfStainProfile.isChanged()
-        || m_numberOfStainComponents.isChanged()
+void CreateStainVectorProfile::setProfileNames(std::shared_ptr<StainProfile> theProfile) {
+    //Take advantage of the implicit conversion operators in the parameter definitions
+    theProfile->SetNameOfStainProfile(m_nameOfStainProfile);
+    theProfile->SetNameOfStainOne(m_nameOfStainOne);
+    theProfile->SetNameOfStainTwo(m_nameOfStainTwo);
+    theProfile->SetNameOfStainThree(m_nameOfStainThree);
+}//end setProfileNames
+
+bool CreateStainVectorProfile::checkComputeParametersChanged() {
+    //The parameters that determine the stain vectors. The number of threads and the sample cache
+    //change only the speed of the computation, not its result, so they are not included
+    if (m_numberOfStainComponents.isChanged()
         || m_stainAnalysisModel.isChanged()
         || m_stainSeparationAlgorithm.isChanged()
         || m_useSubsampleOfPixels.isChanged()
         || m_subsamplePixelsMantissa.isChanged()
         || m_subsamplePixelsMagnitude.isChanged()
+        || m_samplingLevel.isChanged()
         || m_preComputationThreshold.isChanged()
+        || m_algorithmPercentile.isChanged()
+        || m_algorithmHistogramBins.isChanged()
+        || m_progressivePreview.isChanged()
+        || m_progressiveStopAngle.isChanged()
+        || m_autoSampleSize.isChanged()
+        || m_autoSamplePrecision.isChanged()
+        || m_useTimeBudget.isChanged()
+        || m_timeBudgetSeconds.isChanged()
+        || m_sampleTissueOnly.isChanged()
+        || m_countForegroundPixels.isChanged()
+        || m_randomSeed.isChanged()
+        || m_regionAngleTolerance.isChanged()
+        || m_regionListStainOne.isChanged()
+        || m_regionListStainTwo.isChanged()
+        || m_regionListStainThree.isChanged())
+    {
+        return true;
+    }
+    else
+    {
+        return false;
+    }
+}//end checkComputeParametersChanged
+
+bool CreateStainVectorProfile::checkMetadataParametersChanged() {
+    //Names and output options are stored with the stain vectors but do not change them
+    if (m_nameOfStainProfile.isChanged()
         || m_nameOfStainOne.isChanged()
-        || m_regionStainOne.isChanged()
         || m_nameOfStainTwo.isChanged()
-        || m_regionStainTwo.isChanged()
         || m_nameOfStainThree.isChanged()
-        || m_regionStainThree.isChanged()
-        || m_stainToDisplay.isChanged()
-        || m_applyDisplayThreshold.isChanged()
-        || m_displayThreshold.isChanged()
         || m_showPreviewOnly.isChanged()
-        || m_displayArea.isChanged()
-        || (nullptr == m_colorDeconvolution_factory))
+        || m_saveFileAs.isChanged())
     {
         return true;
     }
@@ -436,11 +603,92 @@ bool CreateStainVectorProfile::checkParametersChanged(bool somethingChanged) {
     {
         return false;
     }
-}//end checkParametersChanged
+}//end checkMetadataParametersChanged
 
-bool CreateStainVectorProfile::buildPipeline(std::shared_ptr<StainProfile> theProfile, std::shared_ptr<std::string> errorMessage) {
+bool CreateStainVectorProfile::checkDisplayParametersChanged() {
+    //Options of the color deconvolution kernel, which is rebuilt from the stain profile
+    if (m_stainToDisplay.isChanged()
+        || m_applyDisplayThreshold.isChanged()
+        || m_displayThreshold.isChanged())
+    {
+        return true;
+    }
+    else
+    {
+        return false;
+    }
+}//end checkDisplayParametersChanged
+
+bool CreateStainVectorProfile::computeStainVectors(std::shared_ptr<StainProfile> theProfile, std::shared_ptr<std::string> errorMessage) {
+    //split pipeline by which stain separation algorithm to use
+    bool subPipelineSuccessful = false;
+    int stainAlgNumber = m_stainSeparationAlgorithm;
+    if (stainAlgNumber == 0) { //"Region-of-Interest Selection"
+        subPipelineSuccessful = buildPixelROIPipeline(theProfile, errorMessage);
+    }
+    else if (stainAlgNumber == 1) { //"Macenko Decomposition"
+        subPipelineSuccessful = buildMacenkoPipeline(theProfile, errorMessage);
+    }
+    else if (stainAlgNumber == 2) { //"Non-Negative Matrix Factorization"
+        subPipelineSuccessful = buildNMFPipeline(theProfile, errorMessage);
+    }
+    else {
+        //No action
+    }
+    return subPipelineSuccessful;
+}//end computeStainVectors
+
+bool CreateStainVectorProfile::computeStainVectorsProgressively(std::shared_ptr<StainProfile> theProfile, std::shared_ptr<std::string> errorMessage) {
+    long int requestedPixels = theProfile->GetSeparationAlgorithmNumPixelsParameter();
+    double stopAngle = m_progressiveStopAngle;
+    long int stepPixels = (m_progressivePilotSampleSize < requestedPixels) ? m_progressivePilotSampleSize : requestedPixels;
+    double previousVectors[9] = { 0.0 };
+    int numEstimates = 0;
+    double lastChange = 0.0;
+    bool converged = false;
+    while (true) {
+        //The pipelines take the sample size from the profile, which keeps the size of the final estimate
+        theProfile->SetSeparationAlgorithmNumPixelsParameter(stepPixels);
+        bool stepSuccessful = computeStainVectors(theProfile, errorMessage);
+        if (!stepSuccessful) { return false; }
+        numEstimates++;
+
+        double vectors[9] = { 0.0 };
+        std::array<double, 3> rgb = theProfile->GetStainOneRGB();
+        std::copy(rgb.begin(), rgb.end(), vectors);
+        rgb = theProfile->GetStainTwoRGB();
+        std::copy(rgb.begin(), rgb.end(), vectors + 3);
+        rgb = theProfile->GetStainThreeRGB();
+        std::copy(rgb.begin(), rgb.end(), vectors + 6);
+        if (numEstimates > 1) {
+            lastChange = image::StainVectorBase::MaxStainVectorAngle(previousVectors, vectors);
+            converged = (lastChange < stopAngle);
+        }
+        if (converged || (stepPixels >= requestedPixels) || askedToStop()) { break; }
+
+        //Display this estimate while the next, larger sample is drawn
+        buildPipeline(theProfile);
+        if (nullptr != m_colorDeconvolution_factory) {
+            m_result.update(m_colorDeconvolution_factory, m_displayArea, *this);
+        }
+        std::ostringstream ss;
+        ss << generateCompleteReport() << std::endl << "Refining: estimate " << numEstimates << " used " << stepPixels
+            << " of " << requestedPixels << " pixels";
+        if (numEstimates > 1) {
+            ss << ", change " << std::fixed << std::setprecision(2) << lastChange << " degrees";
+        }
+        ss << std::endl;
+        m_outputText.sendText(ss.str());
+
+        std::copy(std::begin(vectors), std::end(vectors), std::begin(previousVectors));
+        stepPixels = (stepPixels > requestedPixels / m_progressiveGrowthFactor) ? requestedPixels : stepPixels * m_progressiveGrowthFactor;
+    }
+    m_report += generateProgressiveReport(numEstimates, stepPixels, requestedPixels, lastChange, converged);
+    return true;
+}//end computeStainVectorsProgressively
+
+void CreateStainVectorProfile::buildPipeline(std::shared_ptr<StainProfile> theProfile) {
     using namespace image::tile;
-    bool buildSuccessful = false;
     // Get the factory of the source image
     auto source_factory = image()->getFactory();
 
@@ -461,23 +709,6 @@ bool CreateStainVectorProfile::buildPipeline(std::shared_ptr<StainProfile> thePr
         break;
     }
 
-    //split pipeline by which stain separation algorithm to use
-    bool subPipelineSuccessful = false;
-    int stainAlgNumber = m_stainSeparationAlgorithm;
-    if (stainAlgNumber == 0) { //"Region-of-Interest Selection"
-        subPipelineSuccessful = buildPixelROIPipeline(theProfile, errorMessage);
-    }
-    else if (stainAlgNumber == 1) { //"Macenko Decomposition"
-        subPipelineSuccessful = buildMacenkoPipeline(theProfile, errorMessage);
-    }
-    else if (stainAlgNumber == 2) { //"Non-Negative Matrix Factorization"
-        subPipelineSuccessful = buildNMFPipeline(theProfile, errorMessage);
-    }
-    else {
-        //No action
-    }
-    buildSuccessful = subPipelineSuccessful;
-
     //Send information to the kernel
     //TEMPORARY! Note that the display threshold value must be divided by 100 here,
     //because it is not possible to set the precision of a double parameter as of Sedeen 5.4.1
@@ -492,8 +723,6 @@ bool CreateStainVectorProfile::buildPipeline(std::shared_ptr<StainProfile> thePr
     // Wrap resulting Factory in a Cache for speedy results
     m_colorDeconvolution_factory =
         std::make_shared<Cache>(non_cached_factory, RecentCachePolicy(30));
-
-    return buildSuccessful;
 }//end buildPipeline
 
 bool CreateStainVectorProfile::buildPixelROIPipeline(std::shared_ptr<StainProfile> theProfile, std::shared_ptr<std::string> errorMessage) {
@@ -505,50 +734,32 @@ bool CreateStainVectorProfile::buildPixelROIPipeline(std::shared_ptr<StainProfil
     //auto source_color = source_factory->getColorSpace();
 
     int numStains = theProfile->GetNumberOfStainComponents();
-    //Which of the region selectors have regions specified?
-    bool oneDefined = m_regionStainOne.isUserDefined();
-    bool twoDefined = m_regionStainTwo.isUserDefined();
-    bool threeDefined = m_regionStainThree.isUserDefined();
-
-    std::vector<std::shared_ptr<GraphicItemBase>> regionsOfInterestVector;
     if ((numStains <= 0) || (numStains > 3)) {
         errorMessage->assign("Invalid number of stains chosen");
         return errorVal;
     }
-    else if (numStains > 0) {
-        if (oneDefined) {
-            std::shared_ptr<GraphicItemBase> region = m_regionStainOne;
-            regionsOfInterestVector.push_back(region);
-            Rect rect = containingRect(regionsOfInterestVector.at(0)->graphic());
-        }
-        else {
-            errorMessage->assign("Stain 1 region of interest is not defined. Please define a region to use to calculate the stain vector.");
-            return errorVal;
-        }
-    }
-    //These if statements are cumulative, not "else if"
-    if (numStains > 1) {
-        if (twoDefined) {
-            std::shared_ptr<GraphicItemBase> region = m_regionStainTwo;
-            regionsOfInterestVector.push_back(region);
-            Rect rect = containingRect(regionsOfInterestVector.at(1)->graphic());
-        }
-        else {
-            errorMessage->assign("Stain 2 region of interest is not defined. Please define a region to use to calculate the stain vector.");
-            return errorVal;
-        }
-    }
-    //Cumulative
-    if (numStains > 2) {
-        if (threeDefined) {
-            std::shared_ptr<GraphicItemBase> region = m_regionStainThree;
-            regionsOfInterestVector.push_back(region);
-            Rect rect = containingRect(regionsOfInterestVector.at(2)->graphic());
+    //Each stain needs at least one region; there is no limit on the number of regions
+    std::vector<RegionListParameter*> regionLists = { &m_regionListStainOne, &m_regionListStainTwo, &m_regionListStainThree };
+    std::vector<sedeen::image::StainVectorPixelROI::RegionList> stainRegions;
+    std::vector<size_t> numRegions;
+    for (int j = 0; j < numStains; j++) {
+        sedeen::image::StainVectorPixelROI::RegionList regions;
+        if (regionLists[j]->isUserDefined()) {
+            std::vector<std::shared_ptr<GraphicItemBase>> regionList = *regionLists[j];
+            for (auto it = regionList.begin(); it != regionList.end(); ++it) {
+                if ((*it) != nullptr) {
+                    regions.push_back(*it);
+                }
+            }
         }
-        else {
-            errorMessage->assign("Stain 3 region of interest is not defined. Please define a region to use to calculate the stain vector.");
+        if (regions.empty()) {
+            std::stringstream ss;
+            ss << "Stain " << (j + 1) << " regions of interest are not defined. Please define at least one region to use to calculate the stain vector.";
+            errorMessage->assign(ss.str());
             return errorVal;
         }
+        numRegions.push_back(regions.size());
+        stainRegions.push_back(regions);
     }
     //auto display_resolution = getDisplayResolution(image(), m_displayArea);
 
@@ -556,8 +767,18 @@ bool CreateStainVectorProfile::buildPixelROIPipeline(std::shared_ptr<StainProfil
     double conv_matrix[9] = { 0.0 };
 
     std::shared_ptr<sedeen::image::StainVectorPixelROI> stainVectorFromROI 
-        = std::make_shared<sedeen::image::StainVectorPixelROI>(source_factory, regionsOfInterestVector);
+        = std::make_shared<sedeen::image::StainVectorPixelROI>(source_factory, stainRegions);
+    int numThreads = m_numberOfThreads;
+    stainVectorFromROI->SetNumThreads(numThreads);
+    stainVectorFromROI->SetAngleTolerance(m_regionAngleTolerance);
+    //Regions that have not moved since an earlier run reuse their OD sums
+    stainVectorFromROI->SetRegionODCache(m_regionODCache);
+    //Rectangles are summed from the integral OD tables of their tiles
+    stainVectorFromROI->SetIntegralODCache(m_integralODCache);
     stainVectorFromROI->ComputeStainVectors(conv_matrix);
+    //No pixels are sampled; report the resolution each stain was measured at
+    m_report = generateRegionReport(numRegions, stainVectorFromROI->GetStainLevels(), stainVectorFromROI->GetStainErrorEstimates(),
+        stainVectorFromROI->GetNumGroupsMeasured(), stainVectorFromROI->GetNumGroupsReused());
     //option of error return from here?
     //errorMessage->assign("Could not calculate the stain vectors. Please check your regions of interest and try again.");
 
@@ -586,16 +807,51 @@ bool CreateStainVectorProfile::buildMacenkoPipeline(std::shared_ptr<StainProfile
     double compThreshold = theProfile->GetSeparationAlgorithmThresholdParameter();
     double percentileThreshold = theProfile->GetSeparationAlgorithmPercentileParameter();
     int numHistoBins = theProfile->GetSeparationAlgorithmHistogramBinsParameter();
+    int numThreads = m_numberOfThreads;
+    bool sampleTissueOnly = m_sampleTissueOnly;
+    bool countForegroundPixels = m_countForegroundPixels;
+    bool useAllPixels = (m_useSubsampleOfPixels == false);
+    int samplingLevel = this->getSamplingLevel();
+    std::string cacheDirectory = this->getSampleCacheDirectory();
+    u64 samplingSeed = this->getSamplingSeed();
 
     double conv_matrix[9] = { 0.0 };
     double sorted_matrix[9] = { 0.0 };
 
     //This pipeline only works for two stains
     if (numStains == 2) {
-        //Pass the regions of interest to a StainVectorMacenko object, call ComputeStainVectors
-        std::shared_ptr<sedeen::image::StainVectorMacenko> stainVectorFromMacenko
-            = std::make_shared<sedeen::image::StainVectorMacenko>(source_factory, compThreshold, percentileThreshold, numHistoBins);
+        //Pass the pixels to a StainVectorMacenko object, call ComputeStainVectors. The object is kept between runs,
+        //so it reuses its sample, basis transform and angle histogram for the stages whose inputs did not change
+        if (m_stainVectorMacenko == nullptr) {
+            m_stainVectorMacenko = std::make_shared<sedeen::image::StainVectorMacenko>(source_factory);
+        }
+        std::shared_ptr<sedeen::image::StainVectorMacenko> stainVectorFromMacenko = m_stainVectorMacenko;
+        stainVectorFromMacenko->SetODThreshold(compThreshold);
+        stainVectorFromMacenko->SetPercentileThreshold(percentileThreshold);
+        stainVectorFromMacenko->SetNumHistogramBins(numHistoBins);
+        stainVectorFromMacenko->SetNumThreads(numThreads);
+        stainVectorFromMacenko->SetUseTissueMask(sampleTissueOnly);
+        stainVectorFromMacenko->SetCountForegroundOnly(countForegroundPixels);
+        stainVectorFromMacenko->SetUseAllPixels(useAllPixels);
+        stainVectorFromMacenko->SetSamplingLevel(samplingLevel);
+        stainVectorFromMacenko->SetSeed(samplingSeed);
+        //Above 0, the number of pixels is the largest sample drawn while growing it to this precision
+        stainVectorFromMacenko->SetTargetPrecision((m_autoSampleSize && (m_latencyPlan.level < 0)) ? static_cast<double>(m_autoSamplePrecision) : 0.0);
+        stainVectorFromMacenko->SetSampleCacheDirectory(cacheDirectory); //empty disables the cache
+        if (!cacheDirectory.empty()) {
+            stainVectorFromMacenko->SetSlideIdentity(this->getSlideIdentity());
+        }
+        auto computeStart = std::chrono::steady_clock::now();
         stainVectorFromMacenko->ComputeStainVectors(conv_matrix, numPixels);
+        recordComputationCosts(1, stainVectorFromMacenko,
+            std::chrono::duration<double>(std::chrono::steady_clock::now() - computeStart).count());
+        m_report = generateSamplingReport(stainVectorFromMacenko->GetSamplingStatistics());
+        if (stainVectorFromMacenko->GetAutoSampleSize() > 0) {
+            //Record the size of the sample actually used in the profile
+            theProfile->SetSeparationAlgorithmNumPixelsParameter(static_cast<long int>(stainVectorFromMacenko->GetAutoSampleSize()));
+            m_report += generateAutoSampleReport(static_cast<long int>(stainVectorFromMacenko->GetAutoSampleSize()), numPixels,
+                stainVectorFromMacenko->GetAchievedPrecision(), stainVectorFromMacenko->GetTargetPrecision());
+        }
     }
     else {
         errorMessage->assign("Invalid number of stains chosen. The Macenko method is intended for two stains.");
@@ -628,16 +884,49 @@ bool CreateStainVectorProfile::buildNMFPipeline(std::shared_ptr<StainProfile> th
     int numStains = theProfile->GetNumberOfStainComponents();
     long int numPixels = theProfile->GetSeparationAlgorithmNumPixelsParameter();
     double compThreshold = theProfile->GetSeparationAlgorithmThresholdParameter();
+    int numThreads = m_numberOfThreads;
+    bool sampleTissueOnly = m_sampleTissueOnly;
+    bool countForegroundPixels = m_countForegroundPixels;
+    bool useAllPixels = (m_useSubsampleOfPixels == false);
+    int samplingLevel = this->getSamplingLevel();
+    std::string cacheDirectory = this->getSampleCacheDirectory();
+    u64 samplingSeed = this->getSamplingSeed();
 
     double conv_matrix[9] = { 0.0 };
     double sorted_matrix[9] = { 0.0 };
 
     //This pipeline only works for two stains
     if (numStains == 2) {
-        //Pass the regions of interest to a StainVectorNMF object, call ComputeStainVectors
-        std::shared_ptr<sedeen::image::StainVectorNMF> stainVectorFromNMF
-            = std::make_shared<sedeen::image::StainVectorNMF>(source_factory, compThreshold);
+        //Pass the pixels to a StainVectorNMF object, call ComputeStainVectors. The object is kept between runs,
+        //so it reuses its sample and factorization when their inputs did not change
+        if (m_stainVectorNMF == nullptr) {
+            m_stainVectorNMF = std::make_shared<sedeen::image::StainVectorNMF>(source_factory);
+        }
+        std::shared_ptr<sedeen::image::StainVectorNMF> stainVectorFromNMF = m_stainVectorNMF;
+        stainVectorFromNMF->SetODThreshold(compThreshold);
+        stainVectorFromNMF->SetNumThreads(numThreads);
+        stainVectorFromNMF->SetUseTissueMask(sampleTissueOnly);
+        stainVectorFromNMF->SetCountForegroundOnly(countForegroundPixels);
+        stainVectorFromNMF->SetUseAllPixels(useAllPixels);
+        stainVectorFromNMF->SetSamplingLevel(samplingLevel);
+        stainVectorFromNMF->SetSeed(samplingSeed);
+        //Above 0, the number of pixels is the largest sample drawn while growing it to this precision
+        stainVectorFromNMF->SetTargetPrecision((m_autoSampleSize && (m_latencyPlan.level < 0)) ? static_cast<double>(m_autoSamplePrecision) : 0.0);
+        stainVectorFromNMF->SetSampleCacheDirectory(cacheDirectory); //empty disables the cache
+        if (!cacheDirectory.empty()) {
+            stainVectorFromNMF->SetSlideIdentity(this->getSlideIdentity());
+        }
+        auto computeStart = std::chrono::steady_clock::now();
         stainVectorFromNMF->ComputeStainVectors(conv_matrix, numPixels);
+        recordComputationCosts(2, stainVectorFromNMF,
+            std::chrono::duration<double>(std::chrono::steady_clock::now() - computeStart).count());
+        m_report = generateSamplingReport(stainVectorFromNMF->GetSamplingStatistics());
+        if (stainVectorFromNMF->GetAutoSampleSize() > 0) {
+            //Record the size of the sample actually used in the profile
+            theProfile->SetSeparationAlgorithmNumPixelsParameter(static_cast<long int>(stainVectorFromNMF->GetAutoSampleSize()));
+            m_report += generateAutoSampleReport(static_cast<long int>(stainVectorFromNMF->GetAutoSampleSize()), numPixels,
+                stainVectorFromNMF->GetAchievedPrecision(), stainVectorFromNMF->GetTargetPrecision());
+        }
     }
     else {
         errorMessage->assign("Invalid number of stains. Separation by Non-Negative Matrix Factorization is intended for two stains.");
@@ -661,12 +950,106 @@ bool CreateStainVectorProfile::buildNMFPipeline(std::shared_ptr<StainProfile> th
 
 std::string CreateStainVectorProfile::generateCompleteReport() const {
     //Combine the output of the stain profile report
-    //and the pixel fraction report, return the full string
+    //and the sampling report, return the full string
     std::ostringstream ss;
     ss << generateStainProfileReport(m_localStainProfile);
+    if (!m_report.empty()) {
+        ss << std::endl << m_report;
+    }
     return ss.str();
 }//end generateCompleteReport
 
+std::string CreateStainVectorProfile::generateSamplingReport(const image::SamplingStatistics &stats) const {
+    std::ostringstream ss;
+    ss << "Pixel sampling" << std::endl;
+    if (stats.loadedFromCache) {
+        ss << "Sampled pixels were loaded from the sample cache." << std::endl;
+        return ss.str();
+    }
+    ss << "Candidate pixels drawn: " << stats.numPixelsConverted;
+    if (stats.numRounds > 1) {
+        ss << " in " << stats.numRounds << " rounds";
+    }
+    ss << std::endl;
+    ss << "Pixels above the OD threshold: " << stats.numPixelsKept << std::endl;
+    ss << "Acceptance rate: " << std::fixed << std::setprecision(1) << 100.0 * stats.GetAcceptanceRate() << "%" << std::endl;
+    ss << "Conversion speed: " << std::fixed << std::setprecision(1) << stats.GetConversionThroughput() / 1.0e6
+        << " Mpixel/s per thread (" << stats.instructionSet << ")" << std::endl;
+    //Benchmark the conversion kernel on its own once per session, without tile reads, for comparison with the speed above
+    const image::TileODConverter::InstructionSet bestSet = image::TileODConverter::GetBestInstructionSet();
+    static const double bestThroughput = image::TileODConverter::MeasureThroughput(image::RGBSampleStore::GetODLookupTable(), bestSet);
+    static const double scalarThroughput = (bestSet == image::TileODConverter::SCALAR) ? bestThroughput
+        : image::TileODConverter::MeasureThroughput(image::RGBSampleStore::GetODLookupTable(), image::TileODConverter::SCALAR);
+    ss << "Conversion kernel benchmark: " << std::fixed << std::setprecision(1) << bestThroughput / 1.0e6
+        << " Mpixel/s (" << image::TileODConverter::GetInstructionSetName(bestSet) << ")";
+    if (bestSet != image::TileODConverter::SCALAR) {
+        ss << ", " << scalarThroughput / 1.0e6 << " Mpixel/s (scalar)";
+    }
+    ss << std::endl;
+    return ss.str();
+}//end generateSamplingReport
+
+std::string CreateStainVectorProfile::generateRegionReport(const std::vector<size_t> &numRegions,
+    const std::vector<int> &levels, const std::vector<double> &errors, const int numGroupsMeasured, const int numGroupsReused) const {
+    std::ostringstream ss;
+    ss << "Stain regions" << std::endl;
+    for (size_t j = 0; (j < numRegions.size()) && (j < levels.size()) && (j < errors.size()); j++) {
+        ss << "Stain " << (j + 1) << " (" << numRegions[j] << ((numRegions[j] == 1) ? " region): " : " regions): ");
+        if (levels[j] < 0) {
+            ss << "could not be measured" << std::endl;
+        }
+        else if (levels[j] == 0) {
+            ss << "measured at full resolution" << std::endl;
+        }
+        else {
+            ss << "measured at level " << levels[j] << ", estimated error "
+                << std::fixed << std::setprecision(2) << errors[j] << " degrees" << std::endl;
+        }
+    }
+    if (numGroupsReused > 0) {
+        ss << "Region groups read: " << numGroupsMeasured << ", reused from earlier runs: " << numGroupsReused << std::endl;
+    }
+    return ss.str();
+}//end generateRegionReport
+
+std::string CreateStainVectorProfile::generateAutoSampleReport(const long int numPixels, const long int maxPixels,
+    const double precision, const double targetPrecision) const {
+    std::ostringstream ss;
+    ss << "Automatic sample size" << std::endl;
+    ss << "Final sample: " << numPixels << " pixels (largest allowed: " << maxPixels << ")" << std::endl;
+    if (precision < 0.0) {
+        ss << "Precision could not be estimated: too few pixels above the threshold" << std::endl;
+    }
+    else {
+        ss << "Precision (95% bootstrap bound): " << std::fixed << std::setprecision(2) << precision << " degrees";
+        ss << ((precision < targetPrecision) ? "" : ", target not reached") << std::endl;
+    }
+    return ss.str();
+}//end generateAutoSampleReport
+
+std::string CreateStainVectorProfile::generateLatencyReport(const image::LatencyPlanner::Plan &thePlan,
+    const double budgetSeconds, const double actualSeconds) const {
+    std::ostringstream ss;
+    ss << "Time budget plan" << std::endl;
+    ss << "Level " << thePlan.level << ", " << thePlan.sampleSize << " pixels, " << thePlan.numHistogramBins << " histogram bins" << std::endl;
+    ss << std::fixed << std::setprecision(2);
+    ss << "Predicted time: " << thePlan.predictedSeconds << " s, actual: " << actualSeconds << " s, budget: " << budgetSeconds << " s";
+    ss << (thePlan.fitsBudget ? "" : " (no plan was predicted to fit)") << std::endl;
+    return ss.str();
+}//end generateLatencyReport
+
+std::string CreateStainVectorProfile::generateProgressiveReport(const int numEstimates, const long int numPixels,
+    const long int requestedPixels, const double lastChange, const bool converged) const {
+    std::ostringstream ss;
+    ss << "Progressive refinement" << std::endl;
+    ss << "Estimates: " << numEstimates << ", final sample: " << numPixels << " of " << requestedPixels << " pixels" << std::endl;
+    if (numEstimates > 1) {
+        ss << "Last change: " << std::fixed << std::setprecision(2) << lastChange << " degrees";
+        ss << (converged ? " (below the stop angle)" : "") << std::endl;
+    }
+    return ss.str();
+}//end generateProgressiveReport
+
 std::string CreateStainVectorProfile::generateStainProfileReport(std::shared_ptr<StainProfile> theProfile) const
 {
     //I think using assert is a little too strong here. Use different error handling.
@@ -795,6 +1178,85 @@ bool CreateStainVectorProfile::SaveStainProfileToFile() {
     return false;
 }//end SaveStainProfileToFile
 
+std::string CreateStainVectorProfile::getSlideIdentity() {
+    std::ostringstream identity;
+    //The path of the slide file, and its size and modification time so that a replaced file is not mistaken for the original
+    std::string slidePath = image()->getMetaData()->get(image::StringTags::SOURCE_DESCRIPTION, 0);
+    identity << slidePath;
+    std::error_code fileError;
+    auto fileSize = std::filesystem::file_size(slidePath, fileError);
+    if (!fileError) {
+        identity << "|" << fileSize;
+    }
+    auto writeTime = std::filesystem::last_write_time(slidePath, fileError);
+    if (!fileError) {
+        identity << "|" << writeTime.time_since_epoch().count();
+    }
+    //The pyramid dimensions distinguish slides that have no file path
+    auto source_factory = image()->getFactory();
+    for (int level = 0; level < source_factory->getNumLevels(); level++) {
+        auto levelSize = source_factory->getDimensions(level);
+        identity << "|" << levelSize.width() << "x" << levelSize.height();
+    }
+    return identity.str();
+}//end getSlideIdentity
+
+std::string CreateStainVectorProfile::getSampleCacheDirectory() {
+    if (m_cacheSampledPixels == false) { return std::string(); }
+    //A random seed (0) is new on every run, so its samples could never be loaded again
+    int seedParameter = m_randomSeed;
+    if (seedParameter <= 0) { return std::string(); }
+    std::error_code tempError;
+    auto tempDirectory = std::filesystem::temp_directory_path(tempError);
+    if (tempError) { return std::string(); }
+    return (tempDirectory / "CreateStainVectorProfile" / "SampleCache").string();
+}//end getSampleCacheDirectory
+
+std::vector<image::LatencyPlanner::LevelInfo> CreateStainVectorProfile::getPyramidLevels() {
+    std::vector<image::LatencyPlanner::LevelInfo> levels;
+    auto source_factory = image()->getFactory();
+    int numLevels = static_cast<int>(source_factory->getNumLevels());
+    for (int level = 0; level < numLevels; level++) {
+        auto levelSize = source_factory->getDimensions(level);
+        image::LatencyPlanner::LevelInfo info;
+        info.numTiles = static_cast<u64>(source_factory->getNumTiles(level));
+        info.numPixels = static_cast<u64>(levelSize.width()) * static_cast<u64>(levelSize.height());
+        levels.push_back(info);
+    }
+    return levels;
+}//end getPyramidLevels
+
+int CreateStainVectorProfile::getSamplingLevel() {
+    return (m_latencyPlan.level >= 0) ? m_latencyPlan.level : static_cast<int>(m_samplingLevel);
+}//end getSamplingLevel
+
+void CreateStainVectorProfile::recordComputationCosts(const int method,
+    std::shared_ptr<image::StainVectorBase> stainVectorObject, const double seconds) {
+    //Only plain sampled runs are measured: a stream over every pixel or an automatic sample size follow other cost models.
+    //A run that reused a kept sample also reused the stages computed from it, so it does not measure the full cost
+    if ((m_useSubsampleOfPixels == false) || (stainVectorObject->GetTargetPrecision() > 0.0)) { return; }
+    if (!stainVectorObject->GetSamplesWereDrawn()) { return; }
+    double algorithmSeconds = seconds;
+    image::SamplingStatistics stats = stainVectorObject->GetSamplingStatistics();
+    if (!stats.loadedFromCache) {
+        int numThreads = m_numberOfThreads;
+        m_latencyPlanner.RecordSampling(stats.numTilesRead, stats.numPixelsConverted, stats.numPixelsKept,
+            stats.conversionSeconds, stats.elapsedSeconds, numThreads);
+        algorithmSeconds -= stats.elapsedSeconds;
+    }
+    m_latencyPlanner.RecordAlgorithm(method, stainVectorObject->GetNumSamples(), (algorithmSeconds > 0.0) ? algorithmSeconds : 0.0);
+}//end recordComputationCosts
+
+u64 CreateStainVectorProfile::getSamplingSeed() {
+    int seedParameter = m_randomSeed;
+    if (seedParameter > 0) {
+        return static_cast<u64>(seedParameter);
+    }
+    //A seed of 0 requests a new random seed
+    std::random_device randomDevice;
+    return (static_cast<u64>(randomDevice()) << 32) | static_cast<u64>(randomDevice());
+}//end getSamplingSeed
+
 } // namespace algorithm
 } // namespace sedeen
 
@@ -39,12 +39,22 @@
 // Plugin headers
 #include "ColorDeconvolutionKernel.h"
 #include "StainProfile.h"
+#include "LatencyPlanner.h"
 
 namespace sedeen {
 namespace tile {
 
 } // namespace tile
 
+namespace image {
+struct SamplingStatistics;
+class RegionODCache;
+class IntegralODCache;
+class StainVectorBase;
+class StainVectorMacenko;
+class StainVectorNMF;
+} // namespace image
+
 namespace algorithm {
 //#define round(x) ( x >= 0.0f ? floor(x + 0.5f) : ceil(x - 0.5f) )
 
@@ -65,13 +75,22 @@ private:
     //This doesn't work if called from init. It crashes Sedeen.
     //void initialVisibility();
     
-	/// Creates the Color Deconvolution pipeline with a cache
-	//
-	/// \return 
-	/// TRUE if successful, false on error or failure. Error message is placed in pointer to string.
-	bool buildPipeline(std::shared_ptr<StainProfile>, std::shared_ptr<std::string>);
-    /// Test whether the values or states of the UI parameters have changed
-    bool checkParametersChanged(bool);
+	/// Creates the Color Deconvolution pipeline with a cache, from the stain vectors in the profile
+	void buildPipeline(std::shared_ptr<StainProfile>);
+    ///Calculate the stain vectors with the chosen separation algorithm and place them in the profile.
+    ///Returns TRUE if successful, false on error or failure. Error message is placed in pointer to string.
+    bool computeStainVectors(std::shared_ptr<StainProfile>, std::shared_ptr<std::string>);
+    ///Calculate the stain vectors from samples of growing size, sending a preview of each estimate to the display, until
+    ///the requested sample size is reached or successive estimates differ by less than the stop angle. Same returns as computeStainVectors.
+    bool computeStainVectorsProgressively(std::shared_ptr<StainProfile>, std::shared_ptr<std::string>);
+    ///Copy the names of the profile and the stains from the UI parameters to the profile
+    void setProfileNames(std::shared_ptr<StainProfile>);
+    /// Test whether any of the UI parameters that determine the stain vectors have changed
+    bool checkComputeParametersChanged();
+    /// Test whether any of the names or output options have changed
+    bool checkMetadataParametersChanged();
+    /// Test whether any of the options of the displayed image have changed
+    bool checkDisplayParametersChanged();
     ///build the pipeline for getting the stain vectors from pixel values within ROIs. Error message is placed in pointer to string.
     bool buildPixelROIPipeline(std::shared_ptr<StainProfile>, std::shared_ptr<std::string>);
     ///build the pipeline for getting the stain vectors from the Macenko method. Error message is placed in pointer to string.
@@ -85,6 +104,20 @@ private:
 	std::string generateStainProfileReport(std::shared_ptr<StainProfile>) const;
     ///Create a text report for the list of parameters from a model or algorithm
     std::string generateParameterMapReport(std::map<std::string, std::string> p) const;
+    ///Create a text report of the pixel conversion counts and speed of the most recent sampling run
+    std::string generateSamplingReport(const image::SamplingStatistics &stats) const;
+    ///Create a text report of the number of regions, pyramid level and estimated error of each stain,
+    ///and of the number of region groups read or reused from previous runs
+    std::string generateRegionReport(const std::vector<size_t> &numRegions, const std::vector<int> &levels,
+        const std::vector<double> &errors, const int numGroupsMeasured, const int numGroupsReused) const;
+    ///Create a text report of the sample size chosen automatically and the precision it reached
+    std::string generateAutoSampleReport(const long int numPixels, const long int maxPixels,
+        const double precision, const double targetPrecision) const;
+    ///Create a text report of a time budget plan: the chosen level, sample size and bin count, and the predicted and actual time
+    std::string generateLatencyReport(const image::LatencyPlanner::Plan &thePlan, const double budgetSeconds, const double actualSeconds) const;
+    ///Create a text report of the progressive refinement: the number of estimates, the final sample size and the last change
+    std::string generateProgressiveReport(const int numEstimates, const long int numPixels, const long int requestedPixels,
+        const double lastChange, const bool converged) const;
 
     ///Define the save file dialog options outside of init
     sedeen::file::FileDialogOptions defineSaveFileDialogOptions();
@@ -92,6 +125,19 @@ private:
     ///Save the stain profile as defined in the parameters to the file in the save file dialog
     bool SaveStainProfileToFile();
 
+    ///Create text identifying the slide for the sample cache: its path, file size and modification time, and dimensions
+    std::string getSlideIdentity();
+    ///Get the directory to cache sampled pixels in, inside the system temporary directory. Empty if caching is off.
+    std::string getSampleCacheDirectory();
+    ///Get the number of tiles and pixels on each level of the image pyramid, for the latency planner
+    std::vector<image::LatencyPlanner::LevelInfo> getPyramidLevels();
+    ///Get the pyramid level to sample: the planned level in time budget mode, otherwise the Resolution level parameter
+    int getSamplingLevel();
+    ///Update the latency planner's cost model from a completed Macenko or NMF computation that took the given time
+    void recordComputationCosts(const int method, std::shared_ptr<image::StainVectorBase> stainVectorObject, const double seconds);
+    ///Get the seed for the pixel sampler from the Random seed parameter, choosing one at random if it is 0
+    u64 getSamplingSeed();
+
 private:
     //Member parameters
     DisplayAreaParameter m_displayArea;
@@ -112,21 +158,59 @@ private:
     ///Order of magnitude for the subsample of pixels
     algorithm::IntegerParameter m_subsamplePixelsMagnitude;
 
+    ///The resolution level to take pixels from (0 is the highest resolution). If useSubsampleOfPixels is False, every pixel on this level is streamed.
+    algorithm::IntegerParameter m_samplingLevel;
+
     ///Set the optical density threshold to omit pixels before computing stain vectors
     algorithm::DoubleParameter m_preComputationThreshold;
 
+    ///The percentile of the angle histogram at which the Macenko method takes the stain directions
+    algorithm::DoubleParameter m_algorithmPercentile;
+    ///The number of bins in the angle histogram of the Macenko method
+    algorithm::IntegerParameter m_algorithmHistogramBins;
+
+    ///If set, the Macenko and NMF methods first compute and display vectors from a small sample, then refine them with larger samples
+    BoolParameter m_progressivePreview;
+    ///Progressive refinement stops when successive estimates differ by less than this angle, in degrees
+    algorithm::DoubleParameter m_progressiveStopAngle;
+
+    ///If set, the Macenko and NMF methods sample in growing batches until the stain vectors reach the target precision
+    BoolParameter m_autoSampleSize;
+    ///The 95% bootstrap bound on the stain vector angles, in degrees, at which an automatic sample stops growing
+    algorithm::DoubleParameter m_autoSamplePrecision;
+
+    ///If set, the Macenko and NMF methods choose the level, sample size and bin count predicted to finish within the time budget
+    BoolParameter m_useTimeBudget;
+    ///The time the Macenko and NMF methods should finish within, in seconds
+    algorithm::DoubleParameter m_timeBudgetSeconds;
+
+    ///The number of threads to use when sampling pixels from the whole slide image
+    algorithm::IntegerParameter m_numberOfThreads;
+
+    ///If set, a low resolution prepass restricts sampling to tiles that contain tissue
+    BoolParameter m_sampleTissueOnly;
+
+    ///If set, the number of pixels to sample counts only pixels above the computation threshold
+    BoolParameter m_countForegroundPixels;
+
+    ///If set, sampled pixels are saved to disk and reloaded by later runs with the same slide and sampling parameters
+    BoolParameter m_cacheSampledPixels;
+
+    ///The seed of the random number streams used to sample pixels (0 chooses a new seed every run)
+    algorithm::IntegerParameter m_randomSeed;
+
+    ///The error allowed in the mean OD direction of a stain region, in degrees, when choosing the resolution to measure it at
+    algorithm::DoubleParameter m_regionAngleTolerance;
+
     //Stain One
     TextFieldParameter m_nameOfStainOne;
-    //RegionListParameter m_regionListStainOne;
-	GraphicItemParameter m_regionStainOne;
+    RegionListParameter m_regionListStainOne;
     //Stain Two
     TextFieldParameter m_nameOfStainTwo;
-    //RegionListParameter m_regionListStainTwo;
-	GraphicItemParameter m_regionStainTwo;
+    RegionListParameter m_regionListStainTwo;
     //Stain Three
     TextFieldParameter m_nameOfStainThree;
-    //RegionListParameter m_regionListStainThree;
-	GraphicItemParameter m_regionStainThree;
+    RegionListParameter m_regionListStainThree;
 
     OptionParameter m_stainToDisplay;
     BoolParameter m_applyDisplayThreshold;
@@ -143,6 +227,19 @@ private:
 
 	/// The intermediate image factory after color deconvolution
 	std::shared_ptr<image::tile::Factory> m_colorDeconvolution_factory;
+    ///Whether the stain profile holds stain vectors computed from the current parameters
+    bool m_stainVectorsComputed;
+
+    ///OD sums of the stain regions, kept between runs so that only the regions that moved are read again
+    std::shared_ptr<image::RegionODCache> m_regionODCache;
+    ///Integral OD tables of the tiles under rectangular stain regions, so that editing a rectangle reads no pixels
+    std::shared_ptr<image::IntegralODCache> m_integralODCache;
+    ///The Macenko and NMF objects, kept between runs so that a parameter change repeats only the stages it affects
+    std::shared_ptr<image::StainVectorMacenko> m_stainVectorMacenko;
+    std::shared_ptr<image::StainVectorNMF> m_stainVectorNMF;
+    ///The cost model learned from the runs of this plugin, and the plan of the current run (level -1 outside time budget mode)
+    image::LatencyPlanner m_latencyPlanner;
+    image::LatencyPlanner::Plan m_latencyPlan;
 
 private:
     //Member variables
@@ -160,6 +257,10 @@ private:
     const double m_algorithmPercentileDefaultVal;
     const int    m_algorithmHistogramBinsDefaultVal;
 
+    ///The sample size of the first progressive estimate, and the factor by which each refinement grows it
+    const long int m_progressivePilotSampleSize;
+    const int      m_progressiveGrowthFactor;
+
     ///The stain vector profile and its XML file handling
     std::shared_ptr<StainProfile> m_localStainProfile;
     ///Returns the shared_ptr to the local stain profile
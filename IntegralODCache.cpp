@@ -0,0 +1,163 @@
+/*=============================================================================
+ *
+ *  Copyright (c) 2020 Sunnybrook Research Institute
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ *
+ *=============================================================================*/
+
+#include "IntegralODCache.h"
+
+#include "ODConversion.h"
+#include "TileWalker.h"
+
+#include <type_traits>
+
+namespace sedeen {
+namespace image {
+
+IntegralODTile::IntegralODTile(const RawImage &tile)
+    : m_width(0), m_height(0), m_table()
+{
+    if (tile.isNull()) { return; }
+    const int width = tile.size().width();
+    const int height = tile.size().height();
+    if ((width <= 0) || (height <= 0)) { return; }
+    m_width = width;
+    m_height = height;
+    const size_t stride = static_cast<size_t>(width + 1) * NumValues;
+    //Row 0 and column 0 stay zero
+    m_table.assign(stride * static_cast<size_t>(height + 1), 0.0);
+
+    //Each entry is the entry above plus the running sum of its row
+    auto addRow = [this, stride, width](const int y, auto &&getOD) {
+        double rowSum[NumValues] = { 0.0 };
+        const double *above = &m_table[static_cast<size_t>(y) * stride];
+        double *entry = &m_table[static_cast<size_t>(y + 1) * stride];
+        for (int x = 0; x < width; x++) {
+            double od[3];
+            getOD(x, od);
+            for (int c = 0; c < 3; c++) {
+                rowSum[c] += od[c];
+                rowSum[3 + c] += od[c] * od[c];
+            }
+            for (int k = 0; k < NumValues; k++) {
+                entry[(x + 1) * NumValues + k] = above[(x + 1) * NumValues + k] + rowSum[k];
+            }
+        }
+    };
+    bool walked = VisitTilePixels(tile, [&](const auto &walker) {
+        const double *odTable = GetODLookupTableFor<typename std::decay<decltype(walker)>::type::Value>();
+        for (int y = 0; y < height; y++) {
+            const size_t rowStart = static_cast<size_t>(y) * static_cast<size_t>(width);
+            addRow(y, [&](const int x, double(&od)[3]) {
+                od[0] = odTable[walker.R(rowStart + x)];
+                od[1] = odTable[walker.G(rowStart + x)];
+                od[2] = odTable[walker.B(rowStart + x)];
+            });
+        }
+    });
+    if (walked) { return; }
+
+    //Perform fast color to OD conversion using a lookup table
+    std::shared_ptr<ODConversion> converter = std::make_shared<ODConversion>();
+    for (int y = 0; y < height; y++) {
+        addRow(y, [&](const int x, double(&od)[3]) {
+            for (int c = 0; c < 3; c++) {
+                od[c] = converter->LookupRGBtoOD(tile.at(x, y, c).as<int>());
+            }
+        });
+    }
+}//end constructor
+
+IntegralODTile::~IntegralODTile() {
+}//end destructor
+
+size_t IntegralODTile::GetNumBytesFor(const int width, const int height) {
+    if ((width <= 0) || (height <= 0)) { return 0; }
+    return static_cast<size_t>(width + 1) * static_cast<size_t>(height + 1) * NumValues * sizeof(double);
+}//end GetNumBytesFor
+
+long int IntegralODTile::AddRectMoments(const Rect &rect, double(&odSum)[3], double(&odSumSq)[3]) const {
+    if (!this->IsValid()) { return 0; }
+    int x0 = (rect.x() > 0) ? rect.x() : 0;
+    int y0 = (rect.y() > 0) ? rect.y() : 0;
+    int x1 = ((rect.x() + rect.width()) < m_width) ? (rect.x() + rect.width()) : m_width;
+    int y1 = ((rect.y() + rect.height()) < m_height) ? (rect.y() + rect.height()) : m_height;
+    if ((x1 <= x0) || (y1 <= y0)) { return 0; }
+    const size_t stride = static_cast<size_t>(m_width + 1) * NumValues;
+    const double *top = &m_table[static_cast<size_t>(y0) * stride];
+    const double *bottom = &m_table[static_cast<size_t>(y1) * stride];
+    double sums[NumValues];
+    for (int k = 0; k < NumValues; k++) {
+        sums[k] = bottom[x1 * NumValues + k] - bottom[x0 * NumValues + k] - top[x1 * NumValues + k] + top[x0 * NumValues + k];
+    }
+    for (int c = 0; c < 3; c++) {
+        odSum[c] += sums[c];
+        odSumSq[c] += sums[3 + c];
+    }
+    return static_cast<long int>(x1 - x0) * static_cast<long int>(y1 - y0);
+}//end AddRectMoments
+
+IntegralODCache::IntegralODCache(const size_t byteBudget /* = 128 * 1024 * 1024 */)
+    : m_useList(), m_index(), m_numBytes(0), m_byteBudget(byteBudget)
+{}//end constructor
+
+IntegralODCache::~IntegralODCache() {
+}//end destructor
+
+std::shared_ptr<const IntegralODTile> IntegralODCache::Find(const int level, const int column, const int row) {
+    auto it = m_index.find(TileKey(level, column, row));
+    if (it == m_index.end()) { return nullptr; }
+    //Move to the front of the use list
+    m_useList.splice(m_useList.begin(), m_useList, it->second);
+    return it->second->second;
+}//end Find
+
+void IntegralODCache::Insert(const int level, const int column, const int row, std::shared_ptr<const IntegralODTile> tile) {
+    if ((tile == nullptr) || !tile->IsValid()) { return; }
+    TileKey key(level, column, row);
+    auto it = m_index.find(key);
+    if (it != m_index.end()) {
+        m_numBytes -= it->second->second->GetNumBytes();
+        m_useList.erase(it->second);
+        m_index.erase(it);
+    }
+    m_useList.push_front(std::make_pair(key, tile));
+    m_index[key] = m_useList.begin();
+    m_numBytes += tile->GetNumBytes();
+    this->DropToBudget();
+}//end Insert
+
+void IntegralODCache::Clear() {
+    m_useList.clear();
+    m_index.clear();
+    m_numBytes = 0;
+}//end Clear
+
+void IntegralODCache::DropToBudget() {
+    while (!m_useList.empty() && (m_numBytes > m_byteBudget)) {
+        m_numBytes -= m_useList.back().second->GetNumBytes();
+        m_index.erase(m_useList.back().first);
+        m_useList.pop_back();
+    }
+}//end DropToBudget
+
+} // namespace image
+} // namespace sedeen
@@ -0,0 +1,112 @@
+/*=============================================================================
+ *
+ *  Copyright (c) 2020 Sunnybrook Research Institute
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ *
+ *=============================================================================*/
+
+#ifndef SEDEEN_SRC_FILTER_INTEGRALODCACHE_H
+#define SEDEEN_SRC_FILTER_INTEGRALODCACHE_H
+
+#include "Global.h"
+#include "Geometry.h"
+#include "Image.h"
+
+#include <list>
+#include <map>
+#include <memory>
+#include <tuple>
+#include <vector>
+
+namespace sedeen {
+namespace image {
+
+///Summed-area tables of the optical density of each channel of a tile, and of its square.
+///The sums over any rectangle of the tile take four lookups per value, however large the rectangle.
+class PATHCORE_IMAGE_API IntegralODTile {
+public:
+    ///Convert every pixel of the tile to optical density and build the tables
+    IntegralODTile(const RawImage &tile);
+    virtual ~IntegralODTile();
+
+    ///Get whether the tables were built
+    inline const bool IsValid() const { return !m_table.empty(); }
+    ///Get the tile width, in pixels
+    inline const int GetWidth() const { return m_width; }
+    ///Get the tile height, in pixels
+    inline const int GetHeight() const { return m_height; }
+    ///Get the memory held by the tables, in bytes
+    inline const size_t GetNumBytes() const { return m_table.size() * sizeof(double); }
+    ///Get the memory held by the tables of a tile of the given size, in bytes
+    static size_t GetNumBytesFor(const int width, const int height);
+
+    ///Add the OD sums, and sums of squares, of the pixels of a rectangle (in tile coordinates, clipped to the tile)
+    ///to odSum and odSumSq. Returns the number of pixels added
+    long int AddRectMoments(const Rect &rect, double(&odSum)[3], double(&odSumSq)[3]) const;
+
+private:
+    ///The number of values summed per pixel: the OD of R, G, B and their squares
+    static const int NumValues = 6;
+
+private:
+    int m_width;
+    int m_height;
+    ///(m_width + 1) x (m_height + 1) entries of NumValues sums each; entry (x, y) holds the sums over [0, x) x [0, y)
+    std::vector<double> m_table;
+};
+
+///Keeps the integral OD tables of recently used tiles within a memory budget, dropping the least recently used
+class PATHCORE_IMAGE_API IntegralODCache {
+public:
+    IntegralODCache(const size_t byteBudget = 128 * 1024 * 1024);
+    virtual ~IntegralODCache();
+
+    ///Get the tables of the tile at a column and row of a level, or null if they are not kept
+    std::shared_ptr<const IntegralODTile> Find(const int level, const int column, const int row);
+    ///Keep the tables of the tile at a column and row of a level, dropping the least recently used tables over the budget
+    void Insert(const int level, const int column, const int row, std::shared_ptr<const IntegralODTile> tile);
+    ///Drop all tables
+    void Clear();
+
+    ///Get the memory held by the kept tables, in bytes
+    inline const size_t GetNumBytes() const { return m_numBytes; }
+    ///Get/Set the most memory the kept tables may hold, in bytes
+    inline const size_t GetByteBudget() const { return m_byteBudget; }
+    ///Get/Set the most memory the kept tables may hold, in bytes
+    inline void SetByteBudget(const size_t b) { m_byteBudget = b; this->DropToBudget(); }
+
+private:
+    ///Drop the least recently used tables until the kept tables fit the budget
+    void DropToBudget();
+
+private:
+    ///Tiles are identified by level, column and row
+    typedef std::tuple<int, int, int> TileKey;
+    typedef std::list<std::pair<TileKey, std::shared_ptr<const IntegralODTile>>> UseList;
+    ///Tables from most to least recently used
+    UseList m_useList;
+    std::map<TileKey, UseList::iterator> m_index;
+    size_t m_numBytes;
+    size_t m_byteBudget;
+};
+
+} // namespace image
+} // namespace sedeen
+#endif
@@ -0,0 +1,151 @@
+/*=============================================================================
+ *
+ *  Copyright (c) 2020 Sunnybrook Research Institute
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ *
+ *=============================================================================*/
+
+#include "LatencyPlanner.h"
+
+#include <cmath>
+
+namespace sedeen {
+namespace image {
+
+namespace {
+//Initial costs, used until runs have been measured: a tile decode of a few milliseconds,
+//a few nanoseconds per pixel converted (vectorized), and a few hundred nanoseconds per sample for the algorithm
+const double DefaultSecondsPerTile = 5.0e-3;
+const double DefaultSecondsPerPixel = 5.0e-9;
+const double DefaultAcceptanceRate = 0.5;
+const double DefaultSecondsPerSample = 5.0e-7;
+} // namespace
+
+LatencyPlanner::LatencyPlanner()
+    : m_secondsPerTile(DefaultSecondsPerTile),
+    m_secondsPerPixel(DefaultSecondsPerPixel),
+    m_acceptanceRate(DefaultAcceptanceRate),
+    m_secondsPerSample(),
+    m_smoothing(0.5)
+{
+}//end constructor
+
+LatencyPlanner::~LatencyPlanner(void) {
+}//end destructor
+
+LatencyPlanner::Plan LatencyPlanner::MakePlan(const std::vector<LevelInfo> &levels, const double budgetSeconds,
+    const int method, const std::int64_t maxSampleSize, const int maxHistogramBins) const {
+    Plan thePlan;
+    if (levels.empty() || (maxSampleSize <= 0)) { return thePlan; }
+
+    //Candidate sample sizes, largest first: maxSampleSize, then 5, 2 and 1 times powers of ten below it
+    std::vector<std::int64_t> sampleSizes(1, maxSampleSize);
+    for (double decade = std::pow(10.0, std::floor(std::log10(static_cast<double>(maxSampleSize)))); decade >= 1.0; decade /= 10.0) {
+        const double multiples[3] = { 5.0, 2.0, 1.0 };
+        for (int m = 0; m < 3; m++) {
+            std::int64_t size = static_cast<std::int64_t>(multiples[m] * decade);
+            if ((size < maxSampleSize) && (size >= MinPlanSampleSize)) {
+                sampleSizes.push_back(size);
+            }
+        }
+    }
+
+    //The largest size that fits at some level, at the finest such level. A level cannot give more pixels than it has
+    for (auto size = sampleSizes.begin(); (size != sampleSizes.end()) && (thePlan.level < 0); ++size) {
+        for (int level = 0; level < static_cast<int>(levels.size()); level++) {
+            if (static_cast<std::uint64_t>(*size) > levels[level].numPixels) { continue; }
+            double seconds = this->PredictSeconds(levels[level], method, *size);
+            if (seconds <= budgetSeconds) {
+                thePlan.level = level;
+                thePlan.sampleSize = *size;
+                thePlan.predictedSeconds = seconds;
+                thePlan.fitsBudget = true;
+                break;
+            }
+        }
+    }
+    //Nothing fits: the smallest sample at the coarsest level is the fastest plan
+    if (thePlan.level < 0) {
+        thePlan.level = static_cast<int>(levels.size()) - 1;
+        std::int64_t size = sampleSizes.back();
+        std::uint64_t levelPixels = levels[thePlan.level].numPixels;
+        thePlan.sampleSize = (static_cast<std::uint64_t>(size) < levelPixels) ? size : static_cast<std::int64_t>(levelPixels);
+        thePlan.predictedSeconds = this->PredictSeconds(levels[thePlan.level], method, thePlan.sampleSize);
+        thePlan.fitsBudget = false;
+    }
+
+    //A histogram with more bins than about twice the cube root of the samples is mostly noise (the Rice rule)
+    double expectedSamples = static_cast<double>(thePlan.sampleSize) * m_acceptanceRate;
+    int bins = static_cast<int>(std::ceil(2.0 * std::cbrt(expectedSamples)));
+    bins = (bins < MinPlanHistogramBins) ? MinPlanHistogramBins : bins;
+    thePlan.numHistogramBins = (bins < maxHistogramBins) ? bins : maxHistogramBins;
+    return thePlan;
+}//end MakePlan
+
+double LatencyPlanner::PredictSeconds(const LevelInfo &level, const int method, const std::int64_t sampleSize) const {
+    if ((sampleSize <= 0) || (level.numTiles == 0)) { return 0.0; }
+    double numCandidates = static_cast<double>(sampleSize);
+    double numTiles = static_cast<double>(level.numTiles);
+    //Candidates are spread over the tiles at random, so the expected number of tiles holding at least one is T(1 - exp(-n/T))
+    double tilesRead = numTiles * (1.0 - std::exp(-numCandidates / numTiles));
+    double numSamples = numCandidates * m_acceptanceRate;
+    return tilesRead * m_secondsPerTile + numCandidates * m_secondsPerPixel
+        + numSamples * this->GetSecondsPerSample(method);
+}//end PredictSeconds
+
+void LatencyPlanner::RecordSampling(const std::uint64_t numTilesRead, const std::uint64_t numPixelsConverted,
+    const std::uint64_t numPixelsKept, const double conversionSeconds, const double elapsedSeconds, const int numThreads) {
+    if ((numPixelsConverted == 0) || (elapsedSeconds <= 0.0)) { return; }
+    const double threads = (numThreads > 0) ? static_cast<double>(numThreads) : 1.0;
+    //Conversion runs on all the threads at once, so its wall-clock share is the summed time over the threads
+    double conversionWallSeconds = conversionSeconds / threads;
+    if (conversionWallSeconds > elapsedSeconds) { conversionWallSeconds = elapsedSeconds; }
+    m_secondsPerPixel = this->Blend(m_secondsPerPixel, conversionWallSeconds / static_cast<double>(numPixelsConverted));
+    //The rest of the wall-clock time is attributed to reading tiles (and the tissue prepass)
+    if (numTilesRead > 0) {
+        m_secondsPerTile = this->Blend(m_secondsPerTile, (elapsedSeconds - conversionWallSeconds) / static_cast<double>(numTilesRead));
+    }
+    m_acceptanceRate = this->Blend(m_acceptanceRate, static_cast<double>(numPixelsKept) / static_cast<double>(numPixelsConverted));
+}//end RecordSampling
+
+void LatencyPlanner::RecordAlgorithm(const int method, const std::uint64_t numSamples, const double seconds) {
+    if ((numSamples == 0) || (seconds < 0.0)) { return; }
+    double measurement = seconds / static_cast<double>(numSamples);
+    auto it = m_secondsPerSample.find(method);
+    if (it == m_secondsPerSample.end()) {
+        //The first measurement of a method replaces the default outright
+        m_secondsPerSample[method] = measurement;
+    }
+    else {
+        it->second = this->Blend(it->second, measurement);
+    }
+}//end RecordAlgorithm
+
+const double LatencyPlanner::GetSecondsPerSample(const int method) const {
+    auto it = m_secondsPerSample.find(method);
+    return (it != m_secondsPerSample.end()) ? it->second : DefaultSecondsPerSample;
+}//end GetSecondsPerSample
+
+double LatencyPlanner::Blend(const double average, const double measurement) const {
+    return (1.0 - m_smoothing) * average + m_smoothing * measurement;
+}//end Blend
+
+} // namespace image
+} // namespace sedeen
@@ -0,0 +1,114 @@
+/*=============================================================================
+ *
+ *  Copyright (c) 2020 Sunnybrook Research Institute
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ *
+ *=============================================================================*/
+
+#ifndef SEDEEN_SRC_FILTER_LATENCYPLANNER_H
+#define SEDEEN_SRC_FILTER_LATENCYPLANNER_H
+
+#include <cstdint>
+#include <map>
+#include <vector>
+
+namespace sedeen {
+namespace image {
+
+///A cost model of sampling pixels and computing stain vectors, learned from measured runs, and a planner that uses it
+///to choose the pyramid level, sample size and histogram bin count that should finish within a time budget.
+///Sampling time is modelled as a cost per tile read plus a cost per candidate pixel converted, and the algorithm time
+///as a cost per sample for each separation method. Each measurement updates the costs by an exponentially weighted average.
+class LatencyPlanner {
+public:
+    ///The size of one pyramid level
+    struct LevelInfo {
+        std::uint64_t numTiles;
+        std::uint64_t numPixels;
+    };
+    ///A sampling plan and its predicted time
+    struct Plan {
+        Plan() : level(-1), sampleSize(0), numHistogramBins(0), predictedSeconds(0.0), fitsBudget(false) {}
+        ///The pyramid level to sample (-1 if no plan could be made)
+        int level;
+        ///The number of candidate pixels to draw
+        std::int64_t sampleSize;
+        ///The number of bins of the angle histogram
+        int numHistogramBins;
+        ///The predicted time of sampling and computation
+        double predictedSeconds;
+        ///Whether the predicted time is within the budget (false if even the smallest plan is predicted to take longer)
+        bool fitsBudget;
+    };
+
+    ///The smallest sample size a plan uses
+    static const std::int64_t MinPlanSampleSize = 1000;
+    ///The smallest number of histogram bins a plan uses
+    static const int MinPlanHistogramBins = 64;
+
+public:
+    LatencyPlanner();
+    virtual ~LatencyPlanner();
+
+    ///Choose the largest sample, at the finest level holding it, whose predicted time fits the budget.
+    ///Sample sizes are 1, 2 or 5 times a power of ten up to maxSampleSize. The bin count grows with the
+    ///expected number of samples above the threshold (twice its cube root), up to maxHistogramBins
+    Plan MakePlan(const std::vector<LevelInfo> &levels, const double budgetSeconds, const int method,
+        const std::int64_t maxSampleSize, const int maxHistogramBins) const;
+    ///Predict the time to sample and compute stain vectors from sampleSize candidates on a level
+    double PredictSeconds(const LevelInfo &level, const int method, const std::int64_t sampleSize) const;
+
+    ///Update the sampling costs from a sampling call: the tiles read, candidates converted, the conversion time summed
+    ///over numThreads worker threads, and the wall-clock time of the call
+    void RecordSampling(const std::uint64_t numTilesRead, const std::uint64_t numPixelsConverted, const std::uint64_t numPixelsKept,
+        const double conversionSeconds, const double elapsedSeconds, const int numThreads);
+    ///Update the algorithm cost of a method from the time it took to compute stain vectors from numSamples samples
+    void RecordAlgorithm(const int method, const std::uint64_t numSamples, const double seconds);
+
+    ///Get the modelled wall-clock cost of reading one tile, in seconds
+    inline const double GetSecondsPerTile() const { return m_secondsPerTile; }
+    ///Get the modelled wall-clock cost of converting one candidate pixel, in seconds
+    inline const double GetSecondsPerPixel() const { return m_secondsPerPixel; }
+    ///Get the modelled fraction of candidate pixels above the threshold
+    inline const double GetAcceptanceRate() const { return m_acceptanceRate; }
+    ///Get the modelled cost of a method per sample, in seconds
+    const double GetSecondsPerSample(const int method) const;
+
+    ///Get/Set the weight of a new measurement in the running averages (between 0 and 1)
+    inline const double GetSmoothing() const { return m_smoothing; }
+    ///Get/Set the weight of a new measurement in the running averages (between 0 and 1)
+    inline void SetSmoothing(const double s) { m_smoothing = (s < 0.0) ? 0.0 : ((s > 1.0) ? 1.0 : s); }
+
+private:
+    ///Blend a measurement into a running average
+    double Blend(const double average, const double measurement) const;
+
+private:
+    double m_secondsPerTile;
+    double m_secondsPerPixel;
+    double m_acceptanceRate;
+    ///The algorithm cost per sample of each method that has been measured
+    std::map<int, double> m_secondsPerSample;
+    double m_smoothing;
+};
+
+} // namespace image
+} // namespace sedeen
+#endif
@@ -57,6 +57,18 @@ bool MacenkoHistogram::PercentileThresholdVectors(cv::InputArray projectedPoints
     cv::Mat theAngleHist;
     FillHistogram(angleVals, theAngleHist);
 
+    return PercentileThresholdVectorsFromHistogram(theAngleHist, percentileThreshPoints);
+}//end PercentileThresholdVectors
+
+bool MacenkoHistogram::PercentileThresholdVectorsFromHistogram(cv::InputArray theAngleHist,
+    cv::OutputArray percentileThreshPoints) {
+    //Check the value of the member variable, return false if it is out of range
+    float threshVal = static_cast<float>(this->GetPercentileThreshold());
+    if ((threshVal <= 0.0) || (threshVal >= 100.0)) {
+        return false;
+    }
+    if (theAngleHist.empty()) { return false; }
+
     std::array<float,2> percentileAngles = FindPercentileThresholdValues(theAngleHist);
     if (percentileAngles.empty()) { return false; }
 
@@ -67,7 +79,7 @@ bool MacenkoHistogram::PercentileThresholdVectors(cv::InputArray projectedPoints
     //Return true on success
     percentileThreshPoints.assign(angToVecOutput);
     return true;
-}//end PercentileThresholdVectors
+}//end PercentileThresholdVectorsFromHistogram
 
 const std::array<float, 2> MacenkoHistogram::FindPercentileThresholdValues(cv::InputArray _theHist) {
     //Return percentile threshold values in the histogram as a 2-element array
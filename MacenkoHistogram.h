@@ -46,6 +46,9 @@ public:
     ///Given a set of 2D vectors (rows), find angle (w/ atan2), histogram, find vectors at hi/lo percentile thresholds
     bool PercentileThresholdVectors(cv::InputArray projectedPoints, cv::OutputArray percentileThreshPoints);
 
+    ///Given an angle histogram with range and nbins set in member variables, find vectors at hi/lo percentile thresholds
+    bool PercentileThresholdVectorsFromHistogram(cv::InputArray theAngleHist, cv::OutputArray percentileThreshPoints);
+
     ///Given a histogram with range and nbins set in member variables, find values at percentile thresholds
     const std::array<float, 2> FindPercentileThresholdValues(cv::InputArray theHist);
 
@@ -0,0 +1,60 @@
+/*=============================================================================
+ *
+ *  Copyright (c) 2020 Sunnybrook Research Institute
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ *
+ *=============================================================================*/
+
+#include "PhiloxRandom.h"
+
+namespace sedeen {
+namespace image {
+
+PhiloxEngine::PhiloxEngine(const std::uint64_t seed /* = 0 */, const std::uint64_t stream /* = 0 */)
+{
+    this->seed(seed, stream);
+}//end constructor
+
+void PhiloxEngine::seed(const std::uint64_t seed, const std::uint64_t stream /* = 0 */) {
+    m_seed = seed;
+    m_stream = stream;
+    m_blockCounter = 0;
+    m_buffer[0] = 0;
+    m_buffer[1] = 0;
+    m_bufferPosition = 2;
+}//end seed
+
+void PhiloxEngine::discard(const std::uint64_t n) {
+    //Use the values left in the buffer first, then jump the block counter
+    std::uint64_t remaining = n;
+    while ((remaining > 0) && (m_bufferPosition < 2)) {
+        m_bufferPosition++;
+        remaining--;
+    }
+    if (remaining == 0) { return; }
+    m_blockCounter += remaining / 2;
+    if (remaining % 2 == 1) {
+        this->GenerateBlock();
+        m_bufferPosition = 1;
+    }
+}//end discard
+
+} // namespace image
+} // namespace sedeen
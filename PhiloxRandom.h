@@ -0,0 +1,115 @@
+/*=============================================================================
+ *
+ *  Copyright (c) 2020 Sunnybrook Research Institute
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ *
+ *=============================================================================*/
+
+#ifndef SEDEEN_SRC_FILTER_PHILOXRANDOM_H
+#define SEDEEN_SRC_FILTER_PHILOXRANDOM_H
+
+#include <cstdint>
+
+namespace sedeen {
+namespace image {
+
+///A counter-based random number engine (Philox4x32-10, Salmon et al. 2011), usable with the standard distributions.
+///The output is a pure function of the seed, the stream number and the position in the stream, so independent
+///streams for tiles or threads are created in O(1) by number, and engines share no state.
+class PhiloxEngine {
+public:
+    typedef std::uint64_t result_type;
+    static constexpr result_type min() { return 0; }
+    static constexpr result_type max() { return ~static_cast<result_type>(0); }
+
+public:
+    explicit PhiloxEngine(const std::uint64_t seed = 0, const std::uint64_t stream = 0);
+
+    ///Restart the engine at the beginning of a stream of a seed
+    void seed(const std::uint64_t seed, const std::uint64_t stream = 0);
+    ///Skip ahead n values in O(1)
+    void discard(const std::uint64_t n);
+    ///Create an engine at the beginning of another stream of the same seed
+    inline PhiloxEngine Split(const std::uint64_t stream) const { return PhiloxEngine(m_seed, stream); }
+
+    ///Get the seed (the Philox key)
+    inline const std::uint64_t GetSeed() const { return m_seed; }
+    ///Get the stream number
+    inline const std::uint64_t GetStream() const { return m_stream; }
+
+    ///The next 64-bit value in the stream
+    inline result_type operator()() {
+        if (m_bufferPosition >= 2) {
+            this->GenerateBlock();
+        }
+        return m_buffer[m_bufferPosition++];
+    }
+
+    ///Encrypt a 128-bit counter with a 64-bit key: ten Philox4x32 rounds
+    static inline void PhiloxBlock(const std::uint32_t (&counter)[4], const std::uint32_t (&key)[2], std::uint32_t (&output)[4]) {
+        std::uint32_t c0 = counter[0], c1 = counter[1], c2 = counter[2], c3 = counter[3];
+        std::uint32_t k0 = key[0], k1 = key[1];
+        for (int round = 0; round < 10; round++) {
+            if (round > 0) {
+                k0 += 0x9E3779B9; //golden ratio
+                k1 += 0xBB67AE85; //sqrt(3)-1
+            }
+            std::uint64_t product0 = static_cast<std::uint64_t>(0xD2511F53) * c0;
+            std::uint64_t product1 = static_cast<std::uint64_t>(0xCD9E8D57) * c2;
+            std::uint32_t hi0 = static_cast<std::uint32_t>(product0 >> 32), lo0 = static_cast<std::uint32_t>(product0);
+            std::uint32_t hi1 = static_cast<std::uint32_t>(product1 >> 32), lo1 = static_cast<std::uint32_t>(product1);
+            c0 = hi1 ^ c1 ^ k0;
+            c1 = lo1;
+            c2 = hi0 ^ c3 ^ k1;
+            c3 = lo0;
+        }
+        output[0] = c0;
+        output[1] = c1;
+        output[2] = c2;
+        output[3] = c3;
+    }
+
+private:
+    ///Encrypt the current block counter to refill the buffer, then advance the counter
+    inline void GenerateBlock() {
+        const std::uint32_t counter[4] = { static_cast<std::uint32_t>(m_blockCounter), static_cast<std::uint32_t>(m_blockCounter >> 32),
+            static_cast<std::uint32_t>(m_stream), static_cast<std::uint32_t>(m_stream >> 32) };
+        const std::uint32_t key[2] = { static_cast<std::uint32_t>(m_seed), static_cast<std::uint32_t>(m_seed >> 32) };
+        std::uint32_t block[4];
+        PhiloxBlock(counter, key, block);
+        m_buffer[0] = (static_cast<std::uint64_t>(block[1]) << 32) | block[0];
+        m_buffer[1] = (static_cast<std::uint64_t>(block[3]) << 32) | block[2];
+        m_bufferPosition = 0;
+        m_blockCounter++;
+    }
+
+private:
+    std::uint64_t m_seed;
+    std::uint64_t m_stream;
+    ///The counter of the next block to generate (each block gives two 64-bit values)
+    std::uint64_t m_blockCounter;
+    std::uint64_t m_buffer[2];
+    ///The position of the next value in the buffer; 2 when the buffer is used up
+    int m_bufferPosition;
+};
+
+} // namespace image
+} // namespace sedeen
+#endif
@@ -0,0 +1,487 @@
+/*=============================================================================
+ *
+ *  Copyright (c) 2020 Sunnybrook Research Institute
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ *
+ *=============================================================================*/
+
+#include "RGBSampleStore.h"
+
+#include "ODConversion.h"
+
+#include <algorithm>
+#include <array>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <unistd.h>
+#endif
+
+namespace sedeen {
+namespace image {
+
+///A temporary file that chunks are mapped from. The file is deleted when it is closed.
+class RGBSampleStore::SpillFile {
+public:
+    SpillFile(const std::string &directory);
+    ~SpillFile();
+
+    ///Check whether the file was created
+    bool IsOpen() const;
+    ///Extend the file by numBytes and map the new region. numBytes must be a multiple of the mapping granularity. Returns nullptr on failure.
+    u8* MapNewRegion(const size_t numBytes);
+
+private:
+#ifdef _WIN32
+    HANDLE m_file;
+#else
+    int m_file;
+#endif
+    u64 m_fileSize;
+    ///The mapped regions and their sizes, unmapped when the file is closed
+    std::vector<std::pair<void*, size_t>> m_views;
+};
+
+#ifdef _WIN32
+RGBSampleStore::SpillFile::SpillFile(const std::string &directory)
+    : m_file(INVALID_HANDLE_VALUE), m_fileSize(0)
+{
+    std::string dir = directory;
+    if (dir.empty()) {
+        char tempPath[MAX_PATH + 1];
+        DWORD pathLength = GetTempPathA(MAX_PATH + 1, tempPath);
+        dir = ((pathLength > 0) && (pathLength <= MAX_PATH)) ? std::string(tempPath) : std::string(".");
+    }
+    char fileName[MAX_PATH + 1];
+    if (GetTempFileNameA(dir.c_str(), "rgb", 0, fileName) == 0) { return; }
+    m_file = CreateFileA(fileName, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+        FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, NULL);
+}//end constructor
+
+RGBSampleStore::SpillFile::~SpillFile() {
+    for (auto it = m_views.begin(); it != m_views.end(); ++it) {
+        UnmapViewOfFile(it->first);
+    }
+    if (m_file != INVALID_HANDLE_VALUE) {
+        CloseHandle(m_file);
+    }
+}//end destructor
+
+bool RGBSampleStore::SpillFile::IsOpen() const {
+    return (m_file != INVALID_HANDLE_VALUE);
+}//end IsOpen
+
+u8* RGBSampleStore::SpillFile::MapNewRegion(const size_t numBytes) {
+    if (!this->IsOpen()) { return nullptr; }
+    u64 newSize = m_fileSize + static_cast<u64>(numBytes);
+    //Creating a mapping larger than the file extends the file
+    HANDLE mapping = CreateFileMappingA(m_file, NULL, PAGE_READWRITE,
+        static_cast<DWORD>(newSize >> 32), static_cast<DWORD>(newSize & 0xFFFFFFFF), NULL);
+    if (mapping == NULL) { return nullptr; }
+    void *view = MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS,
+        static_cast<DWORD>(m_fileSize >> 32), static_cast<DWORD>(m_fileSize & 0xFFFFFFFF), numBytes);
+    //The view keeps the mapping open
+    CloseHandle(mapping);
+    if (view == NULL) { return nullptr; }
+    m_fileSize = newSize;
+    m_views.push_back(std::make_pair(view, numBytes));
+    return static_cast<u8*>(view);
+}//end MapNewRegion
+#else
+RGBSampleStore::SpillFile::SpillFile(const std::string &directory)
+    : m_file(-1), m_fileSize(0)
+{
+    std::string dir = directory;
+    if (dir.empty()) {
+        const char *tempPath = std::getenv("TMPDIR");
+        dir = (tempPath != nullptr) ? std::string(tempPath) : std::string("/tmp");
+    }
+    std::string pattern = dir + "/rgbsamplesXXXXXX";
+    std::vector<char> fileName(pattern.begin(), pattern.end());
+    fileName.push_back('\0');
+    m_file = mkstemp(fileName.data());
+    //Remove the name now, so the file is deleted when it is closed
+    if (m_file >= 0) {
+        unlink(fileName.data());
+    }
+}//end constructor
+
+RGBSampleStore::SpillFile::~SpillFile() {
+    for (auto it = m_views.begin(); it != m_views.end(); ++it) {
+        munmap(it->first, it->second);
+    }
+    if (m_file >= 0) {
+        close(m_file);
+    }
+}//end destructor
+
+bool RGBSampleStore::SpillFile::IsOpen() const {
+    return (m_file >= 0);
+}//end IsOpen
+
+u8* RGBSampleStore::SpillFile::MapNewRegion(const size_t numBytes) {
+    if (!this->IsOpen()) { return nullptr; }
+    u64 newSize = m_fileSize + static_cast<u64>(numBytes);
+    if (ftruncate(m_file, static_cast<off_t>(newSize)) != 0) { return nullptr; }
+    void *view = mmap(nullptr, numBytes, PROT_READ | PROT_WRITE, MAP_SHARED, m_file, static_cast<off_t>(m_fileSize));
+    if (view == MAP_FAILED) { return nullptr; }
+    m_fileSize = newSize;
+    m_views.push_back(std::make_pair(view, numBytes));
+    return static_cast<u8*>(view);
+}//end MapNewRegion
+#endif
+
+RGBSampleStore::RGBSampleStore()
+    : m_numSamples(0),
+    m_numMemoryChunks(0),
+    m_memoryLimit(static_cast<u64>(2) << 30) //2 GiB
+{}//end constructor
+
+RGBSampleStore::~RGBSampleStore(void) {
+}//end destructor
+
+void RGBSampleStore::Clear() {
+    m_chunks.clear();
+    m_chunkFirstSample.clear();
+    m_numSamples = 0;
+    m_numMemoryChunks = 0;
+    m_spillFile.reset();
+    m_splicedSpillFiles.clear();
+}//end Clear
+
+void RGBSampleStore::Reserve(const size_t numSamples) {
+    if (m_chunks.empty()) {
+        this->AddChunk();
+    }
+    Chunk &chunk = m_chunks.back();
+    if (chunk.mapped == nullptr) {
+        chunk.memory.reserve(3 * ((numSamples < ChunkSamples) ? numSamples : ChunkSamples));
+    }
+}//end Reserve
+
+void RGBSampleStore::Resize(const u64 numSamples) {
+    if (numSamples < m_numSamples) {
+        //Drop the chunks past the new end, then shorten the last chunk.
+        //The file regions of dropped chunks are released when the spill file is closed
+        while (!m_chunks.empty() && (m_chunkFirstSample.back() >= numSamples)) {
+            if (m_chunks.back().mapped == nullptr) { m_numMemoryChunks--; }
+            m_chunks.pop_back();
+            m_chunkFirstSample.pop_back();
+        }
+        if (!m_chunks.empty()) {
+            Chunk &chunk = m_chunks.back();
+            chunk.numSamples = static_cast<size_t>(numSamples - m_chunkFirstSample.back());
+            if (chunk.mapped == nullptr) {
+                chunk.memory.resize(3 * chunk.numSamples);
+            }
+        }
+        m_numSamples = numSamples;
+        return;
+    }
+    //Add black samples, a chunk at a time
+    while (m_numSamples < numSamples) {
+        if (m_chunks.empty() || (m_chunks.back().numSamples >= ChunkSamples)) {
+            this->AddChunk();
+        }
+        Chunk &chunk = m_chunks.back();
+        u64 remaining = numSamples - m_numSamples;
+        size_t count = ChunkSamples - chunk.numSamples;
+        count = (remaining < static_cast<u64>(count)) ? static_cast<size_t>(remaining) : count;
+        if (chunk.mapped != nullptr) {
+            std::memset(chunk.mapped + 3 * chunk.numSamples, 0, 3 * count);
+        }
+        else {
+            chunk.memory.resize(3 * (chunk.numSamples + count), 0);
+        }
+        chunk.numSamples += count;
+        m_numSamples += count;
+    }
+}//end Resize
+
+void RGBSampleStore::Append(const u8 *rgb, const size_t numSamples) {
+    size_t remaining = numSamples;
+    while (remaining > 0) {
+        if (m_chunks.empty() || (m_chunks.back().numSamples >= ChunkSamples)) {
+            this->AddChunk();
+        }
+        Chunk &chunk = m_chunks.back();
+        size_t count = ChunkSamples - chunk.numSamples;
+        count = (remaining < count) ? remaining : count;
+        if (chunk.mapped != nullptr) {
+            std::memcpy(chunk.mapped + 3 * chunk.numSamples, rgb, 3 * count);
+        }
+        else {
+            chunk.memory.insert(chunk.memory.end(), rgb, rgb + 3 * count);
+        }
+        chunk.numSamples += count;
+        m_numSamples += count;
+        rgb += 3 * count;
+        remaining -= count;
+    }
+}//end Append (raw values)
+
+void RGBSampleStore::Append(const RGBSampleStore &other) {
+    for (size_t c = 0; c < other.GetNumChunks(); c++) {
+        this->Append(other.GetChunkData(c), other.GetChunkNumSamples(c));
+    }
+}//end Append
+
+void RGBSampleStore::Splice(RGBSampleStore &&other) {
+    if (&other == this) { return; }
+    for (auto it = other.m_chunks.begin(); it != other.m_chunks.end(); ++it) {
+        if (it->numSamples == 0) { continue; }
+        if (it->mapped == nullptr) { m_numMemoryChunks++; }
+        m_chunkFirstSample.push_back(m_numSamples);
+        m_numSamples += it->numSamples;
+        m_chunks.push_back(std::move(*it));
+    }
+    //Keep the other store's spill files open while their chunks are in use
+    if (other.m_spillFile != nullptr) {
+        m_splicedSpillFiles.push_back(other.m_spillFile);
+    }
+    m_splicedSpillFiles.insert(m_splicedSpillFiles.end(),
+        other.m_splicedSpillFiles.begin(), other.m_splicedSpillFiles.end());
+    other.Clear();
+}//end Splice
+
+void RGBSampleStore::CopySample(const u64 index, const RGBSampleStore &other, const u64 otherIndex) {
+    size_t chunk, position, otherChunk, otherPosition;
+    this->LocateSample(index, chunk, position);
+    other.LocateSample(otherIndex, otherChunk, otherPosition);
+    u8 *rgb = (m_chunks[chunk].mapped != nullptr) ? m_chunks[chunk].mapped : m_chunks[chunk].memory.data();
+    const u8 *otherRGB = other.m_chunks[otherChunk].Data();
+    std::memcpy(rgb + 3 * position, otherRGB + 3 * otherPosition, 3);
+}//end CopySample
+
+void RGBSampleStore::AddChunk() {
+    const size_t chunkBytes = 3 * ChunkSamples;
+    Chunk chunk;
+    //Place the chunk in the spill file if another chunk in memory would exceed the memory limit
+    if (static_cast<u64>(m_numMemoryChunks + 1) * static_cast<u64>(chunkBytes) > m_memoryLimit) {
+        if (m_spillFile == nullptr) {
+            m_spillFile = std::make_shared<SpillFile>(m_spillDirectory);
+        }
+        chunk.mapped = m_spillFile->MapNewRegion(chunkBytes);
+    }
+    //If no file region could be mapped, keep the chunk in memory
+    if (chunk.mapped == nullptr) {
+        //The first chunk grows as needed, so that small stores stay small; later chunks are allocated whole
+        if (!m_chunks.empty()) {
+            chunk.memory.reserve(chunkBytes);
+        }
+        m_numMemoryChunks++;
+    }
+    m_chunkFirstSample.push_back(m_numSamples);
+    m_chunks.push_back(std::move(chunk));
+}//end AddChunk
+
+void RGBSampleStore::LocateSample(const u64 index, size_t &chunk, size_t &position) const {
+    //The last chunk starting at or before the index (empty chunks share the start of the next chunk)
+    auto it = std::upper_bound(m_chunkFirstSample.begin(), m_chunkFirstSample.end(), index);
+    chunk = static_cast<size_t>(it - m_chunkFirstSample.begin()) - 1;
+    position = static_cast<size_t>(index - m_chunkFirstSample[chunk]);
+}//end LocateSample
+
+bool RGBSampleStore::WriteNPY(const std::string &filePath) const {
+    std::ofstream outFile(filePath, std::ios::out | std::ios::binary | std::ios::trunc);
+    if (!outFile.is_open()) { return false; }
+    //Format version 1.0 header: a Python dict literal, padded with spaces and a newline so the data is 64-byte aligned
+    std::ostringstream headerDict;
+    headerDict << "{'descr': '|u1', 'fortran_order': False, 'shape': (" << this->GetNumSamples() << ", 3), }";
+    std::string header = headerDict.str();
+    const size_t preambleSize = 10; //magic string (6), version (2), header length (2)
+    size_t paddedSize = ((preambleSize + header.size() + 1 + 63) / 64) * 64;
+    header.append(paddedSize - preambleSize - header.size() - 1, ' ');
+    header.push_back('\n');
+    if (header.size() > 0xFFFF) { return false; }
+    const char magic[8] = { '\x93', 'N', 'U', 'M', 'P', 'Y', '\x01', '\x00' };
+    outFile.write(magic, 8);
+    const char headerLength[2] = { static_cast<char>(header.size() & 0xFF), static_cast<char>((header.size() >> 8) & 0xFF) };
+    outFile.write(headerLength, 2);
+    outFile.write(header.data(), header.size());
+    //Samples are stored row by row, R, G, B, exactly as in the chunks
+    for (auto it = m_chunks.begin(); it != m_chunks.end(); ++it) {
+        outFile.write(reinterpret_cast<const char*>(it->Data()), static_cast<std::streamsize>(3 * it->numSamples));
+    }
+    outFile.close();
+    return !outFile.fail();
+}//end WriteNPY
+
+bool RGBSampleStore::ReadNPY(const std::string &filePath) {
+    std::ifstream inFile(filePath, std::ios::in | std::ios::binary);
+    if (!inFile.is_open()) { return false; }
+    //Check the magic string and version, read the header length (2 bytes in version 1, 4 bytes in versions 2 and 3)
+    char magic[8];
+    if (!inFile.read(magic, 8)) { return false; }
+    if (std::string(magic, 6) != std::string("\x93NUMPY", 6)) { return false; }
+    size_t headerLength = 0;
+    if (magic[6] == 1) {
+        unsigned char lengthBytes[2];
+        if (!inFile.read(reinterpret_cast<char*>(lengthBytes), 2)) { return false; }
+        headerLength = static_cast<size_t>(lengthBytes[0]) | (static_cast<size_t>(lengthBytes[1]) << 8);
+    }
+    else if ((magic[6] == 2) || (magic[6] == 3)) {
+        unsigned char lengthBytes[4];
+        if (!inFile.read(reinterpret_cast<char*>(lengthBytes), 4)) { return false; }
+        headerLength = static_cast<size_t>(lengthBytes[0]) | (static_cast<size_t>(lengthBytes[1]) << 8)
+            | (static_cast<size_t>(lengthBytes[2]) << 16) | (static_cast<size_t>(lengthBytes[3]) << 24);
+    }
+    else { return false; }
+    std::string header(headerLength, ' ');
+    if (!inFile.read(&header[0], static_cast<std::streamsize>(headerLength))) { return false; }
+    //Only unsigned 8-bit, C order, N x 3 arrays are accepted
+    if ((header.find("'|u1'") == std::string::npos) && (header.find("'u1'") == std::string::npos)) { return false; }
+    if (header.find("'fortran_order': False") == std::string::npos) { return false; }
+    size_t shapePosition = header.find("'shape': (");
+    if (shapePosition == std::string::npos) { return false; }
+    std::istringstream shapeStream(header.substr(shapePosition + 10));
+    u64 numSamples = 0;
+    char separator = 0;
+    int numColumns = 0;
+    if (!(shapeStream >> numSamples >> separator >> numColumns) || (separator != ',') || (numColumns != 3)) { return false; }
+
+    //Read the samples a chunk at a time
+    this->Clear();
+    std::vector<u8> buffer(3 * ChunkSamples);
+    u64 remaining = numSamples;
+    while (remaining > 0) {
+        size_t count = (remaining < static_cast<u64>(ChunkSamples)) ? static_cast<size_t>(remaining) : ChunkSamples;
+        if (!inFile.read(reinterpret_cast<char*>(buffer.data()), static_cast<std::streamsize>(3 * count))) {
+            this->Clear();
+            return false;
+        }
+        this->Append(buffer.data(), count);
+        remaining -= count;
+    }
+    return true;
+}//end ReadNPY
+
+const double* RGBSampleStore::GetODLookupTable() {
+    //Built once, on first use, from the same conversion the sampler thresholds with
+    static const std::array<double, 256> odTable = []() {
+        std::array<double, 256> table;
+        std::shared_ptr<ODConversion> converter = std::make_shared<ODConversion>();
+        for (int i = 0; i < 256; i++) {
+            table[i] = converter->LookupRGBtoOD(i);
+        }
+        return table;
+    }();
+    return odTable.data();
+}//end GetODLookupTable
+
+const double* RGBSampleStore::GetWideODLookupTable() {
+    //Interpolated from the 8-bit table, with the full 16-bit range mapped onto 0..255 (v / 257),
+    //so that 16-bit and 8-bit scans of the same slide give the same optical densities
+    static const std::vector<double> odTable = []() {
+        const double *narrowTable = GetODLookupTable();
+        std::vector<double> table(65536);
+        for (int v = 0; v < 65536; v++) {
+            double position = static_cast<double>(v) / 257.0;
+            int i = static_cast<int>(position);
+            if (i >= 255) {
+                table[v] = narrowTable[255];
+                continue;
+            }
+            double f = position - static_cast<double>(i);
+            table[v] = (1.0 - f) * narrowTable[i] + f * narrowTable[i + 1];
+        }
+        return table;
+    }();
+    return odTable.data();
+}//end GetWideODLookupTable
+
+bool RGBSampleStore::ConvertToOD(const u64 firstSample, const size_t numSamples, cv::OutputArray odBlock) const {
+    if (firstSample + numSamples > this->GetNumSamples()) { return false; }
+    if (numSamples > static_cast<size_t>(INT_MAX)) { return false; }
+    const double *odTable = GetODLookupTable();
+    odBlock.create(static_cast<int>(numSamples), 3, cv::DataType<double>::type);
+    if (numSamples == 0) { return true; }
+    cv::Mat odMat = odBlock.getMat();
+    size_t chunk, position;
+    this->LocateSample(firstSample, chunk, position);
+    size_t row = 0;
+    while (row < numSamples) {
+        const u8 *rgb = m_chunks[chunk].Data();
+        size_t chunkEnd = m_chunks[chunk].numSamples;
+        for (; (position < chunkEnd) && (row < numSamples); position++, row++) {
+            double *od = odMat.ptr<double>(static_cast<int>(row));
+            od[0] = odTable[rgb[3 * position + 0]];
+            od[1] = odTable[rgb[3 * position + 1]];
+            od[2] = odTable[rgb[3 * position + 2]];
+        }
+        chunk++;
+        position = 0;
+    }
+    return true;
+}//end ConvertToOD (block)
+
+bool RGBSampleStore::ConvertToOD(cv::OutputArray odMatrix) const {
+    if (this->GetNumSamples() > static_cast<u64>(INT_MAX)) { return false; }
+    return this->ConvertToOD(0, static_cast<size_t>(this->GetNumSamples()), odMatrix);
+}//end ConvertToOD
+
+bool RGBSampleStore::ForEachChunk(const ChunkConsumer &consumer) const {
+    if (!consumer) { return false; }
+    for (auto it = m_chunks.begin(); it != m_chunks.end(); ++it) {
+        if (it->numSamples == 0) { continue; }
+        consumer(it->Data(), it->numSamples);
+    }
+    return true;
+}//end ForEachChunk
+
+bool RGBSampleStore::ForEachODBlock(const BlockConsumer &consumer, const size_t blockSize /* = 4096 */) const {
+    if (!consumer || (blockSize == 0) || (blockSize > static_cast<size_t>(INT_MAX))) { return false; }
+    const double *odTable = GetODLookupTable();
+    //Reuse one block allocation for the whole pass; blocks do not cross chunk boundaries
+    cv::Mat odBlock;
+    for (auto it = m_chunks.begin(); it != m_chunks.end(); ++it) {
+        const u8 *rgb = it->Data();
+        for (size_t first = 0; first < it->numSamples; first += blockSize) {
+            size_t count = ((it->numSamples - first) < blockSize) ? (it->numSamples - first) : blockSize;
+            odBlock.create(static_cast<int>(count), 3, cv::DataType<double>::type);
+            for (size_t i = 0; i < count; i++) {
+                double *od = odBlock.ptr<double>(static_cast<int>(i));
+                const u8 *px = rgb + 3 * (first + i);
+                od[0] = odTable[px[0]];
+                od[1] = odTable[px[1]];
+                od[2] = odTable[px[2]];
+            }
+            consumer(odBlock);
+        }
+    }
+    return true;
+}//end ForEachODBlock
+
+} // namespace image
+} // namespace sedeen
@@ -0,0 +1,174 @@
+/*=============================================================================
+ *
+ *  Copyright (c) 2020 Sunnybrook Research Institute
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ *
+ *=============================================================================*/
+
+#ifndef SEDEEN_SRC_FILTER_RGBSAMPLESTORE_H
+#define SEDEEN_SRC_FILTER_RGBSAMPLESTORE_H
+
+#include "Global.h"
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+//OpenCV include
+#include <opencv2/core/core.hpp>
+
+namespace sedeen {
+namespace image {
+
+///A compact container of sampled pixels, holding the raw 8-bit R, G, B values (3 bytes per sample).
+///Values are converted to optical density through a lookup table only as consumers read them, one block at a time.
+///Samples are held in fixed-size chunks; once the chunks in memory reach the memory limit,
+///further chunks are placed in a memory-mapped temporary file, so the store may exceed the available RAM.
+class PATHCORE_IMAGE_API RGBSampleStore {
+public:
+    ///A consumer of a block of samples: one row per sample, R, G, B optical density columns (type double)
+    typedef std::function<void(const cv::Mat&)> BlockConsumer;
+    ///A consumer of a chunk of samples: interleaved R, G, B values and the number of samples
+    typedef std::function<void(const u8*, const size_t)> ChunkConsumer;
+    ///The maximum number of samples in a chunk (3 MiB, a multiple of the file mapping granularity)
+    static const size_t ChunkSamples = 1 << 20;
+
+public:
+    RGBSampleStore();
+    virtual ~RGBSampleStore();
+    //Chunks may refer to file views owned by this store, so it can be moved but not copied
+    RGBSampleStore(const RGBSampleStore&) = delete;
+    RGBSampleStore& operator=(const RGBSampleStore&) = delete;
+    RGBSampleStore(RGBSampleStore&&) = default;
+    RGBSampleStore& operator=(RGBSampleStore&&) = default;
+
+    ///Remove all samples
+    void Clear();
+    ///Allocate memory for numSamples samples, up to one chunk
+    void Reserve(const size_t numSamples);
+    ///Set the number of samples; new samples are black (0,0,0)
+    void Resize(const u64 numSamples);
+    ///Add one sample to the end of the store
+    inline void Append(const u8 r, const u8 g, const u8 b) {
+        if (m_chunks.empty() || (m_chunks.back().numSamples >= ChunkSamples)) {
+            this->AddChunk();
+        }
+        Chunk &chunk = m_chunks.back();
+        if (chunk.mapped != nullptr) {
+            u8 *rgb = chunk.mapped + 3 * chunk.numSamples;
+            rgb[0] = r;
+            rgb[1] = g;
+            rgb[2] = b;
+        }
+        else {
+            chunk.memory.push_back(r);
+            chunk.memory.push_back(g);
+            chunk.memory.push_back(b);
+        }
+        chunk.numSamples++;
+        m_numSamples++;
+    }
+    ///Add numSamples samples from interleaved R, G, B values to the end of the store
+    void Append(const u8 *rgb, const size_t numSamples);
+    ///Add copies of all samples of another store to the end of this one
+    void Append(const RGBSampleStore &other);
+    ///Move all samples of another store to the end of this one without copying them, leaving the other store empty
+    void Splice(RGBSampleStore &&other);
+    ///Overwrite the sample at position index with the sample at otherIndex in another store
+    void CopySample(const u64 index, const RGBSampleStore &other, const u64 otherIndex);
+
+    ///Get the number of samples in the store
+    inline const u64 GetNumSamples() const { return m_numSamples; }
+    ///Get the number of bytes the samples occupy, in memory and on disk
+    inline const u64 GetSizeInBytes() const { return 3 * m_numSamples; }
+    ///Get the number of chunks
+    inline const size_t GetNumChunks() const { return m_chunks.size(); }
+    ///Get the number of samples in a chunk
+    inline const size_t GetChunkNumSamples(const size_t chunk) const { return m_chunks[chunk].numSamples; }
+    ///Get the interleaved R, G, B values of a chunk
+    inline const u8* GetChunkData(const size_t chunk) const { return m_chunks[chunk].Data(); }
+
+    ///Get/Set the number of bytes of chunks held in memory before further chunks are placed in a file
+    inline const u64 GetMemoryLimit() const { return m_memoryLimit; }
+    ///Get/Set the number of bytes of chunks held in memory before further chunks are placed in a file
+    inline void SetMemoryLimit(const u64 bytes) { m_memoryLimit = bytes; }
+    ///Get/Set the directory for the temporary file (empty uses the system temporary directory)
+    inline const std::string GetSpillDirectory() const { return m_spillDirectory; }
+    ///Get/Set the directory for the temporary file (empty uses the system temporary directory)
+    inline void SetSpillDirectory(const std::string &dir) { m_spillDirectory = dir; }
+
+    ///Convert numSamples samples starting at firstSample to optical density, one row per sample. Returns false if out of range.
+    bool ConvertToOD(const u64 firstSample, const size_t numSamples, cv::OutputArray odBlock) const;
+    ///Convert all samples to optical density in a single matrix (allocates 24 bytes per sample). Returns false above 2^31-1 samples.
+    bool ConvertToOD(cv::OutputArray odMatrix) const;
+    ///Pass each chunk of samples to the consumer, in storage order
+    bool ForEachChunk(const ChunkConsumer &consumer) const;
+    ///Pass all samples to the consumer as optical density blocks of at most blockSize rows, in storage order
+    bool ForEachODBlock(const BlockConsumer &consumer, const size_t blockSize = 4096) const;
+
+    ///Write the samples to a file in NumPy .npy format (unsigned 8-bit, shape N x 3, C order), which can be memory-mapped
+    bool WriteNPY(const std::string &filePath) const;
+    ///Replace the samples with those in a NumPy .npy file written by WriteNPY. Returns false if the file is missing or not in that layout.
+    bool ReadNPY(const std::string &filePath);
+
+    ///Get the 256-entry table of optical density values for 8-bit intensities, shared by all stores
+    static const double* GetODLookupTable();
+    ///Get the 65536-entry table of optical density values for 16-bit intensities, interpolated from the 8-bit table
+    static const double* GetWideODLookupTable();
+
+private:
+    ///A temporary file that chunks are mapped from, deleted when closed
+    class SpillFile;
+    ///A run of samples, either in memory or in a view of the spill file
+    struct Chunk {
+        Chunk() : mapped(nullptr), numSamples(0) {}
+        inline const u8* Data() const { return (mapped != nullptr) ? mapped : memory.data(); }
+        ///Interleaved R, G, B values of a chunk in memory
+        std::vector<u8> memory;
+        ///The file view of a chunk placed in a spill file, or nullptr
+        u8 *mapped;
+        size_t numSamples;
+    };
+
+private:
+    ///Start a new chunk, in a spill file if the memory limit has been reached
+    void AddChunk();
+    ///Find the chunk containing a sample, and the position of the sample in the chunk
+    void LocateSample(const u64 index, size_t &chunk, size_t &position) const;
+
+private:
+    std::vector<Chunk> m_chunks;
+    ///The position in the store of the first sample of each chunk
+    std::vector<u64> m_chunkFirstSample;
+    u64 m_numSamples;
+    ///The number of chunks held in memory
+    size_t m_numMemoryChunks;
+    u64 m_memoryLimit;
+    std::string m_spillDirectory;
+    ///The spill file that new chunks of this store are mapped from, created when first needed
+    std::shared_ptr<SpillFile> m_spillFile;
+    ///Spill files of stores spliced into this one, kept open while their chunks are in use
+    std::vector<std::shared_ptr<SpillFile>> m_splicedSpillFiles;
+};
+
+} // namespace image
+} // namespace sedeen
+#endif
@@ -27,25 +27,78 @@
 //For now, include ODConversion here, but try to do the OD conversion and thresholding
 //in a kernel, and use a factory to apply it before passing the factory to this class
 #include "ODConversion.h"
+#include "TilePrefetcher.h"
+#include "TileWalker.h"
 
+#include <omp.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <filesystem>
 #include <fstream>
+#include <iomanip>
+#include <limits>
 #include <sstream>
+#include <type_traits>
+#include <unordered_map>
 
 namespace sedeen {
 namespace image {
 
 RandomWSISampler::RandomWSISampler(std::shared_ptr<tile::Factory> source) 
     : m_sourceFactory(source),
-    m_rgen((std::random_device())()) //Initialize random number generation
+    m_seed((static_cast<u64>((std::random_device())()) << 32) | static_cast<u64>((std::random_device())())),
+    m_numThreads(1),
+    m_prefetchDepth(8),
+    m_useTissueMask(false),
+    m_countForegroundOnly(false),
+    m_cacheByteBudget(2ULL * 1024 * 1024 * 1024),
+    m_converter(RGBSampleStore::GetODLookupTable())
 {
+    //Initialize random number generation
+    m_rgen.seed(m_seed, AllocationStream);
 }//end constructor
 
 RandomWSISampler::~RandomWSISampler(void) {
 }//end destructor
 
+void RandomWSISampler::SetSeed(const u64 s) {
+    m_seed = s;
+    m_rgen.seed(m_seed, AllocationStream);
+}//end SetSeed
+
+void RandomWSISampler::AddSamplingStatistics(const u64 numConverted, const u64 numKept, const u64 numTiles, const double seconds,
+    const int bytesPerChannel) {
+    m_statistics.numPixelsConverted += numConverted;
+    m_statistics.numPixelsKept += numKept;
+    m_statistics.numTilesRead += numTiles;
+    m_statistics.conversionSeconds += seconds;
+    m_statistics.bytesPerChannel = (bytesPerChannel > m_statistics.bytesPerChannel) ? bytesPerChannel : m_statistics.bytesPerChannel;
+    m_statistics.elapsedSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - m_statisticsStart).count();
+}//end AddSamplingStatistics
+
+void RandomWSISampler::ResetSamplingStatistics() {
+    m_statistics = SamplingStatistics();
+    m_statisticsStart = std::chrono::steady_clock::now();
+    m_statistics.instructionSet = TileODConverter::GetInstructionSetName(m_converter.GetInstructionSet());
+}//end ResetSamplingStatistics
+
 bool RandomWSISampler::ChooseRandomPixels(cv::OutputArray outputArray, const long int numberOfPixels, const double ODthreshold,
     const int level /* = 0 */, const int focusPlane /* = -1 */, const int band /* = -1 */) {
+    RGBSampleStore samples;
+    bool samplingSuccess = this->ChooseRandomPixels(samples, numberOfPixels, ODthreshold, level, focusPlane, band);
+    if (!samplingSuccess) { return false; }
+    //Define OpenCV Mat structure with one row per sampled pixel, RGB columns, elements are type double
+    return samples.ConvertToOD(outputArray);
+}//end ChooseRandomPixels
+
+bool RandomWSISampler::ChooseRandomPixels(RGBSampleStore &samples, const s64 numberOfPixels, const double ODthreshold,
+    const int level /* = 0 */, const int focusPlane /* = -1 */, const int band /* = -1 */) {
+    this->ResetSamplingStatistics();
     if (this->GetSourceFactory() == nullptr) { return false; }
+    if (numberOfPixels < 0) { return false; }
     auto source = this->GetSourceFactory();
     //get info about the whole slide image from the source factory
     s32 numResolutionLevels = source->getNumLevels();
@@ -66,129 +119,885 @@ bool RandomWSISampler::ChooseRandomPixels(cv::OutputArray outputArray, const lon
     if (band >= numBands) { return false; }
     s32 chosenBand = static_cast<s32>((band < 0) ? defaultBand : band);
 
-    //Get the number of tiles on the chosen level, and the pixels per tile
+    //Get the number of tiles on the chosen level
     s32 numTilesOnLevel = source->getNumTiles(level);
-    //The tile server pads tiles at the edges to keep all tiles the same size
-    s32 numTilePixels = static_cast<s32>(source->getTileSize().width() * source->getTileSize().height());
 
+    //A previous run with the same slide and parameters may have saved its output.
+    //Counting only foreground pixels gives a different output, so it has its own key
+    std::string method = this->GetCountForegroundOnly() ? "ChooseForegroundPixels" : "ChooseRandomPixels";
+    std::string cacheKey = this->BuildCacheKey(method, numberOfPixels, ODthreshold, level, chosenFocusPlane, chosenBand);
+    if (this->ReadCachedSamples(cacheKey, samples)) {
+        m_statistics.loadedFromCache = true;
+        return true;
+    }
 
-    //Create an initialized array to store the number of required pixels from each tile
-    std::unique_ptr<u16[]> tileSamplingCountArray = std::make_unique<u16[]>(numTilesOnLevel);
-    //Initialize a uniform distribution to choose tile indices
-    std::uniform_int_distribution<s32> randTileIndex(0, numTilesOnLevel - 1);
-    for (long int spx = 0; spx < numberOfPixels; spx++) {
-        s32 newIndex = randTileIndex(m_rgen);
-        tileSamplingCountArray[newIndex]++;
+    //Restart the tile allocation sequence so that the same seed gives the same output
+    m_rgen.seed(m_seed, AllocationStream);
+
+    //If requested, only tiles that contain tissue receive samples, weighted by their tissue fraction
+    std::vector<double> tileWeights;
+    bool tissueReadFailed = false;
+    bool useTissueFractions = this->GetUseTissueMask() && this->ComputeTissueFractions(level, ODthreshold, tileWeights, tissueReadFailed);
+    //Uniform weights would give a different sample, which would then be saved under this key
+    if (tissueReadFailed) { return false; }
+    if (!useTissueFractions) {
+        tileWeights.assign(static_cast<size_t>((numTilesOnLevel > 0) ? numTilesOnLevel : 0), 1.0);
     }
 
-    //Wrap the source factory in a cache
-    std::shared_ptr<image::tile::Factory> cacheSource =
-        std::make_shared<image::tile::Cache>(m_sourceFactory, image::tile::RecentCachePolicy(30));
-
-    //Create a TileServer to be able to access tiles from the factory
-    std::unique_ptr<tile::TileServer> theTileServer = std::make_unique<tile::TileServer>(cacheSource);
-
-    //Perform faster color to OD conversion using a lookup table
-    std::shared_ptr<ODConversion> converter = std::make_shared<ODConversion>();
-
-    //Define OpenCV Mat structure with numberOfSamplePixels rows, RGB columns, elements are type double
-    cv::Mat sampledPixelsMatrix(numberOfPixels, 3, cv::DataType<double>::type);
-
-    //Loop over the tiles in the high res image
-    long numPixelsAddedToMatrix = 0;
-    for (int tl = 0; tl < numTilesOnLevel; tl++) {
-        if (tileSamplingCountArray[tl] > 0) {
-            //Create an array of pixel indices
-            std::unique_ptr<u8[]> pixelSamplingArray = std::make_unique<u8[]>(numTilePixels);
-
-            //Initialize a uniform random distribution
-            std::uniform_int_distribution<s32> randPixelIndex(0, numTilePixels - 1);
-            //Fill the array with the number of required pixels, no duplication
-            for (int tpx = 0; tpx < tileSamplingCountArray[tl]; tpx++) {
-                int countLimit = 2 * numTilePixels; //Kind of high, but shouldn't be needed
-                bool freeLocationFound = false;
-                int attemptNumber = 0;
-                while (!freeLocationFound && (attemptNumber < countLimit)) {
-                    s32 newPixelIndex = randPixelIndex(m_rgen);
-                    if (pixelSamplingArray[newPixelIndex] == 0) {
-                        pixelSamplingArray[newPixelIndex] = 1;
-                        freeLocationFound = true;
-                    }
-                    else if (pixelSamplingArray[newPixelIndex] == 1) {
-                        freeLocationFound = false;
-                        attemptNumber++;
-                    }
-                    else {
-                        //invalid value. TODO: error handling
-                        freeLocationFound = false;
-                        attemptNumber++;
-                    }
-                }
-            }
+    bool samplingSuccess = false;
+    if (this->GetCountForegroundOnly()) {
+        samplingSuccess = this->ChooseForegroundPixels(samples, static_cast<u64>(numberOfPixels), tileWeights,
+            ODthreshold, level, chosenFocusPlane, chosenBand);
+    }
+    else {
+        //Split the sample budget across the tiles. Counts are 64-bit so that no tile budget overflows
+        std::vector<u64> tileSamplingCounts;
+        if (useTissueFractions) {
+            this->AllocateSamplesToTiles(static_cast<u64>(numberOfPixels), tileWeights, tileSamplingCounts);
+        }
+        else {
+            this->AllocateSamplesToTiles(static_cast<u64>(numberOfPixels), numTilesOnLevel, tileSamplingCounts);
+        }
+        samplingSuccess = this->SampleTileCandidates(tileSamplingCounts, nullptr, ODthreshold,
+            level, chosenFocusPlane, chosenBand, samples);
+        m_statistics.numRounds = 1;
+    }
+    //Only a pass in which every tile was read is saved
+    if (!samplingSuccess) { return false; }
+    this->WriteCachedSamples(cacheKey, samples);
+    return true;
+}//end ChooseRandomPixels (RGBSampleStore)
 
-            //Retrieve this tile, place in a RawImage so that pixel values are accessible
-            auto tileIndex = tile::getTileIndex(*source, level, tl, chosenFocusPlane, chosenBand);
-
-            RawImage tileImage = theTileServer->getTile(tileIndex);
-            auto numPixels = tileImage.width() * tileImage.height();
-            auto numChannels = sedeen::image::channels(tileImage);
-            auto numElements = numPixels * numChannels;
-            //Get the pixel order of the image: Interleaved or Planar
-            PixelOrder pixelOrder = tileImage.order();
-
-            //For every chosen pixel set to 1 in pixelSamplingArray
-            for (int px = 0; px < numPixels; px++) {
-                if (pixelSamplingArray[px] == 1) {
-                    double rgbOD[3] = { 0.0 };
-                    unsigned int Rindex, Gindex, Bindex;
-                    if (pixelOrder == PixelOrder::Interleaved) {
-                        //RGB RGB RGB ... (if numChannels=3)
-                        Rindex = px * numChannels + 0;
-                        Gindex = px * numChannels + 1;
-                        Bindex = px * numChannels + 2;
-                    }
-                    else if (pixelOrder == PixelOrder::Planar) {
-                        //RRR... GGG... BBB...
-                        Rindex = 0 * numPixels + px;
-                        Gindex = 1 * numPixels + px;
-                        Bindex = 2 * numPixels + px;
-                    }
-                    else {
-                        //Invalid value of pixelOrder
-                        break;
-                    }
-                    //Check the values
-                    if ((Rindex >= numElements) || (Gindex >= numElements) || (Bindex >= numElements)) {
-                        break;
-                    }
-                    //Get the optical density values
-                    rgbOD[0] = converter->LookupRGBtoOD(static_cast<int>((tileImage[Rindex]).as<s32>()));
-                    rgbOD[1] = converter->LookupRGBtoOD(static_cast<int>((tileImage[Gindex]).as<s32>()));
-                    rgbOD[2] = converter->LookupRGBtoOD(static_cast<int>((tileImage[Bindex]).as<s32>()));
-
-                    if (rgbOD[0] + rgbOD[1] + rgbOD[2] > ODthreshold) {
-                        sampledPixelsMatrix.at<double>(numPixelsAddedToMatrix, 0) = rgbOD[0];
-                        sampledPixelsMatrix.at<double>(numPixelsAddedToMatrix, 1) = rgbOD[1];
-                        sampledPixelsMatrix.at<double>(numPixelsAddedToMatrix, 2) = rgbOD[2];
-                        numPixelsAddedToMatrix++;
+bool RandomWSISampler::ChooseForegroundPixels(RGBSampleStore &samples, const u64 numberOfPixels, const std::vector<double> &tileWeights,
+    const double ODthreshold, const int level, const s32 focusPlane, const s32 band) {
+    samples.Clear();
+    auto source = this->GetSourceFactory();
+    const size_t numTiles = tileWeights.size();
+    Size tileSize = source->getTileSize();
+    const u64 tileCapacity = static_cast<u64>((tileSize.width() > 0) ? tileSize.width() : 0)
+        * static_cast<u64>((tileSize.height() > 0) ? tileSize.height() : 0);
+    if ((numTiles == 0) || (tileCapacity == 0)) { return false; }
+
+    //The number of candidates drawn so far from each tile, and the state of its pixel permutation.
+    //Each round continues every tile's permutation where the last one stopped, so no pixel is drawn
+    //twice across rounds and a round costs only as much as the candidates it draws
+    std::vector<u64> tileDrawn(numTiles, 0);
+    std::vector<std::unique_ptr<TilePermutation>> tilePermutations(numTiles);
+    std::vector<double> roundWeights(numTiles, 0.0);
+    std::vector<u64> roundCounts;
+    u64 numDrawn = 0;
+    u64 numAccepted = 0;
+    //The pilot round draws as many candidates as requested samples
+    u64 roundSize = numberOfPixels;
+    for (int round = 0; (round < MaxForegroundRounds) && (samples.GetNumSamples() < numberOfPixels); round++) {
+        //Weight each tile by its undrawn pixels, as if all rounds were one draw without replacement
+        double totalWeight = 0.0;
+        for (size_t tl = 0; tl < numTiles; tl++) {
+            double undrawn = static_cast<double>(tileCapacity - tileDrawn[tl]) / static_cast<double>(tileCapacity);
+            roundWeights[tl] = (tileWeights[tl] > 0.0) ? tileWeights[tl] * undrawn : 0.0;
+            totalWeight += roundWeights[tl];
+        }
+        //Every pixel has been drawn
+        if (totalWeight <= 0.0) { break; }
+        this->AllocateSamplesToTiles(roundSize, roundWeights, roundCounts);
+        u64 roundDrawn = 0;
+        for (size_t tl = 0; tl < numTiles; tl++) {
+            u64 undrawn = tileCapacity - tileDrawn[tl];
+            roundCounts[tl] = (roundCounts[tl] < undrawn) ? roundCounts[tl] : undrawn;
+            roundDrawn += roundCounts[tl];
+        }
+
+        RGBSampleStore roundSamples;
+        roundSamples.SetMemoryLimit(samples.GetMemoryLimit());
+        roundSamples.SetSpillDirectory(samples.GetSpillDirectory());
+        if (!this->SampleTileCandidates(roundCounts, &tilePermutations, ODthreshold, level, focusPlane, band, roundSamples)) {
+            return false;
+        }
+        for (size_t tl = 0; tl < numTiles; tl++) {
+            tileDrawn[tl] += roundCounts[tl];
+        }
+        numDrawn += roundDrawn;
+        numAccepted += roundSamples.GetNumSamples();
+        m_statistics.numRounds = round + 1;
+
+        u64 shortfall = numberOfPixels - samples.GetNumSamples();
+        if (roundSamples.GetNumSamples() <= shortfall) {
+            samples.Splice(std::move(roundSamples));
+        }
+        else {
+            //The round overshot: keep a uniform random subset of its samples, in order (selection sampling)
+            u64 remaining = roundSamples.GetNumSamples();
+            u64 needed = shortfall;
+            std::uniform_real_distribution<double> randUnit(0.0, 1.0);
+            roundSamples.ForEachChunk([&](const u8 *rgb, const size_t numChunkSamples) {
+                for (size_t i = 0; (i < numChunkSamples) && (needed > 0); i++, remaining--) {
+                    if (randUnit(m_rgen) * static_cast<double>(remaining) < static_cast<double>(needed)) {
+                        samples.Append(rgb[3 * i + 0], rgb[3 * i + 1], rgb[3 * i + 2]);
+                        needed--;
                     }
                 }
+            });
+        }
+        if (samples.GetNumSamples() >= numberOfPixels) { break; }
+
+        //Size the next round to fill the shortfall at the acceptance rate seen so far. The estimate
+        //(accepted + 1)/(drawn + 2) stays above zero, and growth is limited in case it is far too low
+        double acceptanceRate = static_cast<double>(numAccepted + 1) / static_cast<double>(numDrawn + 2);
+        double nextRound = std::ceil(static_cast<double>(numberOfPixels - samples.GetNumSamples()) / acceptanceRate);
+        double maxRound = static_cast<double>(MaxForegroundRoundGrowth) * static_cast<double>((numDrawn > 0) ? numDrawn : 1);
+        roundSize = static_cast<u64>((nextRound < maxRound) ? nextRound : maxRound);
+    }
+    return true;
+}//end ChooseForegroundPixels
+
+bool RandomWSISampler::SampleTileCandidates(const std::vector<u64> &tileCounts, std::vector<std::unique_ptr<TilePermutation>> *tilePermutations,
+    const double ODthreshold, const int level, const s32 focusPlane, const s32 band, RGBSampleStore &samples) {
+    auto source = this->GetSourceFactory();
+    if (source == nullptr) { return false; }
+    if ((tilePermutations != nullptr) && (tilePermutations->size() != tileCounts.size())) { return false; }
+
+    //List the tiles to visit in tile index order
+    std::vector<s32> tilesToVisit;
+    for (size_t tl = 0; tl < tileCounts.size(); tl++) {
+        if (tileCounts[tl] > 0) {
+            tilesToVisit.push_back(static_cast<s32>(tl));
+        }
+    }
+
+    //Choose the number of worker threads
+    int numThreads = (this->GetNumThreads() < 1) ? omp_get_num_procs() : this->GetNumThreads();
+    const int numTilesToVisit = static_cast<int>(tilesToVisit.size());
+    //Each worker fills its own store, sharing the memory limit of the output store, so that
+    //the stores can be joined in worker order regardless of when each worker finished
+    std::vector<RGBSampleStore> workerSamples(static_cast<size_t>(numThreads));
+    for (auto it = workerSamples.begin(); it != workerSamples.end(); ++it) {
+        it->SetMemoryLimit(samples.GetMemoryLimit() / static_cast<u64>(numThreads));
+        it->SetSpillDirectory(samples.GetSpillDirectory());
+    }
+    //Set by a worker if one of its tiles could not be read
+    std::vector<int> workerFailed(static_cast<size_t>(numThreads), 0);
+
+#pragma omp parallel num_threads(numThreads)
+    {
+        //Each worker takes a contiguous run of the tile list, so that its tile requests stay in storage order
+        int worker = omp_get_thread_num();
+        int numWorkers = omp_get_num_threads();
+        int firstVisit = static_cast<int>((static_cast<s64>(numTilesToVisit) * worker) / numWorkers);
+        int endVisit = static_cast<int>((static_cast<s64>(numTilesToVisit) * (worker + 1)) / numWorkers);
+
+        //Each worker wraps the source factory in its own cache and TileServer, used only by its prefetch thread
+        std::shared_ptr<image::tile::Factory> cacheSource =
+            std::make_shared<image::tile::Cache>(source, image::tile::RecentCachePolicy(30));
+        std::shared_ptr<tile::TileServer> theTileServer = std::make_shared<tile::TileServer>(cacheSource);
+        //Read tiles ahead of use, so that tile decoding overlaps pixel conversion
+        TilePrefetcher prefetcher([&, theTileServer](const size_t request) {
+            s32 tl = tilesToVisit[firstVisit + request];
+            auto tileIndex = tile::getTileIndex(*source, level, tl, focusPlane, band);
+            return theTileServer->getTile(tileIndex);
+        }, static_cast<size_t>((endVisit > firstVisit) ? (endVisit - firstVisit) : 0), this->GetPrefetchDepth());
+
+        RGBSampleStore tileSamples;
+        RawImage tileImage;
+        u64 numConverted = 0;
+        u64 numTiles = 0;
+        int maxBytesPerChannel = 0;
+        double conversionSeconds = 0.0;
+        for (int visit = firstVisit; visit < endVisit; visit++) {
+            //A failed read arrives as a null image; the sample would be short of the tile's pixels
+            if (!prefetcher.Next(tileImage) || tileImage.isNull()) {
+                workerFailed[worker] = 1;
+                break;
+            }
+            numTiles++;
+            int tileBytesPerChannel = static_cast<int>(sedeen::image::bytesPerChannel(tileImage));
+            maxBytesPerChannel = (tileBytesPerChannel > maxBytesPerChannel) ? tileBytesPerChannel : maxBytesPerChannel;
+            s32 tl = tilesToVisit[visit];
+            //The random number stream of each tile depends only on the seed, the level and the tile number,
+            //so the choice of pixels does not depend on the number of threads. Creating it costs O(1).
+            //Each tile is visited by one worker, so its kept permutation is not shared
+            std::unique_ptr<TilePermutation> newPermutation;
+            TilePermutation *permutation = (tilePermutations != nullptr) ? (*tilePermutations)[tl].get() : nullptr;
+            if (permutation == nullptr) {
+                newPermutation.reset(new TilePermutation(m_seed, TileStream(level, tl)));
+                permutation = newPermutation.get();
+                if (tilePermutations != nullptr) { (*tilePermutations)[tl] = std::move(newPermutation); }
             }
+            u64 firstPosition = permutation->position;
+            auto conversionStart = std::chrono::steady_clock::now();
+            SampleTile(tileImage, tileCounts[tl], *permutation, ODthreshold, tileSamples);
+            conversionSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - conversionStart).count();
+            numConverted += permutation->position - firstPosition;
+            workerSamples[worker].Append(tileSamples);
+        }
+#pragma omp critical
+        this->AddSamplingStatistics(numConverted, workerSamples[worker].GetNumSamples(), numTiles, conversionSeconds, maxBytesPerChannel);
+    }//end parallel region
+    for (auto it = workerFailed.begin(); it != workerFailed.end(); ++it) {
+        if (*it != 0) { return false; }
+    }
+
+    //Workers took contiguous runs of the tile list in order, so joining their stores in worker order
+    //gives tile index order. Chunks are moved, not copied
+    samples.Clear();
+    for (auto it = workerSamples.begin(); it != workerSamples.end(); ++it) {
+        samples.Splice(std::move(*it));
+    }
+    return true;
+}//end SampleTileCandidates
+
+bool RandomWSISampler::StreamAllPixels(const BlockConsumer &consumer, const double ODthreshold,
+    const int level /* = 0 */, const int focusPlane /* = -1 */, const int band /* = -1 */) {
+    if (!consumer) { return false; }
+    this->ResetSamplingStatistics();
+    //Convert each tile's samples to optical density as they arrive, reusing one block allocation
+    cv::Mat tileSlab;
+    auto convertingConsumer = [&](const RGBSampleStore &tileSamples) {
+        tileSamples.ConvertToOD(tileSlab);
+        consumer(tileSlab);
+    };
+    return this->StreamAllSampleBlocks(convertingConsumer, ODthreshold, level, focusPlane, band);
+}//end StreamAllPixels
+
+bool RandomWSISampler::StreamAllSampleBlocks(const SampleBlockConsumer &consumer, const double ODthreshold,
+    const int level /* = 0 */, const int focusPlane /* = -1 */, const int band /* = -1 */) {
+    if (this->GetSourceFactory() == nullptr) { return false; }
+    if (!consumer) { return false; }
+    auto source = this->GetSourceFactory();
+    s32 numResolutionLevels = source->getNumLevels();
+    auto numFocusPlanes = tile::getNumFocusPlanes(*source);
+    auto defaultFocusPlane = tile::getDefaultFocusPlane(*source);
+    auto numBands = tile::getNumBands(*source);
+    auto defaultBand = tile::getDefaultBand(*source);
+
+    //Check the level, focusPlane, and band argument values
+    if ((level < 0) || (level >= numResolutionLevels)) { return false; }
+    if (focusPlane >= numFocusPlanes) { return false; }
+    s32 chosenFocusPlane = static_cast<s32>((focusPlane < 0) ? defaultFocusPlane : focusPlane);
+    if (band >= numBands) { return false; }
+    s32 chosenBand = static_cast<s32>((band < 0) ? defaultBand : band);
+
+    //Tile grid of the level, used to exclude the padding of tiles at the right and bottom edges
+    s32 numTilesOnLevel = source->getNumTiles(level);
+    Size levelSize = source->getDimensions(level);
+    Size tileSize = source->getTileSize();
+    s32 numTilesX = (tileSize.width() > 0) ? (levelSize.width() + tileSize.width() - 1) / tileSize.width() : 0;
+    s32 numTilesY = (tileSize.height() > 0) ? (levelSize.height() + tileSize.height() - 1) / tileSize.height() : 0;
+    bool gridKnown = (numTilesX * numTilesY == numTilesOnLevel);
+
+    //Skip background tiles if a tissue mask was requested
+    std::vector<double> tissueFractions;
+    bool tissueReadFailed = false;
+    bool useTissueFractions = this->GetUseTissueMask() && this->ComputeTissueFractions(level, ODthreshold, tissueFractions, tissueReadFailed);
+    if (tissueReadFailed) { return false; }
+
+    //List the tiles to visit in tile index order
+    std::vector<s32> tilesToVisit;
+    for (s32 tl = 0; tl < numTilesOnLevel; tl++) {
+        if (useTissueFractions && (tissueFractions[tl] <= 0.0)) { continue; }
+        tilesToVisit.push_back(tl);
+    }
+
+    //Wrap the source factory in a cache, create a TileServer to access tiles from the factory.
+    //Tiles are read ahead of use on a prefetch thread, the only user of the TileServer
+    std::shared_ptr<image::tile::Factory> cacheSource =
+        std::make_shared<image::tile::Cache>(source, image::tile::RecentCachePolicy(30));
+    std::shared_ptr<tile::TileServer> theTileServer = std::make_shared<tile::TileServer>(cacheSource);
+    TilePrefetcher prefetcher([&, theTileServer](const size_t request) {
+        auto tileIndex = tile::getTileIndex(*source, level, tilesToVisit[request], chosenFocusPlane, chosenBand);
+        return theTileServer->getTile(tileIndex);
+    }, tilesToVisit.size(), this->GetPrefetchDepth());
+
+    //Only one tile's worth of pixels is held at a time
+    RGBSampleStore tileSamples;
+    RawImage tileImage;
+    u64 numConverted = 0;
+    u64 numKept = 0;
+    u64 numTiles = 0;
+    int maxBytesPerChannel = 0;
+    double conversionSeconds = 0.0;
+    for (auto it = tilesToVisit.begin(); it != tilesToVisit.end(); ++it) {
+        //A failed read arrives as a null image; the pass would be short of the tile's pixels
+        if (!prefetcher.Next(tileImage) || tileImage.isNull()) {
+            this->AddSamplingStatistics(numConverted, numKept, numTiles, conversionSeconds, maxBytesPerChannel);
+            return false;
+        }
+        numTiles++;
+        int tileBytesPerChannel = static_cast<int>(sedeen::image::bytesPerChannel(tileImage));
+        maxBytesPerChannel = (tileBytesPerChannel > maxBytesPerChannel) ? tileBytesPerChannel : maxBytesPerChannel;
+        s32 tl = *it;
+        int validWidth = tileImage.width();
+        int validHeight = tileImage.height();
+        if (gridKnown) {
+            int remainingWidth = levelSize.width() - (tl % numTilesX) * tileSize.width();
+            int remainingHeight = levelSize.height() - (tl / numTilesX) * tileSize.height();
+            validWidth = (remainingWidth < validWidth) ? remainingWidth : validWidth;
+            validHeight = (remainingHeight < validHeight) ? remainingHeight : validHeight;
+        }
+        auto conversionStart = std::chrono::steady_clock::now();
+        ConvertTilePixels(tileImage, validWidth, validHeight, ODthreshold, tileSamples);
+        conversionSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - conversionStart).count();
+        if ((validWidth > 0) && (validHeight > 0)) {
+            numConverted += static_cast<u64>(validWidth) * static_cast<u64>(validHeight);
+        }
+        numKept += tileSamples.GetNumSamples();
+        if (tileSamples.GetNumSamples() > 0) {
+            consumer(tileSamples);
+        }
+    }
+    this->AddSamplingStatistics(numConverted, numKept, numTiles, conversionSeconds, maxBytesPerChannel);
+    m_statistics.numRounds = 1;
+    return true;
+}//end StreamAllSampleBlocks
+
+bool RandomWSISampler::ReservoirSamplePixels(cv::OutputArray outputArray, const long int reservoirSize, const double ODthreshold,
+    const int level /* = 0 */, const int focusPlane /* = -1 */, const int band /* = -1 */) {
+    RGBSampleStore samples;
+    bool samplingSuccess = this->ReservoirSamplePixels(samples, reservoirSize, ODthreshold, level, focusPlane, band);
+    if (!samplingSuccess) { return false; }
+    return samples.ConvertToOD(outputArray);
+}//end ReservoirSamplePixels
+
+bool RandomWSISampler::ReservoirSamplePixels(RGBSampleStore &samples, const s64 reservoirSize, const double ODthreshold,
+    const int level /* = 0 */, const int focusPlane /* = -1 */, const int band /* = -1 */) {
+    if (reservoirSize <= 0) { return false; }
+    this->ResetSamplingStatistics();
+    auto source = this->GetSourceFactory();
+    if (source == nullptr) { return false; }
+    //Resolve the default focus plane and band (-1), so that the cache key matches that of ChooseRandomPixels
+    if (focusPlane >= tile::getNumFocusPlanes(*source)) { return false; }
+    s32 chosenFocusPlane = static_cast<s32>((focusPlane < 0) ? tile::getDefaultFocusPlane(*source) : focusPlane);
+    if (band >= tile::getNumBands(*source)) { return false; }
+    s32 chosenBand = static_cast<s32>((band < 0) ? tile::getDefaultBand(*source) : band);
+    //A previous run with the same slide and parameters may have saved its output
+    std::string cacheKey = this->BuildCacheKey("ReservoirSamplePixels", reservoirSize, ODthreshold, level, chosenFocusPlane, chosenBand);
+    if (this->ReadCachedSamples(cacheKey, samples)) {
+        m_statistics.loadedFromCache = true;
+        return true;
+    }
+    //Restart the random number sequence so that the same seed gives the same output
+    m_rgen.seed(m_seed, ReservoirStream);
+    const double k = static_cast<double>(reservoirSize);
+    std::uniform_real_distribution<double> randUnit(std::numeric_limits<double>::min(), 1.0);
+    std::uniform_int_distribution<s64> randSlot(0, reservoirSize - 1);
+
+    //Reservoir sampling with geometric skips (Li's Algorithm L): after the reservoir is full,
+    //the number of pixels to skip before the next replacement is drawn directly
+    //The output store is the reservoir
+    RGBSampleStore &reservoir = samples;
+    reservoir.Clear();
+    reservoir.Resize(static_cast<u64>(reservoirSize));
+    s64 numInReservoir = 0;
+    u64 numSeen = 0;
+    u64 nextReplacement = 0;
+    double W = 1.0;
+    auto drawNextReplacement = [&](const u64 currentPosition) {
+        W *= std::exp(std::log(randUnit(m_rgen)) / k);
+        double skip = std::floor(std::log(randUnit(m_rgen)) / std::log1p(-W));
+        nextReplacement = currentPosition + 1 + ((skip < 1e18) ? static_cast<u64>(skip) : static_cast<u64>(1e18));
+    };
 
-            //Free the pixelSamplingArray
-            pixelSamplingArray.release();
-            //tileImage should go out of scope
+    auto reservoirConsumer = [&](const RGBSampleStore &block) {
+        const int numRows = static_cast<int>(block.GetNumSamples());
+        int row = 0;
+        //Fill the reservoir
+        while ((row < numRows) && (numInReservoir < reservoirSize)) {
+            reservoir.CopySample(static_cast<u64>(numInReservoir), block, static_cast<u64>(row));
+            numInReservoir++;
+            if (numInReservoir == reservoirSize) {
+                drawNextReplacement(numSeen);
+            }
+            row++;
+            numSeen++;
+        }
+        //Replace reservoir entries at the chosen positions
+        while (row < numRows) {
+            u64 rowsToSkip = nextReplacement - numSeen;
+            if (rowsToSkip >= static_cast<u64>(numRows - row)) {
+                numSeen += static_cast<u64>(numRows - row);
+                break;
+            }
+            row += static_cast<int>(rowsToSkip);
+            numSeen += rowsToSkip;
+            reservoir.CopySample(static_cast<u64>(randSlot(m_rgen)), block, static_cast<u64>(row));
+            drawNextReplacement(numSeen);
+            row++;
+            numSeen++;
         }
-    }//end for each tile
-    tileSamplingCountArray.release();
+    };
+
+    //Only a pass in which every tile was read is saved
+    bool streamSuccess = this->StreamAllSampleBlocks(reservoirConsumer, ODthreshold, level, chosenFocusPlane, chosenBand);
+    if (!streamSuccess) { return false; }
+    //If fewer pixels passed the threshold than the reservoir size, keep only those
+    reservoir.Resize(static_cast<u64>(numInReservoir));
+    this->WriteCachedSamples(cacheKey, reservoir);
+    return true;
+}//end ReservoirSamplePixels (RGBSampleStore)
 
-    //Resize the sampledPixelsMatrix
-    sampledPixelsMatrix.resize(numPixelsAddedToMatrix);
-    //Assign to outputArray
-    outputArray.assign(sampledPixelsMatrix);
+std::string RandomWSISampler::BuildCacheKey(const std::string &method, const s64 count, const double ODthreshold,
+    const int level, const int focusPlane, const int band) const {
+    //The number of threads is not part of the key: it does not change the output
+    std::ostringstream key;
+    key << "slide=" << this->GetSlideIdentity() << "\n"
+        << "method=" << method << "\n"
+        << "level=" << level << "\n"
+        << "focusPlane=" << focusPlane << "\n"
+        << "band=" << band << "\n"
+        << "ODthreshold=" << std::hexfloat << ODthreshold << std::defaultfloat << "\n"
+        << "count=" << count << "\n"
+        << "rng=philox4x32-10\n"
+        << "seed=" << this->GetSeed() << "\n"
+        << "tissueMask=" << (this->GetUseTissueMask() ? 1 : 0) << "\n";
+    return key.str();
+}//end BuildCacheKey
 
+std::string RandomWSISampler::GetCacheFileStem(const std::string &key) const {
+    //64-bit FNV-1a hash of the key names the files; the full key is stored beside the data to rule out collisions
+    u64 hash = 14695981039346656037ULL;
+    for (auto it = key.begin(); it != key.end(); ++it) {
+        hash ^= static_cast<u64>(static_cast<unsigned char>(*it));
+        hash *= 1099511628211ULL;
+    }
+    std::ostringstream fileName;
+    fileName << "samples_" << std::hex << std::setw(16) << std::setfill('0') << hash;
+    return (std::filesystem::path(this->GetCacheDirectory()) / fileName.str()).string();
+}//end GetCacheFileStem
+
+bool RandomWSISampler::ReadCachedSamples(const std::string &key, RGBSampleStore &samples) const {
+    if (this->GetCacheDirectory().empty() || this->GetSlideIdentity().empty()) { return false; }
+    std::string stem = this->GetCacheFileStem(key);
+    //The entry is only used if its stored key matches exactly
+    std::ifstream keyFile(stem + ".key", std::ios::in | std::ios::binary);
+    if (!keyFile.is_open()) { return false; }
+    std::ostringstream storedKey;
+    storedKey << keyFile.rdbuf();
+    if (storedKey.str() != key) { return false; }
+    keyFile.close();
+    if (!samples.ReadNPY(stem + ".npy")) { return false; }
+    //Mark the entry as recently used, for eviction
+    std::error_code timeError;
+    std::filesystem::last_write_time(stem + ".key", std::filesystem::file_time_type::clock::now(), timeError);
     return true;
-}//end ChooseRandomPixels
+}//end ReadCachedSamples
+
+bool RandomWSISampler::WriteCachedSamples(const std::string &key, const RGBSampleStore &samples) const {
+    if (this->GetCacheDirectory().empty() || this->GetSlideIdentity().empty()) { return false; }
+    std::error_code dirError;
+    std::filesystem::create_directories(this->GetCacheDirectory(), dirError);
+    if (dirError) { return false; }
+    std::string stem = this->GetCacheFileStem(key);
+    //Write the data under a temporary name and rename it, so a partly written file is never read.
+    //The key file is written last: an entry without one is ignored
+    std::remove((stem + ".key").c_str());
+    if (!samples.WriteNPY(stem + ".npy.tmp")) {
+        std::remove((stem + ".npy.tmp").c_str());
+        return false;
+    }
+    std::error_code renameError;
+    std::filesystem::rename(stem + ".npy.tmp", stem + ".npy", renameError);
+    if (renameError) {
+        std::remove((stem + ".npy.tmp").c_str());
+        return false;
+    }
+    std::ofstream keyFile(stem + ".key", std::ios::out | std::ios::binary | std::ios::trunc);
+    if (!keyFile.is_open()) { return false; }
+    keyFile << key;
+    keyFile.close();
+    if (keyFile.fail()) { return false; }
+    this->DropCacheToBudget(stem);
+    return true;
+}//end WriteCachedSamples
+
+void RandomWSISampler::DropCacheToBudget(const std::string &keepStem) const {
+    //Each entry is a .key and a .npy file with the same stem. The .key file is written last and touched on each
+    //read, so its time is the last use of the entry
+    struct CacheEntry {
+        std::filesystem::file_time_type lastUse;
+        u64 numBytes;
+        std::string stem;
+    };
+    std::vector<CacheEntry> entries;
+    u64 totalBytes = 0;
+    std::error_code listError;
+    for (std::filesystem::directory_iterator it(this->GetCacheDirectory(), listError), end; !listError && (it != end); it.increment(listError)) {
+        const std::filesystem::path &filePath = it->path();
+        if ((filePath.extension() != ".key") || (filePath.stem().string().compare(0, 8, "samples_") != 0)) { continue; }
+        std::string stem = (filePath.parent_path() / filePath.stem()).string();
+        std::error_code sizeError;
+        CacheEntry entry;
+        entry.stem = stem;
+        entry.lastUse = std::filesystem::last_write_time(filePath, sizeError);
+        u64 keyBytes = static_cast<u64>(std::filesystem::file_size(filePath, sizeError));
+        entry.numBytes = sizeError ? 0 : keyBytes;
+        u64 dataBytes = static_cast<u64>(std::filesystem::file_size(stem + ".npy", sizeError));
+        entry.numBytes += sizeError ? 0 : dataBytes;
+        totalBytes += entry.numBytes;
+        entries.push_back(entry);
+    }
+    if (totalBytes <= this->GetCacheByteBudget()) { return; }
+
+    //Delete the least recently used entries first, keeping the one just written
+    std::sort(entries.begin(), entries.end(), [](const CacheEntry &a, const CacheEntry &b) { return a.lastUse < b.lastUse; });
+    for (auto it = entries.begin(); (it != entries.end()) && (totalBytes > this->GetCacheByteBudget()); ++it) {
+        if (it->stem == keepStem) { continue; }
+        //Remove the key first, so that a partly deleted entry is never read
+        std::remove((it->stem + ".key").c_str());
+        std::remove((it->stem + ".npy").c_str());
+        totalBytes -= it->numBytes;
+    }
+}//end DropCacheToBudget
+
+void RandomWSISampler::AllocateSamplesToTiles(const u64 numberOfPixels, const s32 numTiles,
+    std::vector<u64> &tileSamplingCounts) {
+    tileSamplingCounts.assign(static_cast<size_t>((numTiles > 0) ? numTiles : 0), 0);
+    if (numTiles <= 0) { return; }
+    //Multinomial allocation with equal tile probabilities, as a sequence of binomial draws:
+    //each tile receives Binomial(remaining samples, 1/(remaining tiles))
+    u64 remainingPixels = numberOfPixels;
+    for (s32 tl = 0; (tl < numTiles - 1) && (remainingPixels > 0); tl++) {
+        double p = 1.0 / static_cast<double>(numTiles - tl);
+        std::binomial_distribution<u64> tileCountDist(remainingPixels, p);
+        u64 count = tileCountDist(m_rgen);
+        tileSamplingCounts[tl] = count;
+        remainingPixels -= count;
+    }
+    //The last tile receives whatever remains
+    tileSamplingCounts[numTiles - 1] += remainingPixels;
+}//end AllocateSamplesToTiles
+
+void RandomWSISampler::AllocateSamplesToTiles(const u64 numberOfPixels, const std::vector<double> &tileWeights,
+    std::vector<u64> &tileSamplingCounts) {
+    tileSamplingCounts.assign(tileWeights.size(), 0);
+    if (tileWeights.empty()) { return; }
+    //Total weight of the tiles not yet visited
+    double remainingWeight = 0.0;
+    for (auto it = tileWeights.begin(); it != tileWeights.end(); ++it) {
+        remainingWeight += (*it > 0.0) ? *it : 0.0;
+    }
+    if (remainingWeight <= 0.0) { return; }
+    //Each tile receives Binomial(remaining samples, weight/(remaining weight))
+    u64 remainingPixels = numberOfPixels;
+    size_t lastWeightedTile = 0;
+    for (size_t tl = 0; (tl < tileWeights.size()) && (remainingPixels > 0); tl++) {
+        double w = (tileWeights[tl] > 0.0) ? tileWeights[tl] : 0.0;
+        if (w <= 0.0) { continue; }
+        lastWeightedTile = tl;
+        double p = (w >= remainingWeight) ? 1.0 : (w / remainingWeight);
+        std::binomial_distribution<u64> tileCountDist(remainingPixels, p);
+        u64 count = tileCountDist(m_rgen);
+        tileSamplingCounts[tl] = count;
+        remainingPixels -= count;
+        remainingWeight -= w;
+    }
+    //Floating point roundoff may leave a few samples; give them to the last weighted tile
+    tileSamplingCounts[lastWeightedTile] += remainingPixels;
+}//end AllocateSamplesToTiles (weighted)
+
+bool RandomWSISampler::ComputeTissueFractions(const int level, const double ODthreshold,
+    std::vector<double> &tissueFractions, bool &readFailed) const {
+    tissueFractions.clear();
+    readFailed = false;
+    auto source = m_sourceFactory;
+    if (source == nullptr) { return false; }
+    s32 numResolutionLevels = source->getNumLevels();
+    if ((level < 0) || (level >= numResolutionLevels)) { return false; }
+
+    //Tile grid of the sampling level
+    Size levelSize = source->getDimensions(level);
+    Size tileSize = source->getTileSize();
+    if ((levelSize.width() <= 0) || (levelSize.height() <= 0)
+        || (tileSize.width() <= 0) || (tileSize.height() <= 0)) { return false; }
+    s32 numTilesX = (levelSize.width() + tileSize.width() - 1) / tileSize.width();
+    s32 numTilesY = (levelSize.height() + tileSize.height() - 1) / tileSize.height();
+    s32 numTilesOnLevel = source->getNumTiles(level);
+    //Tile numbers are assumed to be in row-major order on the level
+    if (numTilesX * numTilesY != numTilesOnLevel) { return false; }
+
+    //Choose the coarsest level on which a sampling tile still covers a few pixels in each direction
+    const int minCoarsePixelsPerTile = 4;
+    int coarseLevel = level;
+    for (int lev = numResolutionLevels - 1; lev > level; lev--) {
+        Size candidateSize = source->getDimensions(lev);
+        double scaleX = static_cast<double>(candidateSize.width()) / static_cast<double>(levelSize.width());
+        double scaleY = static_cast<double>(candidateSize.height()) / static_cast<double>(levelSize.height());
+        if ((tileSize.width() * scaleX >= minCoarsePixelsPerTile) && (tileSize.height() * scaleY >= minCoarsePixelsPerTile)) {
+            coarseLevel = lev;
+            break;
+        }
+    }
+    //No coarser level is usable: reading the sampling level whole would cost more than it saves
+    if (coarseLevel == level) { return false; }
+    Size coarseSize = source->getDimensions(coarseLevel);
+    double scaleX = static_cast<double>(coarseSize.width()) / static_cast<double>(levelSize.width());
+    double scaleY = static_cast<double>(coarseSize.height()) / static_cast<double>(levelSize.height());
+
+    //Get the whole image at the resolution of the coarse level
+    auto compositor = image::tile::Compositor(source);
+    Rect fullRect(Point(0, 0), source->getDimensions(0));
+    RawImage coarseImage = compositor.getImage(fullRect, coarseSize);
+    if (coarseImage.isNull()) {
+        readFailed = true;
+        return false;
+    }
+    int coarseWidth = coarseImage.size().width();
+    int coarseHeight = coarseImage.size().height();
+
+    //Mark coarse pixels whose summed optical density exceeds the threshold
+    std::vector<u8> tissueMask(static_cast<size_t>(coarseWidth) * static_cast<size_t>(coarseHeight), 0);
+    bool walked = VisitTilePixels(coarseImage, [&](const auto &walker) {
+        typedef typename std::decay<decltype(walker)>::type Walker;
+        const double *odTable = GetODLookupTableFor<typename Walker::Value>();
+        for (size_t px = 0; px < tissueMask.size(); px++) {
+            tissueMask[px] = (odTable[walker.R(px)] + odTable[walker.G(px)] + odTable[walker.B(px)] > ODthreshold) ? 1 : 0;
+        }
+    });
+    if (!walked) {
+        //Other layouts: read the values one at a time
+        std::shared_ptr<ODConversion> converter = std::make_shared<ODConversion>();
+        for (int y = 0; y < coarseHeight; y++) {
+            for (int x = 0; x < coarseWidth; x++) {
+                double sumOD = converter->LookupRGBtoOD(coarseImage.at(x, y, 0).as<int>())
+                    + converter->LookupRGBtoOD(coarseImage.at(x, y, 1).as<int>())
+                    + converter->LookupRGBtoOD(coarseImage.at(x, y, 2).as<int>());
+                tissueMask[static_cast<size_t>(y) * coarseWidth + x] = (sumOD > ODthreshold) ? 1 : 0;
+            }
+        }
+    }
+
+    //The tissue fraction of a tile is the fraction of its coarse pixels marked as tissue
+    tissueFractions.assign(static_cast<size_t>(numTilesOnLevel), 0.0);
+    bool tissueFound = false;
+    for (s32 tl = 0; tl < numTilesOnLevel; tl++) {
+        s32 col = tl % numTilesX;
+        s32 row = tl / numTilesX;
+        int x0 = static_cast<int>(std::floor(col * tileSize.width() * scaleX));
+        int y0 = static_cast<int>(std::floor(row * tileSize.height() * scaleY));
+        int x1 = static_cast<int>(std::ceil((col + 1) * tileSize.width() * scaleX));
+        int y1 = static_cast<int>(std::ceil((row + 1) * tileSize.height() * scaleY));
+        x1 = (x1 > coarseWidth) ? coarseWidth : x1;
+        y1 = (y1 > coarseHeight) ? coarseHeight : y1;
+        long numCoarsePixels = 0, numTissuePixels = 0;
+        for (int y = y0; y < y1; y++) {
+            for (int x = x0; x < x1; x++) {
+                numTissuePixels += tissueMask[static_cast<size_t>(y) * coarseWidth + x];
+                numCoarsePixels++;
+            }
+        }
+        if (numTissuePixels > 0) {
+            tissueFractions[tl] = static_cast<double>(numTissuePixels) / static_cast<double>(numCoarsePixels);
+            tissueFound = true;
+        }
+    }
+    return tissueFound;
+}//end ComputeTissueFractions
+
+void RandomWSISampler::ChooseTilePixelIndices(const u64 numPixels, const u64 count, TilePermutation &permutation,
+    std::vector<u32> &pixelIndices) {
+    pixelIndices.clear();
+    const u64 firstPosition = permutation.position;
+    if ((numPixels == 0) || (count == 0) || (firstPosition >= numPixels)) { return; }
+    //A tile cannot supply more distinct pixels than it has
+    u64 endPosition = ((numPixels - firstPosition) < count) ? numPixels : (firstPosition + count);
+    if ((firstPosition == 0) && (endPosition == numPixels)) {
+        pixelIndices.resize(static_cast<size_t>(numPixels));
+        for (u64 px = 0; px < numPixels; px++) {
+            pixelIndices[static_cast<size_t>(px)] = static_cast<u32>(px);
+        }
+        permutation.position = numPixels;
+        return;
+    }
+    //Sparse Fisher-Yates: only the displaced entries of the virtual permutation are stored,
+    //so the cost is proportional to count rather than to the number of pixels in the tile.
+    //The generator and the displaced entries are kept from earlier calls, so the permutation
+    //continues from firstPosition and this call draws only its own count of positions
+    const u64 numDrawn = endPosition - firstPosition;
+    pixelIndices.reserve(static_cast<size_t>(numDrawn));
+    std::unordered_map<u64, u64> &displaced = permutation.displaced;
+    //Each position adds at most one displaced entry
+    displaced.reserve(displaced.size() + static_cast<size_t>(numDrawn));
+    for (u64 i = firstPosition; i < endPosition; i++) {
+        std::uniform_int_distribution<u64> randPosition(i, numPixels - 1);
+        u64 j = randPosition(permutation.generator);
+        auto jt = displaced.find(j);
+        u64 valueAtJ = (jt == displaced.end()) ? j : jt->second;
+        auto it = displaced.find(i);
+        u64 valueAtI = (it == displaced.end()) ? i : it->second;
+        displaced[j] = valueAtI;
+        //Position i is never read again, so its entry is dropped to keep the state small between calls
+        displaced.erase(i);
+        pixelIndices.push_back(static_cast<u32>(valueAtJ));
+    }
+    permutation.position = endPosition;
+    //Visit the chosen pixels in memory order
+    std::sort(pixelIndices.begin(), pixelIndices.end());
+}//end ChooseTilePixelIndices
+
+void RandomWSISampler::ConvertTilePixels(const RawImage &tileImage, const int validWidth, const int validHeight,
+    const double ODthreshold, RGBSampleStore &tileSamples) const {
+    tileSamples.Clear();
+    int tileWidth = tileImage.width();
+    int numPixels = tileImage.width() * tileImage.height();
+    int width = (validWidth < tileWidth) ? validWidth : tileWidth;
+    int height = (validHeight < tileImage.height()) ? validHeight : tileImage.height();
+    if ((numPixels <= 0) || (width <= 0) || (height <= 0)) { return; }
+    auto numChannels = sedeen::image::channels(tileImage);
+    if (numChannels < 3) { return; }
+    PixelOrder pixelOrder = tileImage.order();
+    if ((pixelOrder != PixelOrder::Interleaved) && (pixelOrder != PixelOrder::Planar)) { return; }
+
+    //Allocate room for every pixel in the valid region
+    tileSamples.Reserve(static_cast<size_t>(width) * static_cast<size_t>(height));
+    //Choose the walker for the tile's pixel order, channel count and bit depth once, then convert whole rows
+    bool walked = VisitTilePixels(tileImage, [&](const auto &walker) {
+        this->ConvertWalkerRows(walker, tileWidth, width, height, ODthreshold, tileSamples);
+    });
+    if (walked) { return; }
+
+    //Other layouts: read the values of each row one at a time, then threshold the row
+    thread_local std::vector<u8> rowRGB;
+    thread_local std::vector<u8> keptRGB;
+    rowRGB.resize(3 * static_cast<size_t>(width));
+    keptRGB.resize(3 * static_cast<size_t>(width));
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            int px = y * tileWidth + x;
+            unsigned int Rindex, Gindex, Bindex;
+            if (pixelOrder == PixelOrder::Interleaved) {
+                Rindex = px * numChannels + 0;
+                Gindex = px * numChannels + 1;
+                Bindex = px * numChannels + 2;
+            }
+            else {
+                Rindex = 0 * numPixels + px;
+                Gindex = 1 * numPixels + px;
+                Bindex = 2 * numPixels + px;
+            }
+            rowRGB[3 * x + 0] = static_cast<u8>((tileImage[Rindex]).as<s32>());
+            rowRGB[3 * x + 1] = static_cast<u8>((tileImage[Gindex]).as<s32>());
+            rowRGB[3 * x + 2] = static_cast<u8>((tileImage[Bindex]).as<s32>());
+        }
+        size_t numKept = m_converter.CompactInterleaved(rowRGB.data(), static_cast<size_t>(width), 3, ODthreshold, keptRGB.data());
+        tileSamples.Append(keptRGB.data(), numKept);
+    }
+}//end ConvertTilePixels
+
+template <typename Walker>
+void RandomWSISampler::ConvertWalkerRows(const Walker &walker, const int tileWidth, const int width, const int height,
+    const double ODthreshold, RGBSampleStore &tileSamples) const {
+    typedef typename Walker::Value Value;
+    //The kept pixels of a row go to a scratch buffer, reused by each worker thread
+    thread_local std::vector<u8> keptRGB;
+    keptRGB.resize(3 * static_cast<size_t>(width));
+    for (int y = 0; y < height; y++) {
+        size_t rowStart = static_cast<size_t>(y) * static_cast<size_t>(tileWidth);
+        size_t numKept = 0;
+        if constexpr (std::is_same<Value, u8>::value) {
+            //8-bit values go straight to the vectorized kernel
+            if constexpr (Walker::IsInterleaved) {
+                numKept = m_converter.CompactInterleaved(walker.Data() + walker.Index(rowStart, 0), static_cast<size_t>(width),
+                    Walker::Channels, ODthreshold, keptRGB.data());
+            }
+            else {
+                numKept = m_converter.CompactPlanar(walker.ChannelData(0) + rowStart, walker.ChannelData(1) + rowStart,
+                    walker.ChannelData(2) + rowStart, static_cast<size_t>(width), ODthreshold, keptRGB.data());
+            }
+        }
+        else {
+            //Wider values are thresholded at full precision, then stored rounded to 8 bits
+            const double *odTable = GetODLookupTableFor<Value>();
+            for (size_t px = rowStart; px < rowStart + static_cast<size_t>(width); px++) {
+                Value r = walker.R(px);
+                Value g = walker.G(px);
+                Value b = walker.B(px);
+                u8 *out = keptRGB.data() + 3 * numKept;
+                out[0] = ToEightBit(r);
+                out[1] = ToEightBit(g);
+                out[2] = ToEightBit(b);
+                numKept += (odTable[r] + odTable[g] + odTable[b] > ODthreshold) ? 1 : 0;
+            }
+        }
+        tileSamples.Append(keptRGB.data(), numKept);
+    }
+}//end ConvertWalkerRows
+
+void RandomWSISampler::SampleTile(const RawImage &tileImage, const u64 count, TilePermutation &permutation,
+    const double ODthreshold, RGBSampleStore &tileSamples) const {
+    tileSamples.Clear();
+    //The tile server pads tiles at the edges to keep all tiles the same size
+    auto numPixels = tileImage.width() * tileImage.height();
+    if ((numPixels <= 0) || (count == 0)) { return; }
+    auto numChannels = sedeen::image::channels(tileImage);
+    if (numChannels < 3) { return; }
+    //Get the pixel order of the image: Interleaved or Planar
+    PixelOrder pixelOrder = tileImage.order();
+    if ((pixelOrder != PixelOrder::Interleaved) && (pixelOrder != PixelOrder::Planar)) { return; }
+
+    //Choose the pixel indices, no duplication
+    std::vector<u32> pixelIndices;
+    ChooseTilePixelIndices(static_cast<u64>(numPixels), count, permutation, pixelIndices);
+
+    //Choose the walker for the tile's pixel order, channel count and bit depth once
+    bool walked = VisitTilePixels(tileImage, [&](const auto &walker) {
+        this->SampleWalkerPixels(walker, pixelIndices, ODthreshold, tileSamples);
+    });
+    if (walked) { return; }
+
+    //Other layouts: read the values of the chosen pixels one at a time, then threshold them together
+    thread_local std::vector<u8> chosenRGB;
+    thread_local std::vector<u8> keptRGB;
+    chosenRGB.resize(3 * pixelIndices.size());
+    keptRGB.resize(3 * pixelIndices.size());
+    for (size_t i = 0; i < pixelIndices.size(); i++) {
+        unsigned int px = pixelIndices[i];
+        unsigned int Rindex, Gindex, Bindex;
+        if (pixelOrder == PixelOrder::Interleaved) {
+            //RGB RGB RGB ... (if numChannels=3)
+            Rindex = px * numChannels + 0;
+            Gindex = px * numChannels + 1;
+            Bindex = px * numChannels + 2;
+        }
+        else {
+            //RRR... GGG... BBB...
+            Rindex = 0 * numPixels + px;
+            Gindex = 1 * numPixels + px;
+            Bindex = 2 * numPixels + px;
+        }
+        chosenRGB[3 * i + 0] = static_cast<u8>((tileImage[Rindex]).as<s32>());
+        chosenRGB[3 * i + 1] = static_cast<u8>((tileImage[Gindex]).as<s32>());
+        chosenRGB[3 * i + 2] = static_cast<u8>((tileImage[Bindex]).as<s32>());
+    }
+    size_t numKept = m_converter.CompactInterleaved(chosenRGB.data(), pixelIndices.size(), 3, ODthreshold, keptRGB.data());
+    tileSamples.Append(keptRGB.data(), numKept);
+}//end SampleTile
+
+template <typename Walker>
+void RandomWSISampler::SampleWalkerPixels(const Walker &walker, const std::vector<u32> &pixelIndices,
+    const double ODthreshold, RGBSampleStore &tileSamples) const {
+    typedef typename Walker::Value Value;
+    //The slab has at most one sample per chosen pixel; only the pixels above the threshold are kept
+    thread_local std::vector<u8> keptRGB;
+    keptRGB.resize(3 * pixelIndices.size());
+    size_t numKept = 0;
+    if constexpr (std::is_same<Value, u8>::value) {
+        numKept = m_converter.CompactSelected(walker.Data(), pixelIndices.data(), pixelIndices.size(),
+            Walker::Channels, walker.PlaneStride(), ODthreshold, keptRGB.data());
+    }
+    else {
+        //Wider values are thresholded at full precision, then stored rounded to 8 bits
+        const double *odTable = GetODLookupTableFor<Value>();
+        for (auto pxit = pixelIndices.begin(); pxit != pixelIndices.end(); ++pxit) {
+            Value r = walker.R(*pxit);
+            Value g = walker.G(*pxit);
+            Value b = walker.B(*pxit);
+            u8 *out = keptRGB.data() + 3 * numKept;
+            out[0] = ToEightBit(r);
+            out[1] = ToEightBit(g);
+            out[2] = ToEightBit(b);
+            numKept += (odTable[r] + odTable[g] + odTable[b] > ODthreshold) ? 1 : 0;
+        }
+    }
+    tileSamples.Append(keptRGB.data(), numKept);
+}//end SampleWalkerPixels
 
 } // namespace image
 } // namespace sedeen
@@ -29,8 +29,17 @@
 #include "Geometry.h"
 #include "Image.h"
 
+#include "PhiloxRandom.h"
+#include "RGBSampleStore.h"
+#include "TileODConverter.h"
+
 #include <chrono>
+#include <functional>
+#include <memory>
 #include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
 
 //OpenCV include
 #include <opencv2/core/core.hpp>
@@ -38,8 +47,56 @@
 namespace sedeen {
 namespace image {
 
+///Counts and timings of the pixel conversion in the most recent sampling call
+struct SamplingStatistics {
+    SamplingStatistics() : numPixelsConverted(0), numPixelsKept(0), conversionSeconds(0.0), numTilesRead(0), elapsedSeconds(0.0),
+        numRounds(0), bytesPerChannel(0), loadedFromCache(false) {}
+    ///The number of pixels converted to optical density and compared with the threshold (the candidates drawn)
+    u64 numPixelsConverted;
+    ///The number of pixels above the threshold
+    u64 numPixelsKept;
+    ///The time spent converting and compacting pixels, summed over the worker threads
+    double conversionSeconds;
+    ///The number of tiles read from the slide
+    u64 numTilesRead;
+    ///The wall-clock time from the start of the sampling call until the last tile was converted
+    double elapsedSeconds;
+    ///The number of rounds of candidates drawn (more than one when counting only pixels above the threshold)
+    int numRounds;
+    ///The largest size of a channel value in the tiles read, in bytes (0 if no tile was read)
+    int bytesPerChannel;
+    ///The instruction set of the conversion kernel
+    std::string instructionSet;
+    ///Whether the samples were loaded from the sample cache (nothing was converted)
+    bool loadedFromCache;
+    ///Get the fraction of the pixels converted that were above the threshold
+    inline const double GetAcceptanceRate() const {
+        return (numPixelsConverted > 0) ? static_cast<double>(numPixelsKept) / static_cast<double>(numPixelsConverted) : 0.0;
+    }
+    ///Get the number of pixels converted per second by one worker thread
+    inline const double GetConversionThroughput() const {
+        return (conversionSeconds > 0.0) ? static_cast<double>(numPixelsConverted) / conversionSeconds : 0.0;
+    }
+};
+
+///The state of the virtual pixel permutation of one tile (sparse Fisher-Yates), kept between rounds
+///of candidates so that each round continues the permutation instead of replaying it from the start
+struct TilePermutation {
+    TilePermutation(const u64 seed, const u64 stream) : generator(seed, stream), position(0), displaced() {}
+    ///The tile's random number stream, advanced past the positions drawn so far
+    PhiloxEngine generator;
+    ///The number of positions of the permutation drawn so far
+    u64 position;
+    ///The entries of the permutation at or after position that differ from the identity
+    std::unordered_map<u64, u64> displaced;
+};
+
 class PATHCORE_IMAGE_API RandomWSISampler {
 
+public:
+    ///A consumer of a block of pixels: one row per pixel, R, G, B optical density columns (type double)
+    typedef RGBSampleStore::BlockConsumer BlockConsumer;
+
 public:
     RandomWSISampler(std::shared_ptr<tile::Factory> source);
     virtual ~RandomWSISampler();
@@ -47,15 +104,168 @@ public:
     ///Populate an OutputArray with pixels chosen without duplication from the source tile factory
     virtual bool ChooseRandomPixels(cv::OutputArray outputMatrix, const long int numberOfPixels, const double ODthreshold,
         const int level = 0, const int focusPlane = -1, const int band = -1); //Negative indicates to use the source default values
+    ///Fill a compact RGB sample store with pixels chosen without duplication from the source tile factory (the store may spill to disk)
+    virtual bool ChooseRandomPixels(RGBSampleStore &samples, const s64 numberOfPixels, const double ODthreshold,
+        const int level = 0, const int focusPlane = -1, const int band = -1); //Negative indicates to use the source default values
+
+    ///Visit every tile on a level once, passing the OD values of the pixels above ODthreshold to the consumer one tile at a time
+    virtual bool StreamAllPixels(const BlockConsumer &consumer, const double ODthreshold,
+        const int level = 0, const int focusPlane = -1, const int band = -1); //Negative indicates to use the source default values
+
+    ///Populate an OutputArray with a uniform random sample of at most reservoirSize pixels above ODthreshold from a single pass over every tile of a level
+    virtual bool ReservoirSamplePixels(cv::OutputArray outputMatrix, const long int reservoirSize, const double ODthreshold,
+        const int level = 0, const int focusPlane = -1, const int band = -1); //Negative indicates to use the source default values
+    ///Fill a compact RGB sample store with a uniform random sample of at most reservoirSize pixels above ODthreshold from a single pass over every tile of a level
+    virtual bool ReservoirSamplePixels(RGBSampleStore &samples, const s64 reservoirSize, const double ODthreshold,
+        const int level = 0, const int focusPlane = -1, const int band = -1); //Negative indicates to use the source default values
+
+    ///Get/Set the number of worker threads used to fetch and convert tiles (less than 1 uses all available processors)
+    inline const int GetNumThreads() const { return m_numThreads; }
+    ///Get/Set the number of worker threads used to fetch and convert tiles (less than 1 uses all available processors)
+    inline void SetNumThreads(const int n) { m_numThreads = n; }
+
+    ///Get/Set the number of tiles each reader may fetch ahead of the tile being processed
+    inline const int GetPrefetchDepth() const { return m_prefetchDepth; }
+    ///Get/Set the number of tiles each reader may fetch ahead of the tile being processed
+    inline void SetPrefetchDepth(const int d) { m_prefetchDepth = (d < 1) ? 1 : d; }
+
+    ///Get/Set the seed of the random number generator. The allocation, reservoir and per-tile streams are derived from it.
+    inline const u64 GetSeed() const { return m_seed; }
+    ///Get/Set the seed of the random number generator. The allocation, reservoir and per-tile streams are derived from it.
+    void SetSeed(const u64 s);
+
+    ///The random number stream used to split the sample budget across tiles
+    static const u64 AllocationStream = 0;
+    ///The random number stream used by ReservoirSamplePixels
+    static const u64 ReservoirStream = 1;
+    ///The random number stream used to choose pixels within a tile (distinct for every level and tile)
+    static inline const u64 TileStream(const int level, const s32 tile) {
+        return (static_cast<u64>(level + 1) << 32) | static_cast<u64>(static_cast<u32>(tile));
+    }
+
+    ///Get/Set whether to weight tiles by the tissue fraction found in a low resolution prepass (background tiles are not sampled)
+    inline const bool GetUseTissueMask() const { return m_useTissueMask; }
+    ///Get/Set whether to weight tiles by the tissue fraction found in a low resolution prepass (background tiles are not sampled)
+    inline void SetUseTissueMask(const bool u) { m_useTissueMask = u; }
+
+    ///Get/Set whether ChooseRandomPixels counts only pixels above the threshold, drawing more candidates in rounds until it has numberOfPixels of them
+    inline const bool GetCountForegroundOnly() const { return m_countForegroundOnly; }
+    ///Get/Set whether ChooseRandomPixels counts only pixels above the threshold, drawing more candidates in rounds until it has numberOfPixels of them
+    inline void SetCountForegroundOnly(const bool c) { m_countForegroundOnly = c; }
+
+    ///The maximum number of rounds of candidates when counting only pixels above the threshold
+    static const int MaxForegroundRounds = 8;
+    ///The largest size of a round of candidates, as a multiple of the candidates drawn before it
+    static const int MaxForegroundRoundGrowth = 16;
+
+    ///Get/Set the directory that sampled pixels are cached in, as .npy files (empty disables the cache)
+    inline const std::string GetCacheDirectory() const { return m_cacheDirectory; }
+    ///Get/Set the directory that sampled pixels are cached in, as .npy files (empty disables the cache)
+    inline void SetCacheDirectory(const std::string &dir) { m_cacheDirectory = dir; }
+
+    ///Get/Set the largest number of bytes the cache files may take; the least recently used entries are deleted beyond it
+    inline const u64 GetCacheByteBudget() const { return m_cacheByteBudget; }
+    ///Get/Set the largest number of bytes the cache files may take; the least recently used entries are deleted beyond it
+    inline void SetCacheByteBudget(const u64 b) { m_cacheByteBudget = b; }
+
+    ///Get/Set the text identifying the slide in cache keys (the cache is not used if this is empty)
+    inline const std::string GetSlideIdentity() const { return m_slideIdentity; }
+    ///Get/Set the text identifying the slide in cache keys (the cache is not used if this is empty)
+    inline void SetSlideIdentity(const std::string &id) { m_slideIdentity = id; }
+
+    ///Get the pixel conversion statistics of the most recent sampling call
+    inline const SamplingStatistics GetSamplingStatistics() const { return m_statistics; }
+
+protected:
+    ///A consumer of the RGB values of the pixels above the threshold in one tile
+    typedef std::function<void(const RGBSampleStore&)> SampleBlockConsumer;
 
 protected:
+    ///Visit every tile on a level once, passing the RGB values of the pixels above ODthreshold to the consumer one tile at a time.
+    ///Returns false if a tile could not be read
+    bool StreamAllSampleBlocks(const SampleBlockConsumer &consumer, const double ODthreshold,
+        const int level = 0, const int focusPlane = -1, const int band = -1);
     ///Allow derived classes to get the source factory pointer
     inline std::shared_ptr<tile::Factory> GetSourceFactory() { return m_sourceFactory; }
-    ///Allow derived classes access to the random number generator (64-bit Mersenne Twister)
-    std::mt19937_64 m_rgen; //64-bit Mersenne Twister
+    ///Draw tileCounts[tl] candidates from each tile on a level and fill samples with those above ODthreshold in tile order.
+    ///If tilePermutations is not null, each tile continues the permutation kept in it from earlier calls (created on first use);
+    ///otherwise each tile starts a new permutation. Tiles are read and converted in parallel. Returns false if a tile could not be read
+    bool SampleTileCandidates(const std::vector<u64> &tileCounts, std::vector<std::unique_ptr<TilePermutation>> *tilePermutations,
+        const double ODthreshold, const int level, const s32 focusPlane, const s32 band, RGBSampleStore &samples);
+    ///Draw candidates in rounds until numberOfPixels of them are above ODthreshold: a pilot round of numberOfPixels candidates
+    ///estimates the acceptance rate, and each later round draws only enough candidates to fill the shortfall
+    bool ChooseForegroundPixels(RGBSampleStore &samples, const u64 numberOfPixels, const std::vector<double> &tileWeights,
+        const double ODthreshold, const int level, const s32 focusPlane, const s32 band);
+    ///Split numberOfPixels samples across tiles with conditional binomial draws, one draw per tile
+    void AllocateSamplesToTiles(const u64 numberOfPixels, const s32 numTiles, std::vector<u64> &tileSamplingCounts);
+    ///Split numberOfPixels samples across tiles in proportion to tileWeights, with conditional binomial draws
+    void AllocateSamplesToTiles(const u64 numberOfPixels, const std::vector<double> &tileWeights, 
+        std::vector<u64> &tileSamplingCounts);
+    ///Find the fraction of each tile on level that contains tissue, using the coarsest suitable pyramid level. Returns false if no tissue is found or no coarser level is suitable.
+    ///Sets readFailed if the coarse level could not be read
+    bool ComputeTissueFractions(const int level, const double ODthreshold, std::vector<double> &tissueFractions, bool &readFailed) const;
+    ///Choose distinct indices in [0, numPixels) with a sparse Fisher-Yates shuffle: the next count positions of the tile's
+    ///permutation, output in ascending order. Successive calls on the same permutation never repeat an index.
+    static void ChooseTilePixelIndices(const u64 numPixels, const u64 count, TilePermutation &permutation,
+        std::vector<u32> &pixelIndices);
+    ///Check every pixel in the top-left validWidth x validHeight region of a tile, place the RGB values of those above ODthreshold in tileSamples
+    void ConvertTilePixels(const RawImage &tileImage, const int validWidth, const int validHeight,
+        const double ODthreshold, RGBSampleStore &tileSamples) const;
+    ///Choose count pixels without duplication from one tile, continuing its pixel permutation,
+    ///and place the RGB values of those above ODthreshold in tileSamples
+    void SampleTile(const RawImage &tileImage, const u64 count, TilePermutation &permutation,
+        const double ODthreshold, RGBSampleStore &tileSamples) const;
+    ///Threshold and compact the top-left width x height pixels of a tile, through a walker specialized for its layout
+    template <typename Walker>
+    void ConvertWalkerRows(const Walker &walker, const int tileWidth, const int width, const int height,
+        const double ODthreshold, RGBSampleStore &tileSamples) const;
+    ///Threshold and compact the chosen pixels of a tile, through a walker specialized for its layout
+    template <typename Walker>
+    void SampleWalkerPixels(const Walker &walker, const std::vector<u32> &pixelIndices,
+        const double ODthreshold, RGBSampleStore &tileSamples) const;
+    ///Build the text that identifies a sampling request in the cache: the slide, the method and every parameter that changes its output
+    std::string BuildCacheKey(const std::string &method, const s64 count, const double ODthreshold,
+        const int level, const int focusPlane, const int band) const;
+    ///Load the samples cached under a key. Returns false if the cache is disabled or has no entry for the key.
+    bool ReadCachedSamples(const std::string &key, RGBSampleStore &samples) const;
+    ///Save samples in the cache under a key. Returns false if the cache is disabled or the files cannot be written.
+    bool WriteCachedSamples(const std::string &key, const RGBSampleStore &samples) const;
+    ///Get the path of the cache files for a key, without the file extension
+    std::string GetCacheFileStem(const std::string &key) const;
+    ///Delete the least recently used cache entries, other than the one at keepStem, until the cache is within its byte budget
+    void DropCacheToBudget(const std::string &keepStem) const;
+    ///Add the counts and time of one worker thread to the statistics of the current sampling call
+    void AddSamplingStatistics(const u64 numConverted, const u64 numKept, const u64 numTiles, const double seconds,
+        const int bytesPerChannel);
+    ///Clear the statistics at the start of a sampling call
+    void ResetSamplingStatistics();
+    ///Allow derived classes access to the random number generator (counter-based, Philox4x32-10)
+    PhiloxEngine m_rgen;
 
 private:
     std::shared_ptr<tile::Factory> m_sourceFactory;
+    ///The seed of m_rgen and of every random number stream of this sampler
+    u64 m_seed;
+    ///The number of worker threads to use in ChooseRandomPixels
+    int m_numThreads;
+    ///The number of tiles read ahead of use
+    int m_prefetchDepth;
+    ///Whether to restrict sampling to tiles containing tissue
+    bool m_useTissueMask;
+    ///Whether the requested sample size counts only pixels above the threshold
+    bool m_countForegroundOnly;
+    ///The directory of the sample cache, empty if caching is off
+    std::string m_cacheDirectory;
+    ///The largest number of bytes the sample cache may take
+    u64 m_cacheByteBudget;
+    ///Identifies the slide in cache keys
+    std::string m_slideIdentity;
+    ///Converts tile pixels to OD, thresholds and compacts them with the best instruction set available
+    TileODConverter m_converter;
+    ///Statistics of the most recent sampling call
+    SamplingStatistics m_statistics;
+    ///The start time of the most recent sampling call
+    std::chrono::steady_clock::time_point m_statisticsStart;
 
 };
 
@@ -0,0 +1,149 @@
+/*=============================================================================
+ *
+ *  Copyright (c) 2020 Sunnybrook Research Institute
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ *
+ *=============================================================================*/
+
+#include "RegionMask.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace sedeen {
+namespace image {
+
+RegionMask::RegionMask(const std::vector<PointF> &vertices)
+    : m_minX(0.0), m_minY(0.0), m_maxX(0.0), m_maxY(0.0)
+{
+    if (vertices.size() < 3) { return; }
+    m_minX = m_maxX = vertices.front().getX();
+    m_minY = m_maxY = vertices.front().getY();
+    for (size_t i = 0; i < vertices.size(); i++) {
+        //The last vertex connects back to the first
+        const PointF &a = vertices[i];
+        const PointF &b = vertices[(i + 1) % vertices.size()];
+        m_minX = (a.getX() < m_minX) ? a.getX() : m_minX;
+        m_maxX = (a.getX() > m_maxX) ? a.getX() : m_maxX;
+        m_minY = (a.getY() < m_minY) ? a.getY() : m_minY;
+        m_maxY = (a.getY() > m_maxY) ? a.getY() : m_maxY;
+        if (a.getY() == b.getY()) { continue; }
+        Edge edge;
+        if (a.getY() < b.getY()) {
+            edge.x0 = a.getX(); edge.y0 = a.getY(); edge.x1 = b.getX(); edge.y1 = b.getY();
+        }
+        else {
+            edge.x0 = b.getX(); edge.y0 = b.getY(); edge.x1 = a.getX(); edge.y1 = a.getY();
+        }
+        m_edges.push_back(edge);
+    }
+}//end constructor
+
+RegionMask::~RegionMask(void) {
+}//end destructor
+
+const Rect RegionMask::GetBoundingRect() const {
+    if (!this->IsValid()) { return Rect(Point(0, 0), Size(0, 0)); }
+    int x0 = static_cast<int>(std::floor(m_minX));
+    int y0 = static_cast<int>(std::floor(m_minY));
+    int x1 = static_cast<int>(std::ceil(m_maxX));
+    int y1 = static_cast<int>(std::ceil(m_maxY));
+    return Rect(Point(x0, y0), Size(x1 - x0, y1 - y0));
+}//end GetBoundingRect
+
+long int RegionMask::GetBlockSpans(const Rect &block, std::vector<RowSpan> &spans) const {
+    spans.clear();
+    if (!this->IsValid() || (block.width() <= 0) || (block.height() <= 0)) { return 0; }
+    //Keep only the edges that reach the block's rows
+    const double blockTop = static_cast<double>(block.y());
+    const double blockBottom = static_cast<double>(block.y() + block.height());
+    std::vector<const Edge*> activeEdges;
+    for (auto it = m_edges.begin(); it != m_edges.end(); ++it) {
+        if ((it->y1 > blockTop) && (it->y0 < blockBottom)) {
+            activeEdges.push_back(&(*it));
+        }
+    }
+    if (activeEdges.size() < 2) { return 0; }
+
+    long int numInside = 0;
+    std::vector<double> crossings;
+    crossings.reserve(activeEdges.size());
+    for (int row = 0; row < block.height(); row++) {
+        //Find where the edges cross the line through the pixel centres of this row
+        double yc = static_cast<double>(block.y() + row) + 0.5;
+        crossings.clear();
+        for (auto it = activeEdges.begin(); it != activeEdges.end(); ++it) {
+            const Edge &e = **it;
+            //Half-open in y, so a vertex shared by two edges is crossed once
+            if ((yc >= e.y0) && (yc < e.y1)) {
+                crossings.push_back(e.x0 + (yc - e.y0) * (e.x1 - e.x0) / (e.y1 - e.y0));
+            }
+        }
+        if (crossings.size() < 2) { continue; }
+        std::sort(crossings.begin(), crossings.end());
+        //Pixels whose centres lie between pairs of crossings are inside
+        for (size_t c = 0; c + 1 < crossings.size(); c += 2) {
+            int xBegin = static_cast<int>(std::ceil(crossings[c] - 0.5)) - block.x();
+            int xEnd = static_cast<int>(std::ceil(crossings[c + 1] - 0.5)) - block.x();
+            xBegin = (xBegin < 0) ? 0 : xBegin;
+            xEnd = (xEnd > block.width()) ? block.width() : xEnd;
+            if (xEnd <= xBegin) { continue; }
+            RowSpan span;
+            span.y = row;
+            span.xBegin = xBegin;
+            span.xEnd = xEnd;
+            spans.push_back(span);
+            numInside += xEnd - xBegin;
+        }
+    }
+    return numInside;
+}//end GetBlockSpans
+
+long int RegionMask::CountBlockPixels(const Rect &block) const {
+    std::vector<RowSpan> spans;
+    return this->GetBlockSpans(block, spans);
+}//end CountBlockPixels
+
+long int RegionMask::UniteSpans(std::vector<RowSpan> &spans) {
+    std::sort(spans.begin(), spans.end(), [](const RowSpan &a, const RowSpan &b) {
+        return (a.y < b.y) || ((a.y == b.y) && (a.xBegin < b.xBegin));
+    });
+    long int numPixels = 0;
+    size_t numUnited = 0;
+    for (size_t i = 0; i < spans.size(); i++) {
+        if ((numUnited > 0) && (spans[numUnited - 1].y == spans[i].y) && (spans[i].xBegin <= spans[numUnited - 1].xEnd)) {
+            //Extend the previous span
+            if (spans[i].xEnd > spans[numUnited - 1].xEnd) {
+                numPixels += spans[i].xEnd - spans[numUnited - 1].xEnd;
+                spans[numUnited - 1].xEnd = spans[i].xEnd;
+            }
+        }
+        else {
+            spans[numUnited] = spans[i];
+            numPixels += spans[i].xEnd - spans[i].xBegin;
+            numUnited++;
+        }
+    }
+    spans.resize(numUnited);
+    return numPixels;
+}//end UniteSpans
+
+} // namespace image
+} // namespace sedeen
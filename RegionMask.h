@@ -0,0 +1,80 @@
+/*=============================================================================
+ *
+ *  Copyright (c) 2020 Sunnybrook Research Institute
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ *
+ *=============================================================================*/
+
+#ifndef SEDEEN_SRC_FILTER_REGIONMASK_H
+#define SEDEEN_SRC_FILTER_REGIONMASK_H
+
+#include "Global.h"
+#include "Geometry.h"
+#include "Image.h"
+
+#include <vector>
+
+namespace sedeen {
+namespace image {
+
+///Rasterizes a polygon with scanlines, one rectangular block of pixels at a time, so that no mask
+///larger than a block is ever held. A pixel is inside if its centre is inside the polygon (even-odd rule).
+///Vertices and blocks are in the same pixel coordinates (level 0 of the image for regions of interest).
+class PATHCORE_IMAGE_API RegionMask {
+public:
+    ///A run of pixels inside the polygon in one row of a block: columns [xBegin, xEnd) of row y, in block coordinates
+    struct RowSpan {
+        int y;
+        int xBegin;
+        int xEnd;
+    };
+
+public:
+    RegionMask(const std::vector<PointF> &vertices);
+    virtual ~RegionMask();
+
+    ///Get whether the polygon has an interior (at least three vertices, not all on one line)
+    inline const bool IsValid() const { return !m_edges.empty() && (m_maxX > m_minX) && (m_maxY > m_minY); }
+    ///Get the smallest rectangle of pixels containing the polygon
+    const Rect GetBoundingRect() const;
+
+    ///Fill spans with the runs of pixels of a block inside the polygon, in row order. Returns the number of pixels inside.
+    long int GetBlockSpans(const Rect &block, std::vector<RowSpan> &spans) const;
+    ///Get the number of pixels of a block inside the polygon
+    long int CountBlockPixels(const Rect &block) const;
+
+    ///Sort spans into row order and merge those that overlap or touch, so that spans gathered from several
+    ///polygons cover each pixel once. Returns the number of pixels covered.
+    static long int UniteSpans(std::vector<RowSpan> &spans);
+
+private:
+    ///A polygon edge with y0 < y1 (horizontal edges never cross a scanline and are dropped)
+    struct Edge {
+        double x0, y0, x1, y1;
+    };
+
+private:
+    std::vector<Edge> m_edges;
+    double m_minX, m_minY, m_maxX, m_maxY;
+};
+
+} // namespace image
+} // namespace sedeen
+#endif
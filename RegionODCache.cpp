@@ -0,0 +1,105 @@
+/*=============================================================================
+ *
+ *  Copyright (c) 2020 Sunnybrook Research Institute
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ *
+ *=============================================================================*/
+
+#include "RegionODCache.h"
+
+
+namespace sedeen {
+namespace image {
+
+RegionODCache::RegionODCache(const size_t maxEntries /* = 4096 */)
+    : m_entries(), m_insertionOrder(),
+    m_maxEntries((maxEntries < 1) ? 1 : maxEntries)
+{}//end constructor
+
+RegionODCache::~RegionODCache() {
+}//end destructor
+
+bool RegionODCache::Find(const RegionOutlines &outlines, const int level, ODMoments &moments) const {
+    auto it = m_entries.find(HashOutlines(outlines, level));
+    if (it == m_entries.end()) { return false; }
+    //Compare the full key
+    if (it->second.level != level) { return false; }
+    if (it->second.outlines.size() != outlines.size()) { return false; }
+    for (size_t r = 0; r < outlines.size(); r++) {
+        const std::vector<PointF> &saved = it->second.outlines[r];
+        if (saved.size() != outlines[r].size()) { return false; }
+        for (size_t v = 0; v < saved.size(); v++) {
+            if ((saved[v].getX() != outlines[r][v].getX()) || (saved[v].getY() != outlines[r][v].getY())) { return false; }
+        }
+    }
+    moments = it->second.moments;
+    return true;
+}//end Find
+
+void RegionODCache::Insert(const RegionOutlines &outlines, const int level, const ODMoments &moments) {
+    u64 hash = HashOutlines(outlines, level);
+    Entry entry;
+    entry.outlines = outlines;
+    entry.level = level;
+    entry.moments = moments;
+    auto it = m_entries.find(hash);
+    if (it != m_entries.end()) {
+        //Replace the entry, keeping its place in the insertion order
+        it->second = entry;
+        return;
+    }
+    while (!m_insertionOrder.empty() && (m_entries.size() >= m_maxEntries)) {
+        m_entries.erase(m_insertionOrder.front());
+        m_insertionOrder.pop_front();
+    }
+    m_entries[hash] = entry;
+    m_insertionOrder.push_back(hash);
+}//end Insert
+
+void RegionODCache::Clear() {
+    m_entries.clear();
+    m_insertionOrder.clear();
+}//end Clear
+
+u64 RegionODCache::HashOutlines(const RegionOutlines &outlines, const int level) {
+    u64 hash = 14695981039346656037ULL;
+    auto addBytes = [&hash](const void *data, const size_t numBytes) {
+        const unsigned char *bytes = static_cast<const unsigned char*>(data);
+        for (size_t i = 0; i < numBytes; i++) {
+            hash ^= static_cast<u64>(bytes[i]);
+            hash *= 1099511628211ULL;
+        }
+    };
+    s64 value = level;
+    addBytes(&value, sizeof(value));
+    for (auto it = outlines.begin(); it != outlines.end(); ++it) {
+        //The vertex count separates the outlines of the group
+        value = static_cast<s64>(it->size());
+        addBytes(&value, sizeof(value));
+        for (auto vit = it->begin(); vit != it->end(); ++vit) {
+            double xy[2] = { vit->getX(), vit->getY() };
+            addBytes(xy, sizeof(xy));
+        }
+    }
+    return hash;
+}//end HashOutlines
+
+} // namespace image
+} // namespace sedeen
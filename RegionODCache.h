@@ -0,0 +1,89 @@
+/*=============================================================================
+ *
+ *  Copyright (c) 2020 Sunnybrook Research Institute
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ *
+ *=============================================================================*/
+
+#ifndef SEDEEN_SRC_FILTER_REGIONODCACHE_H
+#define SEDEEN_SRC_FILTER_REGIONODCACHE_H
+
+#include "Global.h"
+#include "Geometry.h"
+
+#include <deque>
+#include <map>
+#include <vector>
+
+namespace sedeen {
+namespace image {
+
+///Keeps the OD sums of groups of regions of interest, keyed by the regions' outlines and the pyramid level they
+///were measured on, so that regions that have not moved are not read again when the regions of interest change.
+class PATHCORE_IMAGE_API RegionODCache {
+public:
+    ///The sums of the OD, and of its square, of a number of pixels
+    struct ODMoments {
+        double odSum[3] = { 0.0, 0.0, 0.0 };
+        double odSumSq[3] = { 0.0, 0.0, 0.0 };
+        long int numPixels = 0;
+    };
+    ///The outlines of a group of regions, as polygon vertices in level 0 image coordinates
+    typedef std::vector<std::vector<PointF>> RegionOutlines;
+
+public:
+    RegionODCache(const size_t maxEntries = 4096);
+    virtual ~RegionODCache();
+
+    ///Fill moments with the saved sums of a group of regions on a level. Returns false if they are not saved.
+    bool Find(const RegionOutlines &outlines, const int level, ODMoments &moments) const;
+    ///Save the sums of a group of regions on a level, removing the oldest entry if the cache is full
+    void Insert(const RegionOutlines &outlines, const int level, const ODMoments &moments);
+    ///Remove all entries
+    void Clear();
+
+    ///Get the number of saved entries
+    inline const size_t GetNumEntries() const { return m_entries.size(); }
+    ///Get/Set the maximum number of saved entries
+    inline const size_t GetMaxEntries() const { return m_maxEntries; }
+    ///Get/Set the maximum number of saved entries
+    inline void SetMaxEntries(const size_t n) { m_maxEntries = (n < 1) ? 1 : n; }
+
+    ///Get the 64-bit FNV-1a hash of the outlines of a group of regions and a level
+    static u64 HashOutlines(const RegionOutlines &outlines, const int level);
+
+private:
+    ///A saved entry holds its full key, to rule out hash collisions
+    struct Entry {
+        RegionOutlines outlines;
+        int level;
+        ODMoments moments;
+    };
+
+private:
+    std::map<u64, Entry> m_entries;
+    ///Hashes of the entries in the order they were saved
+    std::deque<u64> m_insertionOrder;
+    size_t m_maxEntries;
+};
+
+} // namespace image
+} // namespace sedeen
+#endif
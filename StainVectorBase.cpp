@@ -24,12 +24,30 @@
 
 #include "StainVectorBase.h"
 
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <vector>
+
 namespace sedeen {
 namespace image {
 
 StainVectorBase::StainVectorBase(std::shared_ptr<tile::Factory> source) 
     : m_sourceFactory(source),
-    m_randomWSISampler(std::make_shared<RandomWSISampler>(source))
+    m_randomWSISampler(std::make_shared<RandomWSISampler>(source)),
+    m_samplingLevel(0),
+    m_useAllPixels(false),
+    m_sampleKey(),
+    m_sampleThreshold(0.0),
+    m_samplesAreEightBit(false),
+    m_haveSamples(false),
+    m_sampleGeneration(0),
+    m_samplesWereDrawn(false),
+    m_targetPrecision(0.0),
+    m_autoSampleSize(0),
+    m_achievedPrecision(0.0),
+    m_lastAutoSizeKey(),
+    m_lastAutoSampleSize(0)
 {
 }//end constructor
 
@@ -39,5 +57,202 @@ StainVectorBase::~StainVectorBase(void) {
 void StainVectorBase::ComputeStainVectors(double (&outputVectors)[9]) {
 }//end ComputeStainVectors
 
+bool StainVectorBase::SampleKey::operator==(const SampleKey &other) const {
+    return (sampleSize == other.sampleSize) && (level == other.level) && (seed == other.seed)
+        && (useReservoir == other.useReservoir) && (useTissueMask == other.useTissueMask)
+        && (countForegroundOnly == other.countForegroundOnly);
+}//end SampleKey::operator==
+
+bool StainVectorBase::AutoSizeKey::operator==(const AutoSizeKey &other) const {
+    return (sampleKey == other.sampleKey) && (ODthreshold == other.ODthreshold) && (targetPrecision == other.targetPrecision);
+}//end AutoSizeKey::operator==
+
+const StainVectorBase::SampleKey StainVectorBase::MakeSampleKey(const s64 sampleSize, const bool useReservoir) const {
+    SampleKey key;
+    key.sampleSize = sampleSize;
+    key.level = this->GetSamplingLevel();
+    key.seed = this->GetSeed();
+    key.useReservoir = useReservoir;
+    key.useTissueMask = this->GetUseTissueMask();
+    key.countForegroundOnly = this->GetCountForegroundOnly();
+    return key;
+}//end MakeSampleKey
+
+const RGBSampleStore* StainVectorBase::ObtainSamples(const s64 sampleSize, const double ODthreshold, const bool useReservoir) {
+    auto theSampler = this->GetRandomWSISampler();
+    if ((theSampler == nullptr) || (sampleSize <= 0)) { return nullptr; }
+    SampleKey key = this->MakeSampleKey(sampleSize, useReservoir);
+    m_samplesWereDrawn = false;
+
+    if (m_haveSamples && (key == m_sampleKey)) {
+        //Unchanged inputs: reuse the sample as it is
+        if (ODthreshold == m_sampleThreshold) { return &m_samples; }
+        //A raised threshold keeps the pixels of the same candidates that pass it, so filter the kept sample rather than
+        //read the slide again. A fresh draw must choose the same candidates for the result to match, so this is not done
+        //with the tissue mask (its tile weights, and so the allocation of candidates to tiles, depend on the threshold),
+        //with a reservoir, or with a sample size that counts only pixels above the threshold; those are drawn again.
+        //A fresh draw thresholds wider channel values at full precision, so only samples read from 8-bit tiles are filtered
+        if ((ODthreshold > m_sampleThreshold) && !useReservoir && !key.countForegroundOnly && !key.useTissueMask
+            && m_samplesAreEightBit) {
+            RGBSampleStore filtered;
+            filtered.SetMemoryLimit(m_samples.GetMemoryLimit());
+            filtered.SetSpillDirectory(m_samples.GetSpillDirectory());
+            TileODConverter converter(RGBSampleStore::GetODLookupTable());
+            std::vector<u8> keptRGB;
+            bool filterSuccess = m_samples.ForEachChunk([&](const u8 *rgb, const size_t numChunkSamples) {
+                keptRGB.resize(3 * numChunkSamples);
+                size_t numKept = converter.CompactInterleaved(rgb, numChunkSamples, 3, ODthreshold, keptRGB.data());
+                filtered.Append(keptRGB.data(), numKept);
+            });
+            if (filterSuccess) {
+                m_samples = std::move(filtered);
+                m_sampleThreshold = ODthreshold;
+                m_sampleGeneration++;
+                return &m_samples;
+            }
+        }
+    }
+
+    //Draw a new sample
+    this->ClearSamples();
+    bool samplingSuccess = useReservoir
+        ? theSampler->ReservoirSamplePixels(m_samples, sampleSize, ODthreshold, key.level)
+        : theSampler->ChooseRandomPixels(m_samples, sampleSize, ODthreshold, key.level);
+    if (!samplingSuccess) {
+        this->ClearSamples();
+        return nullptr;
+    }
+    m_sampleKey = key;
+    m_sampleThreshold = ODthreshold;
+    //Unknown (0) when the sample was loaded from the sample cache
+    m_samplesAreEightBit = (theSampler->GetSamplingStatistics().bytesPerChannel == 1);
+    m_haveSamples = true;
+    m_samplesWereDrawn = true;
+    return &m_samples;
+}//end ObtainSamples
+
+void StainVectorBase::ClearSamples() {
+    m_samples.Clear();
+    m_haveSamples = false;
+    m_samplesAreEightBit = false;
+    m_sampleGeneration++;
+}//end ClearSamples
+
+bool StainVectorBase::ComputeStainVectorsFromSamples(const RGBSampleStore &samples, double (&outputVectors)[9]) {
+    return false;
+}//end ComputeStainVectorsFromSamples
+
+bool StainVectorBase::ChooseAutoSampleSize(const s64 maxSampleSize, const double ODthreshold, s64 &chosenSampleSize) {
+    m_autoSampleSize = 0;
+    m_achievedPrecision = -1.0;
+    if (maxSampleSize <= 0) { return false; }
+    //Each batch is a new draw of the larger size, so the total drawn is at most 4/3 of the final sample
+    s64 batchSize = (AutoInitialSampleSize < maxSampleSize) ? AutoInitialSampleSize : maxSampleSize;
+    //Batches differ in size, so their samples are not kept. With the same inputs as the last choice, start from the
+    //batch it chose: ObtainSamples still holds that sample, so only its precision is checked again (other settings,
+    //such as a percentile, may have changed the vectors), and the batches before it are not drawn again
+    AutoSizeKey autoKey;
+    autoKey.sampleKey = this->MakeSampleKey(maxSampleSize, false);
+    autoKey.ODthreshold = ODthreshold;
+    autoKey.targetPrecision = this->GetTargetPrecision();
+    if ((m_lastAutoSampleSize > 0) && (autoKey == m_lastAutoSizeKey)) {
+        batchSize = m_lastAutoSampleSize;
+    }
+    while (true) {
+        const RGBSampleStore *samples = this->ObtainSamples(batchSize, ODthreshold, false);
+        if (samples == nullptr) { return false; }
+        m_autoSampleSize = batchSize;
+        double vectors[9] = { 0.0 };
+        double precision = 0.0;
+        bool precisionKnown = this->ComputeStainVectorsFromSamples(*samples, vectors)
+            && this->EstimateBootstrapPrecision(*samples, vectors, precision);
+        //A batch whose precision cannot be estimated (too few pixels above the threshold) is grown
+        if (precisionKnown) {
+            m_achievedPrecision = precision;
+            if (precision < this->GetTargetPrecision()) { break; }
+        }
+        if (batchSize >= maxSampleSize) { break; }
+        batchSize = (batchSize > maxSampleSize / AutoSampleGrowthFactor) ? maxSampleSize : batchSize * AutoSampleGrowthFactor;
+    }
+    m_lastAutoSizeKey = autoKey;
+    m_lastAutoSampleSize = m_autoSampleSize;
+    chosenSampleSize = m_autoSampleSize;
+    return true;
+}//end ChooseAutoSampleSize
+
+bool StainVectorBase::EstimateBootstrapPrecision(const RGBSampleStore &samples, const double (&vectors)[9], double &precision) {
+    const u64 numSamples = samples.GetNumSamples();
+    if (numSamples == 0) { return false; }
+    //Replicates larger than the cap would cost as much as the estimate itself, so draw m of the n samples.
+    //The spread of an m-sample estimate is sqrt(n/m) times that of the n-sample one, so scale it back
+    const u64 replicateSize = (numSamples < static_cast<u64>(MaxBootstrapReplicateSize))
+        ? numSamples : static_cast<u64>(MaxBootstrapReplicateSize);
+    const double spreadScale = std::sqrt(static_cast<double>(replicateSize) / static_cast<double>(numSamples));
+
+    PhiloxEngine bootstrapGen(this->GetSeed(), BootstrapStream);
+    std::uniform_int_distribution<u64> randIndex(0, numSamples - 1);
+    std::vector<u64> indices(static_cast<size_t>(replicateSize));
+    std::vector<double> angles;
+    angles.reserve(NumBootstrapReplicates);
+    for (int b = 0; b < NumBootstrapReplicates; b++) {
+        //Draw with replacement, then copy in index order so the sample is read chunk by chunk
+        for (auto &index : indices) { index = randIndex(bootstrapGen); }
+        std::sort(indices.begin(), indices.end());
+        RGBSampleStore replicate;
+        replicate.Reserve(static_cast<size_t>(replicateSize));
+        size_t nextIndex = 0;
+        u64 chunkFirst = 0;
+        samples.ForEachChunk([&](const u8 *rgb, const size_t numChunkSamples) {
+            const u64 chunkEnd = chunkFirst + static_cast<u64>(numChunkSamples);
+            for (; (nextIndex < indices.size()) && (indices[nextIndex] < chunkEnd); nextIndex++) {
+                const u8 *px = rgb + 3 * (indices[nextIndex] - chunkFirst);
+                replicate.Append(px[0], px[1], px[2]);
+            }
+            chunkFirst = chunkEnd;
+        });
+        double replicateVectors[9] = { 0.0 };
+        if (!this->ComputeStainVectorsFromSamples(replicate, replicateVectors)) { continue; }
+        angles.push_back(MaxStainVectorAngle(vectors, replicateVectors) * spreadScale);
+    }
+    //Most replicates must succeed for the bound to mean anything
+    if (angles.size() < static_cast<size_t>(NumBootstrapReplicates / 2)) { return false; }
+    std::sort(angles.begin(), angles.end());
+    size_t boundIndex = static_cast<size_t>(std::ceil(0.95 * static_cast<double>(angles.size()))) - 1;
+    precision = angles[boundIndex];
+    return true;
+}//end EstimateBootstrapPrecision
+
+double StainVectorBase::MaxStainVectorAngle(const double (&a)[9], const double (&b)[9]) {
+    //Angle between each row of a and each row of b
+    double pairAngles[3][3] = { { 0.0 } };
+    for (int i = 0; i < 3; i++) {
+        const double *u = a + 3 * i;
+        double uNormSq = u[0] * u[0] + u[1] * u[1] + u[2] * u[2];
+        for (int j = 0; j < 3; j++) {
+            const double *v = b + 3 * j;
+            double vNormSq = v[0] * v[0] + v[1] * v[1] + v[2] * v[2];
+            if ((uNormSq <= 0.0) && (vNormSq <= 0.0)) { continue; }
+            if ((uNormSq <= 0.0) || (vNormSq <= 0.0)) {
+                pairAngles[i][j] = 90.0;
+                continue;
+            }
+            double cosine = (u[0] * v[0] + u[1] * v[1] + u[2] * v[2]) / std::sqrt(uNormSq * vNormSq);
+            cosine = (cosine > 1.0) ? 1.0 : ((cosine < -1.0) ? -1.0 : cosine);
+            pairAngles[i][j] = std::acos(cosine) * 180.0 / 3.14159265358979323846;
+        }
+    }
+    //The pairing of rows with the smallest largest angle
+    int order[3] = { 0, 1, 2 };
+    double bestAngle = 180.0;
+    do {
+        double maxAngle = 0.0;
+        for (int i = 0; i < 3; i++) {
+            maxAngle = (pairAngles[i][order[i]] > maxAngle) ? pairAngles[i][order[i]] : maxAngle;
+        }
+        bestAngle = (maxAngle < bestAngle) ? maxAngle : bestAngle;
+    } while (std::next_permutation(order, order + 3));
+    return bestAngle;
+}//end MaxStainVectorAngle
+
 } // namespace image
 } // namespace sedeen
@@ -35,6 +35,18 @@ namespace sedeen {
 namespace image {
 
 class PATHCORE_IMAGE_API StainVectorBase {
+public:
+    ///The size of the first batch drawn when the sample size is chosen automatically
+    static const s64 AutoInitialSampleSize = 10000;
+    ///The factor by which each automatic batch grows the sample
+    static const int AutoSampleGrowthFactor = 4;
+    ///The number of bootstrap replicates used to estimate the precision of the stain vectors
+    static const int NumBootstrapReplicates = 20;
+    ///The largest bootstrap replicate; larger samples are bootstrapped m-out-of-n, with the interval rescaled
+    static const s64 MaxBootstrapReplicateSize = 100000;
+    ///The random number stream of the seed used to draw bootstrap replicates
+    static const u64 BootstrapStream = 4;
+
 public:
     StainVectorBase(std::shared_ptr<tile::Factory> source);
     virtual ~StainVectorBase();
@@ -42,6 +54,70 @@ public:
     ///The core functionality of a stain vector class; fills the 9-element array with three stain vectors
     virtual void ComputeStainVectors(double (&outputVectors)[9]);
 
+    ///Get/Set the number of threads the random pixel sampler may use (less than 1 uses all available processors)
+    inline const int GetNumThreads() const { return m_randomWSISampler->GetNumThreads(); }
+    ///Get/Set the number of threads the random pixel sampler may use (less than 1 uses all available processors)
+    inline void SetNumThreads(const int n) { m_randomWSISampler->SetNumThreads(n); }
+
+    ///Get/Set whether the random pixel sampler skips background tiles found in a low resolution prepass
+    inline const bool GetUseTissueMask() const { return m_randomWSISampler->GetUseTissueMask(); }
+    ///Get/Set whether the random pixel sampler skips background tiles found in a low resolution prepass
+    inline void SetUseTissueMask(const bool u) { m_randomWSISampler->SetUseTissueMask(u); }
+
+    ///Get/Set whether the requested number of sampled pixels counts only pixels above the OD threshold
+    inline const bool GetCountForegroundOnly() const { return m_randomWSISampler->GetCountForegroundOnly(); }
+    ///Get/Set whether the requested number of sampled pixels counts only pixels above the OD threshold
+    inline void SetCountForegroundOnly(const bool c) { m_randomWSISampler->SetCountForegroundOnly(c); }
+
+    ///Get/Set the seed of the random pixel sampler
+    inline const u64 GetSeed() const { return m_randomWSISampler->GetSeed(); }
+    ///Get/Set the seed of the random pixel sampler
+    inline void SetSeed(const u64 s) { m_randomWSISampler->SetSeed(s); }
+
+    ///Get/Set the directory the random pixel sampler caches its output in (empty disables the cache)
+    inline const std::string GetSampleCacheDirectory() const { return m_randomWSISampler->GetCacheDirectory(); }
+    ///Get/Set the directory the random pixel sampler caches its output in (empty disables the cache)
+    inline void SetSampleCacheDirectory(const std::string &dir) { m_randomWSISampler->SetCacheDirectory(dir); }
+
+    ///Get/Set the text identifying the slide in sample cache keys
+    inline const std::string GetSlideIdentity() const { return m_randomWSISampler->GetSlideIdentity(); }
+    ///Get/Set the text identifying the slide in sample cache keys
+    inline void SetSlideIdentity(const std::string &id) { m_randomWSISampler->SetSlideIdentity(id); }
+
+    ///Get the pixel conversion statistics of the most recent sampling call
+    inline const SamplingStatistics GetSamplingStatistics() const { return m_randomWSISampler->GetSamplingStatistics(); }
+
+    ///Get/Set the pyramid level that pixels are taken from (0 is the highest resolution)
+    inline const int GetSamplingLevel() const { return m_samplingLevel; }
+    ///Get/Set the pyramid level that pixels are taken from (0 is the highest resolution)
+    inline void SetSamplingLevel(const int l) { m_samplingLevel = l; }
+
+    ///Get/Set whether to stream every pixel of the sampling level rather than a random subsample
+    inline const bool GetUseAllPixels() const { return m_useAllPixels; }
+    ///Get/Set whether to stream every pixel of the sampling level rather than a random subsample
+    inline void SetUseAllPixels(const bool u) { m_useAllPixels = u; }
+
+    ///Get/Set the 95% confidence bound, in degrees, on the stain vector angles at which an automatic sample stops growing.
+    ///0 uses the sample size as given; above 0 the sample size is the largest sample to draw
+    inline const double GetTargetPrecision() const { return m_targetPrecision; }
+    ///Get/Set the 95% confidence bound, in degrees, on the stain vector angles at which an automatic sample stops growing.
+    ///0 uses the sample size as given; above 0 the sample size is the largest sample to draw
+    inline void SetTargetPrecision(const double p) { m_targetPrecision = (p > 0.0) ? p : 0.0; }
+
+    ///Get whether the most recent computation drew a new sample from the slide (false if a kept sample was reused or filtered)
+    inline const bool GetSamplesWereDrawn() const { return m_samplesWereDrawn; }
+    ///Get the number of samples kept from the most recent computation
+    inline const u64 GetNumSamples() const { return m_samples.GetNumSamples(); }
+
+    ///Get the sample size chosen by the most recent automatic computation (0 if none)
+    inline const s64 GetAutoSampleSize() const { return m_autoSampleSize; }
+    ///Get the 95% confidence bound, in degrees, on the stain vector angles reached by the most recent automatic computation (negative if it could not be estimated)
+    inline const double GetAchievedPrecision() const { return m_achievedPrecision; }
+
+    ///Get the largest angle, in degrees, between the stain vectors of two 9-element arrays, pairing the rows in the order
+    ///that makes it smallest (methods may return the stains in any order). A zero row paired with a nonzero row counts as 90
+    static double MaxStainVectorAngle(const double (&a)[9], const double (&b)[9]);
+
 protected:
     ///Returns a shared pointer to the source factory, protected so only derived classes may access it
     inline std::shared_ptr<tile::Factory> GetSourceFactory() { return m_sourceFactory; }
@@ -50,9 +126,72 @@ protected:
     ///Access the random pixel chooser
     inline std::shared_ptr<RandomWSISampler> GetRandomWSISampler() { return m_randomWSISampler; }
 
+    ///Get the pixel sample for the current sampling settings (nullptr on failure). The previous sample is reused when
+    ///its inputs are unchanged, and filtered rather than redrawn when only the OD threshold was raised (uniform candidates from 8-bit tiles only)
+    const RGBSampleStore* ObtainSamples(const s64 sampleSize, const double ODthreshold, const bool useReservoir);
+    ///Get a number that changes whenever ObtainSamples produces a different sample, for keying results computed from it
+    inline const u64 GetSampleGeneration() const { return m_sampleGeneration; }
+    ///Discard the sample kept by ObtainSamples
+    void ClearSamples();
+
+    ///Compute stain vectors from a sample without using or changing any kept results. Classes that support
+    ///an automatic sample size override this; it is applied to every batch and bootstrap replicate
+    virtual bool ComputeStainVectorsFromSamples(const RGBSampleStore &samples, double (&outputVectors)[9]);
+    ///Draw batches of growing size, up to maxSampleSize, until the bootstrap 95% bound on the stain vector angles is below
+    ///the target precision. The chosen sample is kept by ObtainSamples. When the sampling inputs, threshold, target and
+    ///maximum are unchanged, growth resumes from the last chosen batch, so only its precision is checked again.
+    ///Returns false if no batch could be drawn
+    bool ChooseAutoSampleSize(const s64 maxSampleSize, const double ODthreshold, s64 &chosenSampleSize);
+    ///Estimate the 95% bound, in degrees, on the angles between the stain vectors of a sample and those of its resamples
+    bool EstimateBootstrapPrecision(const RGBSampleStore &samples, const double (&vectors)[9], double &precision);
+
+private:
+    ///The inputs of a sample other than the OD threshold
+    struct SampleKey {
+        s64 sampleSize;
+        int level;
+        u64 seed;
+        bool useReservoir;
+        bool useTissueMask;
+        bool countForegroundOnly;
+        bool operator==(const SampleKey &other) const;
+    };
+    ///The inputs of an automatic sample size choice
+    struct AutoSizeKey {
+        SampleKey sampleKey;
+        double ODthreshold;
+        double targetPrecision;
+        bool operator==(const AutoSizeKey &other) const;
+    };
+    ///Get the inputs of a sample of the given size for the current sampling settings
+    const SampleKey MakeSampleKey(const s64 sampleSize, const bool useReservoir) const;
+
 private:
     std::shared_ptr<tile::Factory> m_sourceFactory;
     std::shared_ptr<RandomWSISampler> m_randomWSISampler;
+    ///The pyramid level to take pixels from
+    int m_samplingLevel;
+    ///Whether to use every pixel on the sampling level
+    bool m_useAllPixels;
+
+    ///The sample returned by ObtainSamples, and the inputs it was drawn with
+    RGBSampleStore m_samples;
+    SampleKey m_sampleKey;
+    double m_sampleThreshold;
+    ///Whether the sample was read from 8-bit tiles, so that thresholding its stored values matches a fresh draw
+    bool m_samplesAreEightBit;
+    bool m_haveSamples;
+    u64 m_sampleGeneration;
+    bool m_samplesWereDrawn;
+
+    ///The precision at which an automatic sample stops growing (0 for a fixed sample size)
+    double m_targetPrecision;
+    ///The outcome of the most recent automatic sample size choice
+    s64 m_autoSampleSize;
+    double m_achievedPrecision;
+    ///The inputs of the last automatic choice, with the maximum as the sample size, and the size it chose (0 if none)
+    AutoSizeKey m_lastAutoSizeKey;
+    s64 m_lastAutoSampleSize;
 };
 
 } // namespace image
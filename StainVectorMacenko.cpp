@@ -24,12 +24,18 @@
 
 #include "StainVectorMacenko.h"
 
+#include <cmath>
+#include <limits>
+#include <random>
 #include <sstream>
 
 #include "ODConversion.h"
 #include "StainVectorMath.h"
 #include "MacenkoHistogram.h"
 #include "BasisTransform.h"
+#include "SymmetricEigen3x3.h"
+
+#include <omp.h>
 
 namespace sedeen {
 namespace image {
@@ -41,7 +47,10 @@ StainVectorMacenko::StainVectorMacenko(std::shared_ptr<tile::Factory> source,
     m_sampleSize(0), //Must set to greater than 0 to ComputeStainVectors
     m_avgODThreshold(ODthreshold), //assign default value
     m_percentileThreshold(percentileThreshold), //assign default value
-    m_numHistogramBins(numHistoBins) //assign default value
+    m_numHistogramBins(numHistoBins), //assign default value
+    m_cachedPixelKey(),
+    m_cachedBasisTransform(),
+    m_cachedNumHistogramBins(0)
 {}//end constructor
 
 StainVectorMacenko::~StainVectorMacenko(void) {
@@ -49,48 +58,199 @@ StainVectorMacenko::~StainVectorMacenko(void) {
 
 void StainVectorMacenko::ComputeStainVectors(double (&outputVectors)[9]) {
     if (this->GetSourceFactory() == nullptr) { return; }
-    //Using this overload of the method requires setting sample size in advance
-    long int sampleSize = this->GetSampleSize();
-    if (sampleSize <= 0) { return; }
     double ODthreshold = this->GetODThreshold();
     double percentileThreshold = this->GetPercentileThreshold();
     if (percentileThreshold <= 0.0) { return; }
-
-    //Sample a set of pixel values from the source
-    cv::Mat samplePixels;
     auto theSampler = this->GetRandomWSISampler();
     if (theSampler == nullptr) { return; }
-    
-    bool samplingSuccess = theSampler->ChooseRandomPixels(samplePixels, sampleSize, ODthreshold);
-    if (!samplingSuccess) { return; }
-
-    //Create a class to perform the basis transformation of the sample pixels.
-    std::unique_ptr<BasisTransform> theBasisTransform = std::make_unique<BasisTransform>(samplePixels, true); //optimizeDirections=true
-    //The basis vectors are computed in the constructor and stored as members, so project points using them
-    cv::Mat projectedPoints;
-    bool projectSuccess = theBasisTransform->projectPoints(samplePixels, projectedPoints, false); //useMean=false
-    if (!projectSuccess) { return; }
-
-    //Create a class to histogram the results and find 2D vectors corresponding to percentile thresholds
-    std::unique_ptr<MacenkoHistogram> theHistogram
-        = std::make_unique<MacenkoHistogram>(this->GetPercentileThreshold(), this->GetNumHistogramBins());
+
+    //Stream every pixel of the sampling level, rather than holding a sample in memory
+    if (this->GetUseAllPixels()) {
+        int level = this->GetSamplingLevel();
+        PixelPass allPixelsPass = [&](const RandomWSISampler::BlockConsumer &consumer) {
+            return theSampler->StreamAllPixels(consumer, ODthreshold, level);
+        };
+        PixelSourceKey streamKey = { true, 0, ODthreshold, level, this->GetSeed(), this->GetUseTissueMask() };
+        this->ComputeStainVectorsFromPasses(allPixelsPass, streamKey, outputVectors);
+        return;
+    }
+
+    //Using this overload of the method requires setting sample size in advance
+    s64 sampleSize = this->GetSampleSize();
+    if (sampleSize <= 0) { return; }
+    //With a target precision, the sample size is the largest to draw; grow batches until the vectors are that precise
+    if (this->GetTargetPrecision() > 0.0) {
+        bool autoSizeSuccess = this->ChooseAutoSampleSize(sampleSize, ODthreshold, sampleSize);
+        if (!autoSizeSuccess) { return; }
+    }
+
+    //Sample a set of pixel values from the source, held as 8-bit RGB values (reused or filtered if only the threshold changed)
+    const RGBSampleStore *samplePixels = this->ObtainSamples(sampleSize, ODthreshold, false);
+    if (samplePixels == nullptr) { return; }
+
+    //Read the sample chunk by chunk in optical density blocks, so that no double matrix of the whole sample
+    //is created and chunks that spilled to disk are paged in one at a time
+    PixelPass samplePass = [&](const RandomWSISampler::BlockConsumer &consumer) {
+        return samplePixels->ForEachODBlock(consumer, SampleBlockSize);
+    };
+    PixelSourceKey sampleKey = { false, this->GetSampleGeneration(), 0.0, 0, 0, false };
+    this->ComputeStainVectorsFromPasses(samplePass, sampleKey, outputVectors);
+}//end single-parameter ComputeStainVectors
+
+bool StainVectorMacenko::PixelSourceKey::operator==(const PixelSourceKey &other) const {
+    return (streaming == other.streaming) && (sampleGeneration == other.sampleGeneration)
+        && (ODthreshold == other.ODthreshold) && (level == other.level) && (seed == other.seed)
+        && (useTissueMask == other.useTissueMask);
+}//end PixelSourceKey::operator==
+
+void StainVectorMacenko::ClearCachedStages() {
+    this->ClearSamples();
+    m_cachedBasisTransform.reset();
+    m_cachedAngleHist.release();
+    m_cachedNumHistogramBins = 0;
+}//end ClearCachedStages
+
+void StainVectorMacenko::ComputeStainVectorsFromPasses(const PixelPass &pixelPass, const PixelSourceKey &pixelKey,
+    double (&outputVectors)[9]) {
+    //The basis transform depends only on the pixels; the histogram also on the number of bins
+    if ((m_cachedBasisTransform == nullptr) || !(pixelKey == m_cachedPixelKey)) {
+        m_cachedAngleHist.release();
+        m_cachedBasisTransform = this->ComputeBasisTransform(pixelPass);
+        if (m_cachedBasisTransform == nullptr) { return; }
+        m_cachedPixelKey = pixelKey;
+    }
+    int numHistoBins = this->GetNumHistogramBins();
+    if (m_cachedAngleHist.empty() || (numHistoBins != m_cachedNumHistogramBins)) {
+        m_cachedAngleHist.release();
+        cv::Mat theAngleHist;
+        bool histogramPassSuccess = this->AccumulateAngleHistogram(pixelPass, *m_cachedBasisTransform, numHistoBins, theAngleHist);
+        if (!histogramPassSuccess) { return; }
+        m_cachedAngleHist = theAngleHist;
+        m_cachedNumHistogramBins = numHistoBins;
+    }
+
+    //Only the percentile thresholds and back projection depend on the percentile, and they are cheap
+    this->StainVectorsFromHistogram(*m_cachedBasisTransform, m_cachedAngleHist, numHistoBins, outputVectors);
+}//end ComputeStainVectorsFromPasses
+
+bool StainVectorMacenko::ComputeStainVectorsFromSamples(const RGBSampleStore &samples, double (&outputVectors)[9]) {
+    PixelPass samplePass = [&](const RandomWSISampler::BlockConsumer &consumer) {
+        return samples.ForEachODBlock(consumer, SampleBlockSize);
+    };
+    std::shared_ptr<BasisTransform> theBasisTransform = this->ComputeBasisTransform(samplePass);
+    if (theBasisTransform == nullptr) { return false; }
+    int numHistoBins = this->GetNumHistogramBins();
+    cv::Mat theAngleHist;
+    bool histogramPassSuccess = this->AccumulateAngleHistogram(samplePass, *theBasisTransform, numHistoBins, theAngleHist);
+    if (!histogramPassSuccess) { return false; }
+    return this->StainVectorsFromHistogram(*theBasisTransform, theAngleHist, numHistoBins, outputVectors);
+}//end ComputeStainVectorsFromSamples
+
+std::shared_ptr<BasisTransform> StainVectorMacenko::ComputeBasisTransform(const PixelPass &pixelPass) {
+    //First pass: accumulate the count, mean, and six unique scatter terms of the OD values, merging one block at a time.
+    //Keep a small uniform sample of pixels to test the signs of the basis vectors
+    const int numSignTestPixels = 1000;
+    u64 numPixels = 0;
+    PointMoments3 moments;
+    cv::Mat signTestPixels(numSignTestPixels, 3, cv::DataType<double>::type);
+    int numSignTestKept = 0;
+    //Reservoir sampling with geometric skips (Li's Algorithm L) chooses the sign test pixels,
+    //using a stream of the sampler's seed distinct from those of the sampler and the basis transform
+    const u64 signTestStream = 3;
+    PhiloxEngine signTestGen(this->GetSeed(), signTestStream);
+    std::uniform_real_distribution<double> randUnit(std::numeric_limits<double>::min(), 1.0);
+    std::uniform_int_distribution<int> randSlot(0, numSignTestPixels - 1);
+    double signTestW = 1.0;
+    u64 nextSignTestReplacement = 0;
+    auto drawNextReplacement = [&](const u64 currentPosition) {
+        signTestW *= std::exp(std::log(randUnit(signTestGen)) / static_cast<double>(numSignTestPixels));
+        double skip = std::floor(std::log(randUnit(signTestGen)) / std::log1p(-signTestW));
+        nextSignTestReplacement = currentPosition + 1 + ((skip < 1e18) ? static_cast<u64>(skip) : static_cast<u64>(1e18));
+    };
+    auto momentConsumer = [&](const cv::Mat &block) {
+        const int blockRows = block.rows;
+        if (blockRows <= 0) { return; }
+        //Offer the rows of this block to the sign test reservoir
+        int offeredRow = 0;
+        while (offeredRow < blockRows) {
+            u64 position = numPixels + static_cast<u64>(offeredRow);
+            if (numSignTestKept < numSignTestPixels) {
+                block.row(offeredRow).copyTo(signTestPixels.row(numSignTestKept));
+                numSignTestKept++;
+                if (numSignTestKept == numSignTestPixels) {
+                    drawNextReplacement(position);
+                }
+                offeredRow++;
+                continue;
+            }
+            u64 rowsToSkip = nextSignTestReplacement - position;
+            if (rowsToSkip >= static_cast<u64>(blockRows - offeredRow)) { break; }
+            offeredRow += static_cast<int>(rowsToSkip);
+            block.row(offeredRow).copyTo(signTestPixels.row(randSlot(signTestGen)));
+            drawNextReplacement(numPixels + static_cast<u64>(offeredRow));
+            offeredRow++;
+        }
+
+        //Covariance terms of this block in one pass, merged with the running values
+        moments.AddPoints(block.ptr<double>(0), static_cast<u64>(blockRows), static_cast<u64>(block.step1()), 1);
+        numPixels += static_cast<u64>(blockRows);
+    };
+    bool momentSuccess = pixelPass(momentConsumer);
+    if (!momentSuccess || (numPixels <= 3)) { return nullptr; }
+    signTestPixels.resize(static_cast<size_t>(numSignTestKept));
+
+    //Scaled covariance matrix (divided by the number of pixels) and the mean as a row vector, in stack storage
+    double covarTerms[6], covarValues[9], meanValues[3];
+    moments.GetCovariance(covarTerms);
+    moments.GetMean(meanValues);
+    SymmetricEigen3x3::Expand(covarTerms, covarValues);
+    cv::Mat covar(3, 3, cv::DataType<double>::type, covarValues);
+    cv::Mat meanRow(1, 3, cv::DataType<double>::type, meanValues);
+
+    //Create a class to perform the basis transformation from the accumulated moments
+    return std::make_shared<BasisTransform>(covar, meanRow, signTestPixels, true, false, this->GetSeed()); //optimizeDirections=true, useMean=false
+}//end ComputeBasisTransform
+
+bool StainVectorMacenko::AccumulateAngleHistogram(const PixelPass &pixelPass, BasisTransform &theBasisTransform,
+    const int numHistoBins, cv::Mat &theAngleHist) {
+    //The two basis vectors, as rows
+    double basisVectors[6];
+    bool basisSuccess = theBasisTransform.GetBasisVectors(BasisTransform::MutableView::RowMajor(basisVectors, 2, 3));
+    if (!basisSuccess) { return false; }
+
+    //Project each block into the basis and count the angles in one fused kernel, with per-worker histograms
+    int numThreads = (this->GetNumThreads() < 1) ? omp_get_num_procs() : this->GetNumThreads();
+    MacenkoHistogram theHistogram(this->GetPercentileThreshold(), numHistoBins);
+    auto histogramConsumer = [&](const cv::Mat &block) {
+        theHistogram.AccumulateProjectedAngles(block, basisVectors, numThreads);
+    };
+    bool passSuccess = pixelPass(histogramConsumer);
+    if (!passSuccess) { return false; }
+    theHistogram.GetProjectedAngleHistogram(theAngleHist);
+    return true;
+}//end AccumulateAngleHistogram
+
+bool StainVectorMacenko::StainVectorsFromHistogram(BasisTransform &theBasisTransform, const cv::Mat &theAngleHist,
+    const int numHistoBins, double (&outputVectors)[9]) {
+    MacenkoHistogram theHistogram(this->GetPercentileThreshold(), numHistoBins);
     cv::Mat percentileThreshVectors;
-    bool histoSuccess = theHistogram->PercentileThresholdVectors(projectedPoints, percentileThreshVectors);
-    if (!histoSuccess) { return; }
+    bool histoSuccess = theHistogram.PercentileThresholdVectorsFromHistogram(theAngleHist, percentileThreshVectors);
+    if (!histoSuccess) { return false; }
 
     //Back-project to get un-normalized stain vectors. DO NOT translate to the mean after backprojection.
     cv::Mat backProjectedVectors;
-    bool backProjectSuccess = theBasisTransform->backProjectPoints(percentileThreshVectors, backProjectedVectors, false); //useMean=false
-    if (!backProjectSuccess) { return; }
+    bool backProjectSuccess = theBasisTransform.backProjectPoints(percentileThreshVectors, backProjectedVectors, false); //useMean=false
+    if (!backProjectSuccess) { return false; }
 
     //Convert to C-style array and normalize rows
     double tempStainVecOutput[9] = {0.0};
     StainCVMatToCArray(backProjectedVectors, tempStainVecOutput, true);
     std::copy(std::begin(tempStainVecOutput), std::end(tempStainVecOutput), std::begin(outputVectors));
-}//end single-parameter ComputeStainVectors
+    return true;
+}//end StainVectorsFromHistogram
 
 //This overload does not have a default value for sampleSize, so it requires two arguments
-void StainVectorMacenko::ComputeStainVectors(double (&outputVectors)[9], const long int sampleSize) {
+void StainVectorMacenko::ComputeStainVectors(double (&outputVectors)[9], const s64 sampleSize) {
     if (this->GetSourceFactory() == nullptr) { return; }
     //Set member variables with the argument values
     this->SetSampleSize(sampleSize);
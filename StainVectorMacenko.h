@@ -31,9 +31,14 @@
 
 #include "StainVectorOpenCV.h"
 
+#include <functional>
+#include <memory>
+
 namespace sedeen {
 namespace image {
 
+class BasisTransform;
+
 class PATHCORE_IMAGE_API StainVectorMacenko : public StainVectorOpenCV {
 public:
     StainVectorMacenko(std::shared_ptr<tile::Factory> source,
@@ -43,7 +48,7 @@ public:
     ///Fill the 9-element array with three stain vectors
     virtual void ComputeStainVectors(double (&outputVectors)[9]);
     ///Overload of the basic method, includes sampleSize parameter
-    void ComputeStainVectors(double (&outputVectors)[9], long int sampleSize);
+    void ComputeStainVectors(double (&outputVectors)[9], s64 sampleSize);
 
     ///Get/Set the average optical density threshold
     inline const double GetODThreshold() const { return m_avgODThreshold; }
@@ -56,22 +61,62 @@ public:
     inline void SetPercentileThreshold(const double p) { m_percentileThreshold = p; }
 
     ///Get/Set the sample size, the number of pixels to choose
-    inline const long int GetSampleSize() const { return m_sampleSize; }
+    inline const s64 GetSampleSize() const { return m_sampleSize; }
     ///Get/Set the sample size, the number of pixels to choose
-    inline void SetSampleSize(const long int s) { m_sampleSize = s; }
+    inline void SetSampleSize(const s64 s) { m_sampleSize = s; }
 
     ///Get/Set the number of bins in the angle histogram (in MacenkoHistogram)
     inline const int GetNumHistogramBins() const { return m_numHistogramBins; }
     ///Get/Set the number of bins in the angle histogram (in MacenkoHistogram)
     inline void SetNumHistogramBins(const int n) { m_numHistogramBins = n; }
 
+    ///Discard the sample, basis transform and angle histogram kept from the previous computation
+    void ClearCachedStages();
+
+protected:
+    ///A function that passes every pixel used in the computation to a block consumer, returning false on failure
+    typedef std::function<bool(const RandomWSISampler::BlockConsumer&)> PixelPass;
+    ///Identifies the pixels a pass visits: a sample generation, or the settings of a stream over every pixel
+    struct PixelSourceKey {
+        bool streaming;
+        u64 sampleGeneration;
+        double ODthreshold;
+        int level;
+        u64 seed;
+        bool useTissueMask;
+        bool operator==(const PixelSourceKey &other) const;
+    };
+    ///Compute the stain vectors from two passes over the pixels (moments, then angle histogram), holding one block at a time.
+    ///The basis transform and histogram of the previous call are reused when the pixel source and bin count are unchanged
+    void ComputeStainVectorsFromPasses(const PixelPass &pixelPass, const PixelSourceKey &pixelKey, double (&outputVectors)[9]);
+    ///First pass: build the basis transform from the moments of the OD values and a sign test sample (nullptr on failure)
+    std::shared_ptr<BasisTransform> ComputeBasisTransform(const PixelPass &pixelPass);
+    ///Second pass: accumulate the histogram of the angles of the pixels projected into the basis, with a fused kernel
+    bool AccumulateAngleHistogram(const PixelPass &pixelPass, BasisTransform &theBasisTransform,
+        const int numHistoBins, cv::Mat &theAngleHist);
+    ///Find the stain vectors at the percentile thresholds of the angle histogram, back-projected from the basis
+    bool StainVectorsFromHistogram(BasisTransform &theBasisTransform, const cv::Mat &theAngleHist,
+        const int numHistoBins, double (&outputVectors)[9]);
+    ///Compute the stain vectors of a sample with no kept stages, for automatic sample size batches and bootstrap replicates
+    virtual bool ComputeStainVectorsFromSamples(const RGBSampleStore &samples, double (&outputVectors)[9]);
+
+protected:
+    ///The number of rows of the optical density blocks a sample is read in, large enough to split among threads
+    static const size_t SampleBlockSize = 65536;
+
 private:
     double m_avgODThreshold;
     double m_percentileThreshold;
     int m_numHistogramBins;
 
-    ///The number of pixels that should be used to calculate the stain vectors
-    long int m_sampleSize;
+    ///The number of pixels that should be used to calculate the stain vectors (may exceed 2^31; samples spill to disk)
+    s64 m_sampleSize;
+
+    ///The output of each stage of the previous computation, with the inputs it depends on
+    PixelSourceKey m_cachedPixelKey;
+    std::shared_ptr<BasisTransform> m_cachedBasisTransform;
+    int m_cachedNumHistogramBins;
+    cv::Mat m_cachedAngleHist;
 };
 
 } // namespace image
@@ -26,6 +26,7 @@
 
 #include <mlpack/methods/amf/amf.hpp>
 
+#include <algorithm>
 #include <sstream>
 
 #include "ODConversion.h"
@@ -39,7 +40,11 @@ StainVectorNMF::StainVectorNMF(std::shared_ptr<tile::Factory> source,
     : StainVectorMLPACK(source),
     m_sampleSize(0), //Must set to greater than 0 to ComputeStainVectors
     m_numStains(2),  //Can be 2 or 3
-    m_avgODThreshold(ODthreshold) //assign default value
+    m_avgODThreshold(ODthreshold), //assign default value
+    m_cachedVectors(),
+    m_cachedSampleGeneration(0),
+    m_cachedNumStains(0),
+    m_haveCachedVectors(false)
 {}//end constructor
 
 StainVectorNMF::~StainVectorNMF(void) {
@@ -48,26 +53,64 @@ StainVectorNMF::~StainVectorNMF(void) {
 void StainVectorNMF::ComputeStainVectors(double (&outputVectors)[9]) {
     if (this->GetSourceFactory() == nullptr) { return; }
     //Using this overload of the method requires setting sample size in advance
-    long int sampleSize = this->GetSampleSize();
+    s64 sampleSize = this->GetSampleSize();
     if (sampleSize <= 0) { return; }
     double ODthreshold = this->GetODThreshold();
-
-    //Sample a set of pixel values from the source
-    cv::Mat samplePixels;
-    auto theSampler = this->GetRandomWSISampler();
-    if (theSampler == nullptr) { return; }
-    bool samplingSuccess = theSampler->ChooseRandomPixels(samplePixels, sampleSize, ODthreshold);
-    if (!samplingSuccess) { return; }
-
-    //Convert samplePixels from CV to Armadillo
-    arma::Mat<double> armaSamplePixels = CVMatToArmaMat<double>(samplePixels);
-
     //The rank sets the number of columns in the basis matrix, and rows in the encoding matrix
     //It is the number of stains we are attempting to decompose the data points into
     //Valid values are 2 and 3 (enforce this)
     if (GetNumStains() > 3 || GetNumStains() < 2) { return; }
+
+    //With a target precision, the sample size is the largest to draw; grow batches until the vectors are that precise.
+    //A reservoir over every pixel has a fixed size, so it is not grown
+    if ((this->GetTargetPrecision() > 0.0) && !this->GetUseAllPixels()) {
+        bool autoSizeSuccess = this->ChooseAutoSampleSize(sampleSize, ODthreshold, sampleSize);
+        if (!autoSizeSuccess) { return; }
+    }
+
+    //Sample a set of pixel values from the source, held as 8-bit RGB values (reused or filtered if only the threshold changed).
+    //With useAllPixels, every pixel of the sampling level is streamed through a reservoir bounded by sampleSize
+    const RGBSampleStore *samplePixels = this->ObtainSamples(sampleSize, ODthreshold, this->GetUseAllPixels());
+    if (samplePixels == nullptr) { return; }
+
+    //The factorization is the costly stage: skip it if neither the sample nor the rank changed
+    if (m_haveCachedVectors && (m_cachedSampleGeneration == this->GetSampleGeneration())
+        && (m_cachedNumStains == GetNumStains())) {
+        std::copy(std::begin(m_cachedVectors), std::end(m_cachedVectors), std::begin(outputVectors));
+        return;
+    }
+
+    double tempStainVecOutput[9] = {0.0};
+    bool factorizeSuccess = this->ComputeStainVectorsFromSamples(*samplePixels, tempStainVecOutput);
+    if (!factorizeSuccess) { return; }
+    for (int i = 0; i < 9; i++) {
+        outputVectors[i] = tempStainVecOutput[i];
+    }
+    std::copy(std::begin(tempStainVecOutput), std::end(tempStainVecOutput), std::begin(m_cachedVectors));
+    m_cachedSampleGeneration = this->GetSampleGeneration();
+    m_cachedNumStains = GetNumStains();
+    m_haveCachedVectors = true;
+}//end single-parameter ComputeStainVectors
+
+bool StainVectorNMF::ComputeStainVectorsFromSamples(const RGBSampleStore &samplePixels, double (&outputVectors)[9]) {
+    if (samplePixels.GetNumSamples() == 0) { return false; }
+    if (GetNumStains() > 3 || GetNumStains() < 2) { return false; }
+    //Convert the samples to optical density directly into an Armadillo matrix (column-major, one row per pixel)
+    const double *odTable = RGBSampleStore::GetODLookupTable();
+    arma::Mat<double> armaSamplePixels(static_cast<arma::uword>(samplePixels.GetNumSamples()), 3);
+    arma::uword armaRow = 0;
+    samplePixels.ForEachChunk([&](const u8 *rgb, const size_t numChunkSamples) {
+        for (size_t i = 0; i < numChunkSamples; i++, armaRow++) {
+            armaSamplePixels(armaRow, 0) = odTable[rgb[3 * i + 0]];
+            armaSamplePixels(armaRow, 1) = odTable[rgb[3 * i + 1]];
+            armaSamplePixels(armaRow, 2) = odTable[rgb[3 * i + 2]];
+        }
+    });
+
     size_t rank = static_cast<size_t>(GetNumStains());
     arma::Mat<double> basisMat, encodingMat;
+    //The factorization starts from a random initialization; seed it so runs are reproducible
+    arma::arma_rng::set_seed(static_cast<arma::arma_rng::seed_type>(this->GetSeed()));
     mlpack::amf::NMFALSFactorizer nmfFactorizer;
     //Perform non-negative matrix factorization
     double residue = nmfFactorizer.Apply(armaSamplePixels, rank, basisMat, encodingMat);
@@ -75,12 +118,14 @@ void StainVectorNMF::ComputeStainVectors(double (&outputVectors)[9]) {
     //The stain values are in the encoding matrix. Convert to output array
     cv::Mat encodingAsCV = ArmaMatToCVMat<double>(encodingMat);
     //Convert to C-style array and normalize rows
-    double tempStainVecOutput[9] = {0.0};
-    StainCVMatToCArray(encodingAsCV, tempStainVecOutput, true);
-    for (int i = 0; i < 9; i++) {
-        outputVectors[i] = tempStainVecOutput[i];
-    }
-}//end single-parameter ComputeStainVectors
+    StainCVMatToCArray(encodingAsCV, outputVectors, true);
+    return true;
+}//end ComputeStainVectorsFromSamples
+
+void StainVectorNMF::ClearCachedStages() {
+    this->ClearSamples();
+    m_haveCachedVectors = false;
+}//end ClearCachedStages
 
 //This overload does not have a default value for sampleSize, so it requires at two arguments
 void StainVectorNMF::ComputeStainVectors(double (&outputVectors)[9], long int sampleSize) {
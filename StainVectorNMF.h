@@ -54,12 +54,18 @@ public:
     ///Get/Set the sample size, the number of pixels to choose
     inline void SetSampleSize(const long int s) { m_sampleSize = s; }
 
+    ///Discard the sample and stain vectors kept from the previous computation
+    void ClearCachedStages();
+
 protected:
     ///Get/Set the number of stains
     inline const int GetNumStains() const { return m_numStains; }
     ///Get/Set the number of stains
     inline void SetNumStains(const int n) { m_numStains = n; }
 
+    ///Factorize the OD values of a sample into stain vectors, with no kept results
+    virtual bool ComputeStainVectorsFromSamples(const RGBSampleStore &samplePixels, double (&outputVectors)[9]);
+
 private:
     double m_avgODThreshold;
 
@@ -67,6 +73,12 @@ private:
     long int m_sampleSize;
     ///The number of stains to obtain. Set to be 2 in member initialization of constructor.
     int m_numStains;
+
+    ///The stain vectors of the previous computation, with the sample generation and rank they were computed from
+    double m_cachedVectors[9];
+    u64 m_cachedSampleGeneration;
+    int m_cachedNumStains;
+    bool m_haveCachedVectors;
 };
 
 } // namespace image
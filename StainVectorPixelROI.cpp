@@ -25,58 +25,96 @@
 #include "StainVectorPixelROI.h"
 
 #include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <map>
 #include <random>
+#include <type_traits>
 
 #include "ODConversion.h"
 #include "StainVectorMath.h"
+#include "TilePrefetcher.h"
+#include "TileWalker.h"
+
+#include <omp.h>
 
 namespace sedeen {
 namespace image {
 
 StainVectorPixelROI::StainVectorPixelROI(std::shared_ptr<tile::Factory> source,
-    const std::vector<std::shared_ptr<GraphicItemBase>> regions_of_interest) 
-    : StainVectorBase(source), m_regionsOfInterest(regions_of_interest)
+    const std::vector<RegionList> stain_regions)
+    : StainVectorBase(source), m_stainRegions(stain_regions),
+    m_prefetchDepth(8),
+    m_angleTolerance(0.0),
+    m_regionODCache(nullptr),
+    m_integralODCache(nullptr),
+    m_numGroupsMeasured(0),
+    m_numGroupsReused(0)
 {}//end constructor
 
+StainVectorPixelROI::StainVectorPixelROI(std::shared_ptr<tile::Factory> source,
+    const std::vector<std::shared_ptr<GraphicItemBase>> regions_of_interest)
+    : StainVectorBase(source), m_stainRegions(),
+    m_prefetchDepth(8),
+    m_angleTolerance(0.0),
+    m_regionODCache(nullptr),
+    m_integralODCache(nullptr),
+    m_numGroupsMeasured(0),
+    m_numGroupsReused(0)
+{
+    //One region per stain
+    for (auto it = regions_of_interest.begin(); it != regions_of_interest.end(); ++it) {
+        m_stainRegions.push_back(RegionList(1, *it));
+    }
+}//end constructor
+
 StainVectorPixelROI::~StainVectorPixelROI(void) {
 }//end destructor
 
 void StainVectorPixelROI::ComputeStainVectors(double (&outputVectors)[9]) {
     //Error checks
     if (this->GetSourceFactory() == nullptr) { return; }
-    if (m_regionsOfInterest.empty()) {
+    if (m_stainRegions.empty()) {
         return;
     }
     else {
-        for (auto it = m_regionsOfInterest.begin(); it != m_regionsOfInterest.end(); ++it) {
-            if ((*it) == nullptr) {
-                //Missing region of interest
+        for (auto it = m_stainRegions.begin(); it != m_stainRegions.end(); ++it) {
+            if (it->empty()) {
+                //Stain with no regions of interest
                 return;
             }
+            for (auto rit = it->begin(); rit != it->end(); ++rit) {
+                if ((*rit) == nullptr) {
+                    //Missing region of interest
+                    return;
+                }
+            }
         }
     }
     //temporary output value array
     double tempOut[9] = { 0.0 };
 
-    //Get the length of the region_of_interests vector, though we want at most 3
-    size_t numberOfRegions = m_regionsOfInterest.size();
-    numberOfRegions = (numberOfRegions > 3) ? 3 : numberOfRegions;
+    //Get the number of stains, though we want at most 3. There is no limit on the regions per stain
+    size_t numberOfStains = m_stainRegions.size();
+    numberOfStains = (numberOfStains > 3) ? 3 : numberOfStains;
 
-    // Get image from the output factory
-    auto compositor = image::tile::Compositor(this->GetSourceFactory());
-    double  rgbOD[3];
-    for (size_t j = 0; j < numberOfRegions; j++)
-    {
-        rgbOD[0] = 0.0;
-        rgbOD[1] = 0.0;
-        rgbOD[2] = 0.0;
-        Rect rect = containingRect(m_regionsOfInterest.at(j)->graphic());
-        RawImage ROI = compositor.getImage(rect, Size(rect.width(), rect.height()));
-        getmeanRGBODfromROI(ROI, rgbOD);
+    //Get the outline of every region of each stain
+    std::vector<RegionOutlines> stainOutlines(numberOfStains);
+    for (size_t j = 0; j < numberOfStains; j++) {
+        for (auto it = m_stainRegions[j].begin(); it != m_stainRegions[j].end(); ++it) {
+            std::vector<PointF> vertices;
+            if (GetRegionVertices(**it, vertices)) {
+                stainOutlines[j].push_back(vertices);
+            }
+        }
+    }
 
-        tempOut[j * 3] = rgbOD[0];
-        tempOut[j * 3 + 1] = rgbOD[1];
-        tempOut[j * 3 + 2] = rgbOD[2];
+    std::vector<double> meanOD;
+    ComputeMeanODOfStains(stainOutlines, meanOD, m_stainLevels, m_stainErrorEstimates);
+    for (size_t j = 0; j < numberOfStains; j++) {
+        tempOut[j * 3] = meanOD[j * 3];
+        tempOut[j * 3 + 1] = meanOD[j * 3 + 1];
+        tempOut[j * 3 + 2] = meanOD[j * 3 + 2];
     }
 
     //Assign the tempOut values to the outputVectors array
@@ -89,30 +127,595 @@ void StainVectorPixelROI::getmeanRGBODfromROI(RawImage ROI, double(&rgbOD)[3])
 {
     if (ROI.isNull())
         return;
-    //temporary array
+    //Sum the OD over all pixels
     double tempOD[3] = { 0.0 };
+    long int imageSize = AccumulateODFromImage(ROI, tempOD);
+    if (imageSize <= 0) { return; }
+    //average of all pixels in region of interest
+    rgbOD[0] = tempOD[0] / imageSize;
+    rgbOD[1] = tempOD[1] / imageSize;
+    rgbOD[2] = tempOD[2] / imageSize;
+}//end getmeanRGBODfromROI
+
+long int StainVectorPixelROI::AccumulateODFromImage(const RawImage &ROI, double(&odSum)[3]) const {
+    if (ROI.isNull()) { return 0; }
+    int width = ROI.size().width();
+    int height = ROI.size().height();
+    if ((width <= 0) || (height <= 0)) { return 0; }
+    //Every row, in full
+    std::vector<RegionMask::RowSpan> spans(static_cast<size_t>(height));
+    for (int y = 0; y < height; y++) {
+        spans[y].y = y;
+        spans[y].xBegin = 0;
+        spans[y].xEnd = width;
+    }
+    double odSumSq[3] = { 0.0 };
+    return AccumulateODInSpans(ROI, spans, odSum, odSumSq);
+}//end AccumulateODFromImage
+
+long int StainVectorPixelROI::AccumulateODInSpans(const RawImage &image, const std::vector<RegionMask::RowSpan> &spans,
+    double(&odSum)[3], double(&odSumSq)[3]) const {
+    if (image.isNull() || spans.empty()) { return 0; }
+    const int width = image.size().width();
+    const int height = image.size().height();
+    long int numPixels = 0;
+    for (auto it = spans.begin(); it != spans.end(); ++it) {
+        if ((it->y < 0) || (it->y >= height) || (it->xBegin < 0) || (it->xEnd > width)) { return 0; }
+        numPixels += it->xEnd - it->xBegin;
+    }
+
+    //Choose the walker for the image's pixel order, channel count and bit depth once.
+    //8-bit values are counted, then the table is weighted by the counts: 256 products per channel
+    //instead of one table lookup and addition per pixel. Wider values are looked up directly
+    bool walked = VisitTilePixels(image, [&](const auto &walker) {
+        typedef typename std::decay<decltype(walker)>::type Walker;
+        typedef typename Walker::Value Value;
+        const double *odTable = GetODLookupTableFor<Value>();
+        if constexpr (std::is_same<Value, u8>::value) {
+            std::uint64_t counts[3][256] = { { 0 } };
+            for (auto it = spans.begin(); it != spans.end(); ++it) {
+                size_t first = static_cast<size_t>(it->y) * static_cast<size_t>(width) + static_cast<size_t>(it->xBegin);
+                size_t count = static_cast<size_t>(it->xEnd - it->xBegin);
+                if constexpr (Walker::IsInterleaved) {
+                    TileODConverter::CountChannelValues(walker.Data() + walker.Index(first, 0), count, Walker::Channels, counts);
+                }
+                else {
+                    for (size_t px = first; px < first + count; px++) {
+                        counts[0][walker.R(px)]++;
+                        counts[1][walker.G(px)]++;
+                        counts[2][walker.B(px)]++;
+                    }
+                }
+            }
+            for (int c = 0; c < 3; c++) {
+                for (int v = 0; v < 256; v++) {
+                    odSum[c] += static_cast<double>(counts[c][v]) * odTable[v];
+                    odSumSq[c] += static_cast<double>(counts[c][v]) * odTable[v] * odTable[v];
+                }
+            }
+        }
+        else {
+            double sum[3] = { 0.0 };
+            double sumSq[3] = { 0.0 };
+            for (auto it = spans.begin(); it != spans.end(); ++it) {
+                size_t first = static_cast<size_t>(it->y) * static_cast<size_t>(width) + static_cast<size_t>(it->xBegin);
+                size_t count = static_cast<size_t>(it->xEnd - it->xBegin);
+                for (size_t px = first; px < first + count; px++) {
+                    double od[3] = { odTable[walker.R(px)], odTable[walker.G(px)], odTable[walker.B(px)] };
+                    for (int c = 0; c < 3; c++) {
+                        sum[c] += od[c];
+                        sumSq[c] += od[c] * od[c];
+                    }
+                }
+            }
+            for (int c = 0; c < 3; c++) {
+                odSum[c] += sum[c];
+                odSumSq[c] += sumSq[c];
+            }
+        }
+    });
+    if (walked) { return numPixels; }
 
     //Perform fast color to OD conversion using a lookup table
     std::shared_ptr<ODConversion> converter = std::make_shared<ODConversion>();
+    for (auto it = spans.begin(); it != spans.end(); ++it) {
+        for (int x = it->xBegin; x < it->xEnd; x++) {
+            //Convert RGB vals to optical density, sum over all pixels
+            for (int c = 0; c < 3; c++) {
+                double od = converter->LookupRGBtoOD(image.at(x, it->y, c).as<int>());
+                odSum[c] += od;
+                odSumSq[c] += od * od;
+            }
+        }
+    }
+    return numPixels;
+}//end AccumulateODInSpans
+
+bool StainVectorPixelROI::GetRegionVertices(const GraphicItemBase &region, std::vector<PointF> &vertices) {
+    vertices.clear();
+    //Rectangles, ellipses, polygons and freehand regions all convert to a polygon outline in image coordinates
+    PolygonF outline = toPolygonF(region.graphic());
+    vertices = outline.vertices();
+    if (vertices.size() >= 3) { return true; }
+    //Otherwise use the corners of the containing rectangle
+    Rect rect = containingRect(region.graphic());
+    if ((rect.width() <= 0) || (rect.height() <= 0)) { return false; }
+    double x0 = static_cast<double>(rect.x());
+    double y0 = static_cast<double>(rect.y());
+    double x1 = x0 + static_cast<double>(rect.width());
+    double y1 = y0 + static_cast<double>(rect.height());
+    vertices = { PointF(x0, y0), PointF(x1, y0), PointF(x1, y1), PointF(x0, y1) };
+    return true;
+}//end GetRegionVertices
 
-    int imageSize = ROI.size().width()*ROI.size().height();
-    double log255 = log(255.0);
-    int y = 0, x = 0;
-    for (int i = 0; i < imageSize; i++) {
-        x = i % ROI.size().width();
-        if (x == 0 && i != 0) {
-            y++;
+bool StainVectorPixelROI::GetLevelScale(const int level, double &scaleX, double &scaleY) {
+    auto source = this->GetSourceFactory();
+    if (source == nullptr) { return false; }
+    if ((level < 0) || (level >= static_cast<int>(source->getNumLevels()))) { return false; }
+    Size level0Size = source->getDimensions(0);
+    Size levelSize = source->getDimensions(level);
+    if ((level0Size.width() <= 0) || (level0Size.height() <= 0)) { return false; }
+    scaleX = static_cast<double>(levelSize.width()) / static_cast<double>(level0Size.width());
+    scaleY = static_cast<double>(levelSize.height()) / static_cast<double>(level0Size.height());
+    return true;
+}//end GetLevelScale
+
+void StainVectorPixelROI::ScaleOutline(const std::vector<PointF> &vertices, const double scaleX, const double scaleY,
+    std::vector<PointF> &scaled) {
+    scaled.clear();
+    for (auto it = vertices.begin(); it != vertices.end(); ++it) {
+        scaled.push_back(PointF(it->getX() * scaleX, it->getY() * scaleY));
+    }
+}//end ScaleOutline
+
+bool StainVectorPixelROI::ComputeMeanODOfStains(const std::vector<RegionOutlines> &stainOutlines, std::vector<double> &meanOD,
+    std::vector<int> &chosenLevels, std::vector<double> &errorEstimates) {
+    const size_t numStains = stainOutlines.size();
+    meanOD.assign(3 * numStains, 0.0);
+    chosenLevels.assign(numStains, -1);
+    errorEstimates.assign(numStains, 0.0);
+    m_numGroupsMeasured = 0;
+    m_numGroupsReused = 0;
+    auto source = this->GetSourceFactory();
+    if (source == nullptr) { return false; }
+
+    //Split each stain's regions into groups whose bounds overlap. Pixels are only shared within a group,
+    //so a stain's sums are the sums of its groups', and each group can be saved and reused on its own
+    std::vector<RegionOutlines> groups;
+    std::vector<size_t> groupStains;
+    for (size_t j = 0; j < numStains; j++) {
+        std::vector<RegionOutlines> stainGroups;
+        GroupOverlappingRegions(stainOutlines[j], stainGroups);
+        for (auto it = stainGroups.begin(); it != stainGroups.end(); ++it) {
+            groups.push_back(*it);
+            groupStains.push_back(j);
         }
-        //Convert RGB vals to optical density, sum over all pixels
-        tempOD[0] = tempOD[0] + converter->LookupRGBtoOD(ROI.at(x, y, 0).as<int>());
-        tempOD[1] = tempOD[1] + converter->LookupRGBtoOD(ROI.at(x, y, 1).as<int>());
-        tempOD[2] = tempOD[2] + converter->LookupRGBtoOD(ROI.at(x, y, 2).as<int>());
     }
-    //average of all pixels in region of interest
-    rgbOD[0] = tempOD[0] / imageSize;
-    rgbOD[1] = tempOD[1] / imageSize;
-    rgbOD[2] = tempOD[2] / imageSize;
-}//end getmeanRGBODfromROI
+
+    //Start each stain at the coarsest level with enough region pixels for a variance check (level 0 if there is no tolerance)
+    int numLevels = static_cast<int>(source->getNumLevels());
+    std::vector<int> startLevels(numStains, 0);
+    if (this->GetAngleTolerance() > 0.0) {
+        std::vector<PointF> scaled;
+        for (size_t j = 0; j < numStains; j++) {
+            for (int level = numLevels - 1; level > 0; level--) {
+                double scaleX = 1.0, scaleY = 1.0;
+                if (!GetLevelScale(level, scaleX, scaleY)) { continue; }
+                long int numPixels = 0;
+                for (auto it = stainOutlines[j].begin(); it != stainOutlines[j].end(); ++it) {
+                    ScaleOutline(*it, scaleX, scaleY, scaled);
+                    RegionMask levelMask(scaled);
+                    numPixels += levelMask.CountBlockPixels(levelMask.GetBoundingRect());
+                }
+                if (numPixels >= MinPixelsPerLevel) {
+                    startLevels[j] = level;
+                    break;
+                }
+            }
+        }
+    }
+
+    //Refine level by level, measuring the stains still open on each level in one pass over the tiles.
+    //A stain's level is accepted once its mean differs from the next coarser level's, and its standard error,
+    //by less than the tolerance angle; each level costs about a quarter of the next finer one
+    const double radiansToDegrees = 180.0 / 3.14159265358979323846;
+    std::vector<bool> accepted(numStains, false);
+    std::vector<bool> havePrevious(numStains, false);
+    std::vector<double> previousMean(3 * numStains, 0.0);
+    int topLevel = 0;
+    for (size_t j = 0; j < numStains; j++) {
+        topLevel = (startLevels[j] > topLevel) ? startLevels[j] : topLevel;
+    }
+    for (int level = topLevel; level >= 0; level--) {
+        std::vector<bool> measure(numStains, false);
+        bool measureAny = false;
+        for (size_t j = 0; j < numStains; j++) {
+            measure[j] = !accepted[j] && !stainOutlines[j].empty() && (startLevels[j] >= level);
+            measureAny = measureAny || measure[j];
+        }
+        if (!measureAny) { continue; }
+        //Reuse the saved sums of groups that have not moved; read the others in one pass over their tiles
+        std::vector<ODMoments> groupMoments(groups.size());
+        std::vector<bool> measureGroups(groups.size(), false);
+        bool readAny = false;
+        for (size_t g = 0; g < groups.size(); g++) {
+            if (!measure[groupStains[g]]) { continue; }
+            if ((m_regionODCache != nullptr) && m_regionODCache->Find(groups[g], level, groupMoments[g])) {
+                m_numGroupsReused++;
+                continue;
+            }
+            measureGroups[g] = true;
+            readAny = true;
+        }
+        std::vector<ODMoments> measured;
+        if (readAny) {
+            //A failed read would leave the sums short, so the stains are not measured
+            if (!ComputeGroupMomentsAtLevel(groups, measureGroups, level, measured)) { return false; }
+            for (size_t g = 0; g < groups.size(); g++) {
+                if (!measureGroups[g]) { continue; }
+                groupMoments[g] = measured[g];
+                m_numGroupsMeasured++;
+                if (m_regionODCache != nullptr) {
+                    m_regionODCache->Insert(groups[g], level, groupMoments[g]);
+                }
+            }
+        }
+        std::vector<ODMoments> moments(numStains);
+        for (size_t g = 0; g < groups.size(); g++) {
+            ODMoments &m = moments[groupStains[g]];
+            for (int c = 0; c < 3; c++) {
+                m.odSum[c] += groupMoments[g].odSum[c];
+                m.odSumSq[c] += groupMoments[g].odSumSq[c];
+            }
+            m.numPixels += groupMoments[g].numPixels;
+        }
+
+        for (size_t j = 0; j < numStains; j++) {
+            if (!measure[j] || (moments[j].numPixels <= 0)) { continue; }
+            double mean[3], variance = 0.0, meanNormSq = 0.0;
+            for (int c = 0; c < 3; c++) {
+                mean[c] = moments[j].odSum[c] / moments[j].numPixels;
+                double v = moments[j].odSumSq[c] / moments[j].numPixels - mean[c] * mean[c];
+                variance += (v > 0.0) ? v : 0.0;
+                meanNormSq += mean[c] * mean[c];
+            }
+            //The standard error of the mean vector, as an angle
+            double standardErrorAngle = (meanNormSq > 0.0)
+                ? std::sqrt(variance / moments[j].numPixels / meanNormSq) * radiansToDegrees : 0.0;
+            double previous[3] = { previousMean[j * 3], previousMean[j * 3 + 1], previousMean[j * 3 + 2] };
+            double changeAngle = havePrevious[j] ? AngleBetween(previous, mean) : 0.0;
+            for (int c = 0; c < 3; c++) {
+                meanOD[j * 3 + c] = mean[c];
+                previousMean[j * 3 + c] = mean[c];
+            }
+            chosenLevels[j] = level;
+            errorEstimates[j] = (changeAngle > standardErrorAngle) ? changeAngle : standardErrorAngle;
+            //Level 0 is exact
+            if (level == 0) {
+                errorEstimates[j] = 0.0;
+            }
+            accepted[j] = havePrevious[j] && (errorEstimates[j] < this->GetAngleTolerance());
+            havePrevious[j] = true;
+        }
+    }
+
+    for (size_t j = 0; j < numStains; j++) {
+        if (chosenLevels[j] < 0) { return false; }
+    }
+    return true;
+}//end ComputeMeanODOfStains
+
+void StainVectorPixelROI::GroupOverlappingRegions(const RegionOutlines &outlines, std::vector<RegionOutlines> &groups) {
+    groups.clear();
+    //Bounds of each outline
+    const size_t numRegions = outlines.size();
+    std::vector<double> bounds(4 * numRegions, 0.0);
+    for (size_t r = 0; r < numRegions; r++) {
+        if (outlines[r].empty()) { continue; }
+        double minX = outlines[r].front().getX(), maxX = minX;
+        double minY = outlines[r].front().getY(), maxY = minY;
+        for (auto it = outlines[r].begin(); it != outlines[r].end(); ++it) {
+            minX = (it->getX() < minX) ? it->getX() : minX;
+            maxX = (it->getX() > maxX) ? it->getX() : maxX;
+            minY = (it->getY() < minY) ? it->getY() : minY;
+            maxY = (it->getY() > maxY) ? it->getY() : maxY;
+        }
+        bounds[4 * r] = minX;
+        bounds[4 * r + 1] = minY;
+        bounds[4 * r + 2] = maxX;
+        bounds[4 * r + 3] = maxY;
+    }
+    //Join the regions whose bounds touch into sets, labelled by their first region
+    std::vector<size_t> label(numRegions);
+    for (size_t r = 0; r < numRegions; r++) {
+        label[r] = r;
+    }
+    auto findLabel = [&label](size_t r) {
+        while (label[r] != r) {
+            label[r] = label[label[r]];
+            r = label[r];
+        }
+        return r;
+    };
+    for (size_t r = 0; r < numRegions; r++) {
+        for (size_t q = r + 1; q < numRegions; q++) {
+            bool overlap = (bounds[4 * r] <= bounds[4 * q + 2]) && (bounds[4 * q] <= bounds[4 * r + 2])
+                && (bounds[4 * r + 1] <= bounds[4 * q + 3]) && (bounds[4 * q + 1] <= bounds[4 * r + 3]);
+            if (overlap) {
+                size_t a = findLabel(r), b = findLabel(q);
+                label[(a > b) ? a : b] = (a > b) ? b : a;
+            }
+        }
+    }
+    //Groups are in the order of their first region, and keep their regions in order
+    std::vector<size_t> groupOfLabel(numRegions, numRegions);
+    for (size_t r = 0; r < numRegions; r++) {
+        size_t root = findLabel(r);
+        if (groupOfLabel[root] == numRegions) {
+            groupOfLabel[root] = groups.size();
+            groups.push_back(RegionOutlines());
+        }
+        groups[groupOfLabel[root]].push_back(outlines[r]);
+    }
+}//end GroupOverlappingRegions
+
+bool StainVectorPixelROI::IsAxisAlignedRectangle(const std::vector<PointF> &vertices) {
+    //Four corners, or five with the first repeated at the end
+    size_t numCorners = vertices.size();
+    if ((numCorners == 5) && (vertices[4].getX() == vertices[0].getX()) && (vertices[4].getY() == vertices[0].getY())) {
+        numCorners = 4;
+    }
+    if (numCorners != 4) { return false; }
+    //Every edge is horizontal or vertical, and they alternate
+    bool horizontal[4];
+    for (int i = 0; i < 4; i++) {
+        const PointF &p = vertices[i];
+        const PointF &q = vertices[(i + 1) % 4];
+        horizontal[i] = (p.getY() == q.getY()) && (p.getX() != q.getX());
+        bool vertical = (p.getX() == q.getX()) && (p.getY() != q.getY());
+        if (!horizontal[i] && !vertical) { return false; }
+    }
+    return (horizontal[0] != horizontal[1]) && (horizontal[1] != horizontal[2]) && (horizontal[2] != horizontal[3]);
+}//end IsAxisAlignedRectangle
+
+bool StainVectorPixelROI::ComputeGroupMomentsAtLevel(const std::vector<RegionOutlines> &groupOutlines,
+    const std::vector<bool> &measure, const int level, std::vector<ODMoments> &moments) {
+    const size_t numGroups = groupOutlines.size();
+    moments.assign(numGroups, ODMoments());
+    auto source = this->GetSourceFactory();
+    if (source == nullptr) { return false; }
+    if (measure.size() != numGroups) { return false; }
+    double scaleX = 1.0, scaleY = 1.0;
+    if (!GetLevelScale(level, scaleX, scaleY)) { return false; }
+    Size levelSize = source->getDimensions(level);
+
+    //Rasterize every region of the groups to measure on the level, in group order
+    std::vector<RegionMask> masks;
+    std::vector<size_t> maskGroups;
+    std::vector<PointF> scaled;
+    for (size_t g = 0; g < numGroups; g++) {
+        if (!measure[g]) { continue; }
+        for (auto it = groupOutlines[g].begin(); it != groupOutlines[g].end(); ++it) {
+            ScaleOutline(*it, scaleX, scaleY, scaled);
+            RegionMask mask(scaled);
+            if (mask.IsValid()) {
+                masks.push_back(mask);
+                maskGroups.push_back(g);
+            }
+        }
+    }
+    //No region has pixels on this level
+    if (masks.empty()) { return true; }
+
+    //A group of one axis-aligned rectangle can be summed from integral OD tables, without reading its pixels.
+    //Find the rectangle of pixels inside it, with the same pixel centre rule as the mask
+    const bool useTables = (m_integralODCache != nullptr);
+    std::vector<Rect> maskRects(masks.size(), Rect());
+    std::vector<bool> maskIsRect(masks.size(), false);
+    if (useTables) {
+        std::vector<size_t> groupSizes(numGroups, 0);
+        for (size_t m = 0; m < masks.size(); m++) {
+            groupSizes[maskGroups[m]]++;
+        }
+        std::vector<RegionMask::RowSpan> rectSpans;
+        for (size_t m = 0; m < masks.size(); m++) {
+            //Masks were made from every outline of their group, in order, so a group of one holds the mask's outline
+            if (groupSizes[maskGroups[m]] != 1) { continue; }
+            if (!IsAxisAlignedRectangle(groupOutlines[maskGroups[m]].front())) { continue; }
+            Rect bounds = masks[m].GetBoundingRect();
+            masks[m].GetBlockSpans(bounds, rectSpans);
+            if (rectSpans.empty()) { continue; }
+            maskRects[m] = Rect(Point(bounds.x() + rectSpans.front().xBegin, bounds.y() + rectSpans.front().y),
+                Size(rectSpans.front().xEnd - rectSpans.front().xBegin, rectSpans.back().y - rectSpans.front().y + 1));
+            maskIsRect[m] = true;
+        }
+    }
+
+    Size tileSize = source->getTileSize();
+    int tileWidth = (tileSize.width() > 0) ? tileSize.width() : levelSize.width();
+    int tileHeight = (tileSize.height() > 0) ? tileSize.height() : levelSize.height();
+    if ((tileWidth <= 0) || (tileHeight <= 0)) { return false; }
+
+    //The tables of a rectangle's tiles must all fit the cache's budget, with those of the rectangles before it.
+    //Larger rectangles are read through their spans, so that building tables never needs more memory than the budget
+    if (useTables) {
+        const size_t tileTableBytes = IntegralODTile::GetNumBytesFor(tileWidth, tileHeight);
+        size_t tableBytes = 0;
+        for (size_t m = 0; m < masks.size(); m++) {
+            if (!maskIsRect[m]) { continue; }
+            //Count the tiles of the rectangle clipped to the level
+            const Rect &rect = maskRects[m];
+            int x0 = (rect.x() > 0) ? rect.x() : 0;
+            int y0 = (rect.y() > 0) ? rect.y() : 0;
+            int x1 = ((rect.x() + rect.width()) < levelSize.width()) ? (rect.x() + rect.width()) : levelSize.width();
+            int y1 = ((rect.y() + rect.height()) < levelSize.height()) ? (rect.y() + rect.height()) : levelSize.height();
+            if ((x1 <= x0) || (y1 <= y0)) { continue; }
+            size_t numTiles = static_cast<size_t>((x1 - 1) / tileWidth - x0 / tileWidth + 1)
+                * static_cast<size_t>((y1 - 1) / tileHeight - y0 / tileHeight + 1);
+            size_t rectBytes = numTiles * tileTableBytes;
+            if (tableBytes + rectBytes > m_integralODCache->GetByteBudget()) {
+                maskIsRect[m] = false;
+                continue;
+            }
+            tableBytes += rectBytes;
+        }
+    }
+
+    //Find the union of the level's tiles that contain region pixels, and the regions in each, in row-major order.
+    //Tiles shared by several regions, of one group or of several, are listed once
+    const s64 numColumns = (levelSize.width() + tileWidth - 1) / tileWidth;
+    std::map<s64, std::vector<size_t>> tileRegions;
+    for (size_t m = 0; m < masks.size(); m++) {
+        //Clip the polygon's bounding rectangle to the level
+        Rect bounds = masks[m].GetBoundingRect();
+        int x0 = (bounds.x() > 0) ? bounds.x() : 0;
+        int y0 = (bounds.y() > 0) ? bounds.y() : 0;
+        int x1 = ((bounds.x() + bounds.width()) < levelSize.width()) ? (bounds.x() + bounds.width()) : levelSize.width();
+        int y1 = ((bounds.y() + bounds.height()) < levelSize.height()) ? (bounds.y() + bounds.height()) : levelSize.height();
+        for (int row = y0 / tileHeight; (x1 > x0) && (row * tileHeight < y1); row++) {
+            int by0 = (row * tileHeight > y0) ? row * tileHeight : y0;
+            int by1 = ((row + 1) * tileHeight < y1) ? (row + 1) * tileHeight : y1;
+            for (int column = x0 / tileWidth; column * tileWidth < x1; column++) {
+                int bx0 = (column * tileWidth > x0) ? column * tileWidth : x0;
+                int bx1 = ((column + 1) * tileWidth < x1) ? (column + 1) * tileWidth : x1;
+                if (masks[m].CountBlockPixels(Rect(Point(bx0, by0), Size(bx1 - bx0, by1 - by0))) > 0) {
+                    tileRegions[static_cast<s64>(row) * numColumns + column].push_back(m);
+                }
+            }
+        }
+    }
+    if (tileRegions.empty()) { return true; }
+    //Each block is a whole tile, clipped to the level. Tiles holding only rectangles whose tables are kept are not read
+    std::vector<Rect> blocks;
+    std::vector<std::pair<int, int>> blockTiles;
+    std::vector<std::vector<size_t>> blockRegions;
+    for (auto it = tileRegions.begin(); it != tileRegions.end(); ++it) {
+        int column = static_cast<int>(it->first % numColumns);
+        int row = static_cast<int>(it->first / numColumns);
+        int bx1 = ((column + 1) * tileWidth < levelSize.width()) ? (column + 1) * tileWidth : levelSize.width();
+        int by1 = ((row + 1) * tileHeight < levelSize.height()) ? (row + 1) * tileHeight : levelSize.height();
+        Rect block(Point(column * tileWidth, row * tileHeight), Size(bx1 - column * tileWidth, by1 - row * tileHeight));
+        bool onlyRects = useTables;
+        for (auto rit = it->second.begin(); rit != it->second.end(); ++rit) {
+            onlyRects = onlyRects && maskIsRect[*rit];
+        }
+        std::shared_ptr<const IntegralODTile> table = onlyRects ? m_integralODCache->Find(level, column, row) : nullptr;
+        if (table != nullptr) {
+            for (auto rit = it->second.begin(); rit != it->second.end(); ++rit) {
+                ODMoments &m = moments[maskGroups[*rit]];
+                long int numAdded = table->AddRectMoments(Rect(Point(maskRects[*rit].x() - block.x(), maskRects[*rit].y() - block.y()),
+                    maskRects[*rit].size()), m.odSum, m.odSumSq);
+                m.numPixels += numAdded;
+            }
+            continue;
+        }
+        blocks.push_back(block);
+        blockTiles.push_back(std::make_pair(column, row));
+        blockRegions.push_back(it->second);
+    }
+    if (blocks.empty()) { return true; }
+
+    //Choose the number of worker threads
+    int numThreads = (this->GetNumThreads() < 1) ? omp_get_num_procs() : this->GetNumThreads();
+    const int numBlocks = static_cast<int>(blocks.size());
+    numThreads = (numThreads > numBlocks) ? numBlocks : numThreads;
+    //Each worker sums into its own moments, joined in worker order so the result does not depend on timing
+    std::vector<std::vector<ODMoments>> workerMoments(static_cast<size_t>(numThreads), std::vector<ODMoments>(numGroups));
+    //Set by a worker if one of its blocks could not be read
+    std::vector<int> workerFailed(static_cast<size_t>(numThreads), 0);
+
+#pragma omp parallel num_threads(numThreads)
+    {
+        //Each worker takes a contiguous run of the block list, so that its reads stay in storage order
+        int worker = omp_get_thread_num();
+        int numWorkers = omp_get_num_threads();
+        int firstVisit = static_cast<int>((static_cast<s64>(numBlocks) * worker) / numWorkers);
+        int endVisit = static_cast<int>((static_cast<s64>(numBlocks) * (worker + 1)) / numWorkers);
+
+        //Read blocks ahead of use on a prefetch thread, the only user of the worker's compositor.
+        //The compositor takes level 0 rectangles; requesting the block's size at the level reads from that level
+        auto compositor = std::make_shared<image::tile::Compositor>(source);
+        TilePrefetcher prefetcher([&blocks, firstVisit, compositor, scaleX, scaleY](const size_t request) {
+            const Rect &block = blocks[firstVisit + request];
+            int rx0 = static_cast<int>(std::floor(block.x() / scaleX));
+            int ry0 = static_cast<int>(std::floor(block.y() / scaleY));
+            int rx1 = static_cast<int>(std::ceil((block.x() + block.width()) / scaleX));
+            int ry1 = static_cast<int>(std::ceil((block.y() + block.height()) / scaleY));
+            Rect level0Rect(Point(rx0, ry0), Size(rx1 - rx0, ry1 - ry0));
+            return compositor->getImage(level0Rect, Size(block.width(), block.height()));
+        }, static_cast<size_t>((endVisit > firstVisit) ? (endVisit - firstVisit) : 0), this->GetPrefetchDepth());
+
+        //Rasterize each block against its regions as it is consumed, so only one block's spans are held
+        std::vector<RegionMask::RowSpan> groupSpans, regionSpans;
+        RawImage blockImage;
+        std::shared_ptr<const IntegralODTile> blockTable;
+        for (int visit = firstVisit; visit < endVisit; visit++) {
+            //A failed read arrives as a null image; the sums would be short of the block's pixels
+            if (!prefetcher.Next(blockImage) || blockImage.isNull()) {
+                workerFailed[worker] = 1;
+                break;
+            }
+            const std::vector<size_t> &regions = blockRegions[visit];
+            blockTable = nullptr;
+            //Regions are in group order. Gather the spans of each group's regions in the block, and unite
+            //them where there is more than one, so that pixels shared by overlapping regions count once per group
+            size_t first = 0;
+            while (first < regions.size()) {
+                size_t group = maskGroups[regions[first]];
+                size_t end = first;
+                groupSpans.clear();
+                while ((end < regions.size()) && (maskGroups[regions[end]] == group)) {
+                    masks[regions[end]].GetBlockSpans(blocks[visit], regionSpans);
+                    groupSpans.insert(groupSpans.end(), regionSpans.begin(), regionSpans.end());
+                    end++;
+                }
+                ODMoments &m = workerMoments[worker][group];
+                if (maskIsRect[regions[first]]) {
+                    //Build the block's tables once, on its first rectangle, and keep them at once so that
+                    //a worker holds no more than one block's tables. Later edits of rectangles in it need no read
+                    if (blockTable == nullptr) {
+                        blockTable = std::make_shared<const IntegralODTile>(blockImage);
+#pragma omp critical(IntegralODCacheInsert)
+                        m_integralODCache->Insert(level, blockTiles[visit].first, blockTiles[visit].second, blockTable);
+                    }
+                    const Rect &rect = maskRects[regions[first]];
+                    m.numPixels += blockTable->AddRectMoments(Rect(Point(rect.x() - blocks[visit].x(),
+                        rect.y() - blocks[visit].y()), rect.size()), m.odSum, m.odSumSq);
+                    first = end;
+                    continue;
+                }
+                if (end - first > 1) {
+                    RegionMask::UniteSpans(groupSpans);
+                }
+                m.numPixels += AccumulateODInSpans(blockImage, groupSpans, m.odSum, m.odSumSq);
+                first = end;
+            }
+        }
+    }//end parallel region
+
+    for (auto it = workerFailed.begin(); it != workerFailed.end(); ++it) {
+        if (*it != 0) { return false; }
+    }
+    for (auto it = workerMoments.begin(); it != workerMoments.end(); ++it) {
+        for (size_t g = 0; g < numGroups; g++) {
+            for (int c = 0; c < 3; c++) {
+                moments[g].odSum[c] += (*it)[g].odSum[c];
+                moments[g].odSumSq[c] += (*it)[g].odSumSq[c];
+            }
+            moments[g].numPixels += (*it)[g].numPixels;
+        }
+    }
+    return true;
+}//end ComputeGroupMomentsAtLevel
+
+double StainVectorPixelROI::AngleBetween(const double(&a)[3], const double(&b)[3]) {
+    double dot = a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+    double norms = std::sqrt((a[0] * a[0] + a[1] * a[1] + a[2] * a[2]) * (b[0] * b[0] + b[1] * b[1] + b[2] * b[2]));
+    if (norms <= 0.0) { return 0.0; }
+    double cosine = dot / norms;
+    cosine = (cosine > 1.0) ? 1.0 : ((cosine < -1.0) ? -1.0 : cosine);
+    return std::acos(cosine) * 180.0 / 3.14159265358979323846;
+}//end AngleBetween
 
 } // namespace image
 } // namespace sedeen
@@ -29,6 +29,9 @@
 #include "Geometry.h"
 #include "Image.h"
 
+#include "IntegralODCache.h"
+#include "RegionMask.h"
+#include "RegionODCache.h"
 #include "StainVectorBase.h"
 
 namespace sedeen {
@@ -36,22 +39,124 @@ namespace image {
 
 class PATHCORE_IMAGE_API StainVectorPixelROI : public StainVectorBase {
 public:
+    ///The regions of interest of one stain
+    typedef std::vector<std::shared_ptr<GraphicItemBase>> RegionList;
+
+public:
+    ///Any number of regions of interest per stain, for up to three stains
+    StainVectorPixelROI(std::shared_ptr<tile::Factory> source,
+        const std::vector<RegionList> stain_regions);
+    ///One region of interest per stain, for up to three stains
     StainVectorPixelROI(std::shared_ptr<tile::Factory> source, 
         const std::vector<std::shared_ptr<GraphicItemBase>> regions_of_interest);
     virtual ~StainVectorPixelROI();
 
-    ///Fill the 9-element array with three stain vectors
+    ///Fill the 9-element array with three stain vectors, each the mean OD of the pixels in a stain's regions
     virtual void ComputeStainVectors(double(&outputVectors)[9]);
 
-    ///Get/Set the vector of regions of interest
-    inline const std::vector<std::shared_ptr<GraphicItemBase>> GetRegionsOfInterest() const { return m_regionsOfInterest; }
-    ///Get/Set the vector of regions of interest
-    inline void SetRegionsOfInterest(const std::vector<std::shared_ptr<GraphicItemBase>> roi) { m_regionsOfInterest = roi; }
+    ///Get/Set the list of regions of interest of each stain
+    inline const std::vector<RegionList> GetStainRegions() const { return m_stainRegions; }
+    ///Get/Set the list of regions of interest of each stain
+    inline void SetStainRegions(const std::vector<RegionList> regions) { m_stainRegions = regions; }
 
     void getmeanRGBODfromROI(RawImage, double(&rgbOD)[3]);
 
+    ///Get/Set the number of image blocks read ahead of the block being processed
+    inline const int GetPrefetchDepth() const { return m_prefetchDepth; }
+    ///Get/Set the number of image blocks read ahead of the block being processed
+    inline void SetPrefetchDepth(const int d) { m_prefetchDepth = (d < 1) ? 1 : d; }
+
+    ///Get/Set the error allowed in the mean OD direction of a stain, in degrees. Stains are measured on the coarsest
+    ///pyramid level whose estimated error is below it; 0 measures every stain at full resolution
+    inline const double GetAngleTolerance() const { return m_angleTolerance; }
+    ///Get/Set the error allowed in the mean OD direction of a stain, in degrees. Stains are measured on the coarsest
+    ///pyramid level whose estimated error is below it; 0 measures every stain at full resolution
+    inline void SetAngleTolerance(const double t) { m_angleTolerance = (t > 0.0) ? t : 0.0; }
+
+    ///Get the pyramid level each stain was measured on in the last call to ComputeStainVectors (-1 if it failed)
+    inline const std::vector<int> GetStainLevels() const { return m_stainLevels; }
+    ///Get the estimated error of each stain's mean OD direction in the last call to ComputeStainVectors, in degrees
+    inline const std::vector<double> GetStainErrorEstimates() const { return m_stainErrorEstimates; }
+
+    ///Get/Set a cache of the OD sums of groups of regions, kept by the caller between runs, so that only the regions
+    ///that moved are read again. Groups are regions of one stain linked by overlapping bounds. May be null (no caching)
+    inline const std::shared_ptr<RegionODCache> GetRegionODCache() const { return m_regionODCache; }
+    ///Get/Set a cache of the OD sums of groups of regions, kept by the caller between runs, so that only the regions
+    ///that moved are read again. Groups are regions of one stain linked by overlapping bounds. May be null (no caching)
+    inline void SetRegionODCache(std::shared_ptr<RegionODCache> cache) { m_regionODCache = cache; }
+
+    ///Get/Set a cache of integral OD tables of tiles, kept by the caller between runs. Regions that are axis-aligned
+    ///rectangles, and overlap no other region of their stain, are summed from the tables of their tiles with four lookups
+    ///per tile; tiles with no kept tables are read once to build them, unless a rectangle's tables would not fit the cache's
+    ///budget. May be null (rectangles are read like other regions)
+    inline const std::shared_ptr<IntegralODCache> GetIntegralODCache() const { return m_integralODCache; }
+    ///Get/Set a cache of integral OD tables of tiles, kept by the caller between runs. Regions that are axis-aligned
+    ///rectangles, and overlap no other region of their stain, are summed from the tables of their tiles with four lookups
+    ///per tile; tiles with no kept tables are read once to build them, unless a rectangle's tables would not fit the cache's
+    ///budget. May be null (rectangles are read like other regions)
+    inline void SetIntegralODCache(std::shared_ptr<IntegralODCache> cache) { m_integralODCache = cache; }
+
+    ///Get the number of region groups read, summed over levels, in the last call to ComputeStainVectors
+    inline const int GetNumGroupsMeasured() const { return m_numGroupsMeasured; }
+    ///Get the number of region groups whose sums were taken from the cache, summed over levels, in the last call to ComputeStainVectors
+    inline const int GetNumGroupsReused() const { return m_numGroupsReused; }
+
+    ///The minimum number of a stain's region pixels on the coarsest level measured
+    static const long int MinPixelsPerLevel = 4096;
+
+protected:
+    ///The sums of the OD, and of its square, of a number of pixels
+    typedef RegionODCache::ODMoments ODMoments;
+    ///The outlines of a list of regions, as polygon vertices in level 0 image coordinates
+    typedef RegionODCache::RegionOutlines RegionOutlines;
+
+    ///Add the optical density of every pixel in the image to odSum, return the number of pixels added
+    long int AccumulateODFromImage(const RawImage &image, double(&odSum)[3]) const;
+    ///Add the optical density, and its square, of the pixels in spans (in image coordinates) to odSum and odSumSq, return the number of pixels added
+    long int AccumulateODInSpans(const RawImage &image, const std::vector<RegionMask::RowSpan> &spans,
+        double(&odSum)[3], double(&odSumSq)[3]) const;
+    ///Fill meanOD (three values per stain) with the mean OD of the pixels inside each stain's region outlines, measured on
+    ///the coarsest pyramid level whose estimated error is below the angle tolerance. Outputs the level used and the
+    ///error estimate in degrees for each stain. Returns false if any stain could not be measured, or a block could not be read
+    bool ComputeMeanODOfStains(const std::vector<RegionOutlines> &stainOutlines, std::vector<double> &meanOD,
+        std::vector<int> &chosenLevels, std::vector<double> &errorEstimates);
+    ///Read the union of the tiles of a level that hold pixels of the groups of regions to measure, each tile once, in parallel
+    ///with reads running ahead of the OD accumulation. Fill the OD moments of the pixels inside each group's outlines
+    ///(zero for groups with no pixels on the level). Returns false if a block could not be read
+    bool ComputeGroupMomentsAtLevel(const std::vector<RegionOutlines> &groupOutlines, const std::vector<bool> &measure,
+        const int level, std::vector<ODMoments> &moments);
+    ///Split a list of regions into groups, each a set of regions linked by overlapping bounds, so that no pixel is in two groups
+    static void GroupOverlappingRegions(const RegionOutlines &outlines, std::vector<RegionOutlines> &groups);
+    ///Get whether polygon vertices outline a rectangle with horizontal and vertical edges
+    static bool IsAxisAlignedRectangle(const std::vector<PointF> &vertices);
+    ///Get the scale from level 0 coordinates to the coordinates of a level
+    bool GetLevelScale(const int level, double &scaleX, double &scaleY);
+    ///Scale polygon vertices from level 0 coordinates to a level's coordinates
+    static void ScaleOutline(const std::vector<PointF> &vertices, const double scaleX, const double scaleY,
+        std::vector<PointF> &scaled);
+    ///Get the angle between two vectors, in degrees
+    static double AngleBetween(const double(&a)[3], const double(&b)[3]);
+    ///Get the outline of a region as polygon vertices in level 0 image coordinates. Returns false if the region is empty.
+    static bool GetRegionVertices(const GraphicItemBase &region, std::vector<PointF> &vertices);
+
 private:
-    std::vector<std::shared_ptr<GraphicItemBase>> m_regionsOfInterest;
+    ///The regions of interest of each stain
+    std::vector<RegionList> m_stainRegions;
+    ///The number of blocks read ahead of use by each worker thread
+    int m_prefetchDepth;
+    ///The error allowed in the mean OD direction of a stain, in degrees
+    double m_angleTolerance;
+    ///The pyramid level each stain was measured on
+    std::vector<int> m_stainLevels;
+    ///The estimated error of each stain's mean OD direction, in degrees
+    std::vector<double> m_stainErrorEstimates;
+    ///Saved OD sums of groups of regions (may be null)
+    std::shared_ptr<RegionODCache> m_regionODCache;
+    ///Integral OD tables of tiles (may be null)
+    std::shared_ptr<IntegralODCache> m_integralODCache;
+    ///Counts of the region groups read and reused in the last run
+    int m_numGroupsMeasured;
+    int m_numGroupsReused;
 };
 
 } // namespace image
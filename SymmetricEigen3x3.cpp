@@ -0,0 +1,340 @@
+/*=============================================================================
+ *
+ *  Copyright (c) 2020 Sunnybrook Research Institute
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ *
+ *=============================================================================*/
+
+#include "SymmetricEigen3x3.h"
+
+#include <cmath>
+
+namespace sedeen {
+namespace image {
+
+namespace {
+//The row and column of each of the six unique terms of a symmetric 3x3 matrix
+const int TermRow[6] = { 0, 0, 0, 1, 1, 2 };
+const int TermCol[6] = { 0, 1, 2, 1, 2, 2 };
+
+//If the spread of the eigenvalues is below this fraction of their mean, the matrix is treated as near-isotropic
+const double IsotropicTolerance = 1.0e-6;
+//If the largest cross product of the rows of A - lambda*I is below this fraction of the matrix scale (squared),
+//the eigenvector of lambda cannot be found from them reliably
+const double CrossProductTolerance = 1.0e-12;
+
+inline double Dot3(const double *u, const double *v) {
+    return u[0] * v[0] + u[1] * v[1] + u[2] * v[2];
+}
+
+inline void Cross3(const double *u, const double *v, double *w) {
+    w[0] = u[1] * v[2] - u[2] * v[1];
+    w[1] = u[2] * v[0] - u[0] * v[2];
+    w[2] = u[0] * v[1] - u[1] * v[0];
+}
+
+//Multiply a symmetric matrix (full, row-major) by a vector
+inline void MultiplySym3(const double *m, const double *v, double *w) {
+    w[0] = m[0] * v[0] + m[1] * v[1] + m[2] * v[2];
+    w[1] = m[3] * v[0] + m[4] * v[1] + m[5] * v[2];
+    w[2] = m[6] * v[0] + m[7] * v[1] + m[8] * v[2];
+}
+
+//The tangent of the Jacobi rotation angle that zeroes the off-diagonal term apq of a 2x2 symmetric block
+inline double JacobiTangent(const double app, const double aqq, const double apq) {
+    double theta = (aqq - app) / (2.0 * apq);
+    double t = 1.0 / (std::abs(theta) + std::sqrt(theta * theta + 1.0));
+    return (theta < 0.0) ? -t : t;
+}
+
+//Write the eigenpairs to the outputs in descending eigenvalue order, eigenvectors as rows
+void SortEigenpairs(const double (&lambda)[3], const double (&vectors)[3][3], double (&evals)[3], double (&evecs)[9]) {
+    int order[3] = { 0, 1, 2 };
+    for (int i = 1; i < 3; i++) {
+        for (int j = i; (j > 0) && (lambda[order[j]] > lambda[order[j - 1]]); j--) {
+            int temp = order[j];
+            order[j] = order[j - 1];
+            order[j - 1] = temp;
+        }
+    }
+    for (int i = 0; i < 3; i++) {
+        evals[i] = lambda[order[i]];
+        for (int e = 0; e < 3; e++) {
+            evecs[3 * i + e] = vectors[order[i]][e];
+        }
+    }
+}
+} // namespace
+
+PointMoments3::PointMoments3()
+    : m_count(0)
+{
+    Clear();
+}//end constructor
+
+PointMoments3::~PointMoments3(void) {
+}//end destructor
+
+void PointMoments3::AddPoints(const double *data, const std::uint64_t numPoints, const std::uint64_t pointStride,
+    const std::uint64_t elementStride /*= 1*/) {
+    if ((data == nullptr) || (numPoints == 0)) { return; }
+    //Sum the offsets from the first point, and the six products of the offsets, in one pass
+    const double k0 = data[0];
+    const double k1 = data[elementStride];
+    const double k2 = data[2 * elementStride];
+    double s0 = 0.0, s1 = 0.0, s2 = 0.0;
+    double p00 = 0.0, p01 = 0.0, p02 = 0.0, p11 = 0.0, p12 = 0.0, p22 = 0.0;
+    const double *point = data;
+    for (std::uint64_t p = 0; p < numPoints; p++, point += pointStride) {
+        const double d0 = point[0] - k0;
+        const double d1 = point[elementStride] - k1;
+        const double d2 = point[2 * elementStride] - k2;
+        s0 += d0;
+        s1 += d1;
+        s2 += d2;
+        p00 += d0 * d0;
+        p01 += d0 * d1;
+        p02 += d0 * d2;
+        p11 += d1 * d1;
+        p12 += d1 * d2;
+        p22 += d2 * d2;
+    }
+
+    //The mean and scatter of this set, then merge it with the running values
+    const double n = static_cast<double>(numPoints);
+    PointMoments3 addedMoments;
+    addedMoments.m_count = numPoints;
+    addedMoments.m_mean[0] = k0 + s0 / n;
+    addedMoments.m_mean[1] = k1 + s1 / n;
+    addedMoments.m_mean[2] = k2 + s2 / n;
+    addedMoments.m_scatter[0] = p00 - s0 * s0 / n;
+    addedMoments.m_scatter[1] = p01 - s0 * s1 / n;
+    addedMoments.m_scatter[2] = p02 - s0 * s2 / n;
+    addedMoments.m_scatter[3] = p11 - s1 * s1 / n;
+    addedMoments.m_scatter[4] = p12 - s1 * s2 / n;
+    addedMoments.m_scatter[5] = p22 - s2 * s2 / n;
+    Merge(addedMoments);
+}//end AddPoints
+
+void PointMoments3::Merge(const PointMoments3 &other) {
+    if (other.m_count == 0) { return; }
+    if (m_count == 0) {
+        *this = other;
+        return;
+    }
+    const double nA = static_cast<double>(m_count);
+    const double nB = static_cast<double>(other.m_count);
+    const double nAB = nA + nB;
+    const double delta[3] = { other.m_mean[0] - m_mean[0], other.m_mean[1] - m_mean[1], other.m_mean[2] - m_mean[2] };
+    for (int t = 0; t < 6; t++) {
+        m_scatter[t] += other.m_scatter[t] + delta[TermRow[t]] * delta[TermCol[t]] * nA * nB / nAB;
+    }
+    for (int c = 0; c < 3; c++) { m_mean[c] += delta[c] * nB / nAB; }
+    m_count += other.m_count;
+}//end Merge
+
+void PointMoments3::Clear() {
+    m_count = 0;
+    for (int c = 0; c < 3; c++) { m_mean[c] = 0.0; }
+    for (int t = 0; t < 6; t++) { m_scatter[t] = 0.0; }
+}//end Clear
+
+void PointMoments3::GetMean(double (&mean)[3]) const {
+    for (int c = 0; c < 3; c++) { mean[c] = m_mean[c]; }
+}//end GetMean
+
+void PointMoments3::GetScatter(double (&scatter)[6]) const {
+    for (int t = 0; t < 6; t++) { scatter[t] = m_scatter[t]; }
+}//end GetScatter
+
+bool PointMoments3::GetCovariance(double (&covar)[6]) const {
+    if (m_count == 0) { return false; }
+    const double n = static_cast<double>(m_count);
+    for (int t = 0; t < 6; t++) { covar[t] = m_scatter[t] / n; }
+    return true;
+}//end GetCovariance
+
+bool SymmetricEigen3x3::Solve(const double (&a)[6], double (&evals)[3], double (&evecs)[9]) {
+    for (int t = 0; t < 6; t++) {
+        if (!std::isfinite(a[t])) { return false; }
+    }
+    double full[9];
+    Expand(a, full);
+
+    //Closed-form eigenvalues (Smith, 1961): with q the mean of the eigenvalues and B = (A - qI) / p scaled to unit spread,
+    //the eigenvalues are q + 2p cos(phi + 2k pi/3), k = 0, 1, 2, where cos(3 phi) = det(B) / 2
+    const double q = (a[0] + a[3] + a[5]) / 3.0;
+    const double b00 = a[0] - q;
+    const double b11 = a[3] - q;
+    const double b22 = a[5] - q;
+    const double offDiagSq = a[1] * a[1] + a[2] * a[2] + a[4] * a[4];
+    const double p = std::sqrt((b00 * b00 + b11 * b11 + b22 * b22 + 2.0 * offDiagSq) / 6.0);
+    //A near-isotropic matrix has no well-separated eigenvalue to start from
+    if (!(p > IsotropicTolerance * std::abs(q))) {
+        return SolveJacobi(a, evals, evecs);
+    }
+    const double detB = (b00 * (b11 * b22 - a[4] * a[4]) - a[1] * (a[1] * b22 - a[4] * a[2])
+        + a[2] * (a[1] * a[4] - b11 * a[2])) / (p * p * p);
+    const double r = (detB / 2.0 < -1.0) ? -1.0 : ((detB / 2.0 > 1.0) ? 1.0 : detB / 2.0);
+    const double phi = std::acos(r) / 3.0;
+    const double twoThirdsPi = 2.0 * 3.14159265358979323846 / 3.0;
+    const double largest = q + 2.0 * p * std::cos(phi);
+    const double smallest = q + 2.0 * p * std::cos(phi + twoThirdsPi);
+    const double middle = 3.0 * q - largest - smallest;
+
+    //Find the eigenvector of the more isolated of the largest and smallest eigenvalues first.
+    //A - lambda*I has rank two, and its null vector is the largest cross product of two of its rows
+    const double isolated = ((largest - middle) >= (middle - smallest)) ? largest : smallest;
+    double rows[3][3];
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            rows[i][j] = full[3 * i + j] - ((i == j) ? isolated : 0.0);
+        }
+    }
+    double crosses[3][3];
+    Cross3(rows[0], rows[1], crosses[0]);
+    Cross3(rows[0], rows[2], crosses[1]);
+    Cross3(rows[1], rows[2], crosses[2]);
+    int bestCross = 0;
+    double bestNormSq = Dot3(crosses[0], crosses[0]);
+    for (int c = 1; c < 3; c++) {
+        double normSq = Dot3(crosses[c], crosses[c]);
+        if (normSq > bestNormSq) {
+            bestNormSq = normSq;
+            bestCross = c;
+        }
+    }
+    const double scaleSq = (p * p) * (p * p);
+    if (!(bestNormSq > CrossProductTolerance * scaleSq)) {
+        return SolveJacobi(a, evals, evecs);
+    }
+    double vectors[3][3];
+    double lambda[3];
+    const double invNorm = 1.0 / std::sqrt(bestNormSq);
+    for (int e = 0; e < 3; e++) { vectors[0][e] = crosses[bestCross][e] * invNorm; }
+
+    //An orthonormal basis U, V of the plane perpendicular to the first eigenvector
+    const double *w = vectors[0];
+    double U[3], V[3];
+    if (std::abs(w[0]) > std::abs(w[1])) {
+        double invLength = 1.0 / std::sqrt(w[0] * w[0] + w[2] * w[2]);
+        U[0] = -w[2] * invLength;
+        U[1] = 0.0;
+        U[2] = w[0] * invLength;
+    }
+    else {
+        double invLength = 1.0 / std::sqrt(w[1] * w[1] + w[2] * w[2]);
+        U[0] = 0.0;
+        U[1] = w[2] * invLength;
+        U[2] = -w[1] * invLength;
+    }
+    Cross3(w, U, V);
+
+    //The other two eigenpairs are those of A restricted to that plane, a 2x2 problem solved exactly by one
+    //Jacobi rotation; this stays accurate when the two remaining eigenvalues are close or equal
+    double AU[3], AV[3], Aw[3];
+    MultiplySym3(full, U, AU);
+    MultiplySym3(full, V, AV);
+    MultiplySym3(full, w, Aw);
+    lambda[0] = Dot3(w, Aw);
+    const double m00 = Dot3(U, AU);
+    const double m01 = Dot3(U, AV);
+    const double m11 = Dot3(V, AV);
+    double c = 1.0, s = 0.0, t = 0.0;
+    if (m01 != 0.0) {
+        t = JacobiTangent(m00, m11, m01);
+        c = 1.0 / std::sqrt(t * t + 1.0);
+        s = t * c;
+    }
+    lambda[1] = m00 - t * m01;
+    lambda[2] = m11 + t * m01;
+    for (int e = 0; e < 3; e++) {
+        vectors[1][e] = c * U[e] - s * V[e];
+        vectors[2][e] = s * U[e] + c * V[e];
+    }
+
+    SortEigenpairs(lambda, vectors, evals, evecs);
+    return true;
+}//end Solve
+
+bool SymmetricEigen3x3::SolveJacobi(const double (&a)[6], double (&evals)[3], double (&evecs)[9]) {
+    for (int t = 0; t < 6; t++) {
+        if (!std::isfinite(a[t])) { return false; }
+    }
+    double m[9];
+    Expand(a, m);
+    //Accumulate the rotations in v, whose columns become the eigenvectors
+    double v[9] = { 1.0, 0.0, 0.0, 0.0, 1.0, 0.0, 0.0, 0.0, 1.0 };
+    const int pairP[3] = { 0, 0, 1 };
+    const int pairQ[3] = { 1, 2, 2 };
+    for (int sweep = 0; sweep < MaxJacobiSweeps; sweep++) {
+        double offDiag = m[1] * m[1] + m[2] * m[2] + m[5] * m[5];
+        double diag = m[0] * m[0] + m[4] * m[4] + m[8] * m[8];
+        if (offDiag <= 1.0e-32 * diag) { break; }
+        for (int pair = 0; pair < 3; pair++) {
+            const int p = pairP[pair];
+            const int q = pairQ[pair];
+            const double apq = m[3 * p + q];
+            if (apq == 0.0) { continue; }
+            const double t = JacobiTangent(m[3 * p + p], m[3 * q + q], apq);
+            const double c = 1.0 / std::sqrt(t * t + 1.0);
+            const double s = t * c;
+            //m = J^T m J, then v = v J
+            for (int k = 0; k < 3; k++) {
+                const double mkp = m[3 * k + p];
+                const double mkq = m[3 * k + q];
+                m[3 * k + p] = c * mkp - s * mkq;
+                m[3 * k + q] = s * mkp + c * mkq;
+            }
+            for (int k = 0; k < 3; k++) {
+                const double mpk = m[3 * p + k];
+                const double mqk = m[3 * q + k];
+                m[3 * p + k] = c * mpk - s * mqk;
+                m[3 * q + k] = s * mpk + c * mqk;
+            }
+            for (int k = 0; k < 3; k++) {
+                const double vkp = v[3 * k + p];
+                const double vkq = v[3 * k + q];
+                v[3 * k + p] = c * vkp - s * vkq;
+                v[3 * k + q] = s * vkp + c * vkq;
+            }
+        }
+    }
+
+    double lambda[3] = { m[0], m[4], m[8] };
+    double vectors[3][3];
+    for (int i = 0; i < 3; i++) {
+        for (int e = 0; e < 3; e++) {
+            vectors[i][e] = v[3 * e + i];
+        }
+    }
+    SortEigenpairs(lambda, vectors, evals, evecs);
+    return true;
+}//end SolveJacobi
+
+void SymmetricEigen3x3::Expand(const double (&a)[6], double (&full)[9]) {
+    for (int t = 0; t < 6; t++) {
+        full[3 * TermRow[t] + TermCol[t]] = a[t];
+        full[3 * TermCol[t] + TermRow[t]] = a[t];
+    }
+}//end Expand
+
+} // namespace image
+} // namespace sedeen
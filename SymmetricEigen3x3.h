@@ -0,0 +1,85 @@
+/*=============================================================================
+ *
+ *  Copyright (c) 2020 Sunnybrook Research Institute
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ *
+ *=============================================================================*/
+
+#ifndef SEDEEN_SRC_FILTER_SYMMETRICEIGEN3X3_H
+#define SEDEEN_SRC_FILTER_SYMMETRICEIGEN3X3_H
+
+#include <cstdint>
+
+namespace sedeen {
+namespace image {
+
+///The count, mean and scatter matrix of a set of 3-element points, accumulated in fixed-size storage.
+///The scatter matrix is symmetric, so only its six unique terms are kept, in the order xx, xy, xz, yy, yz, zz.
+class PointMoments3 {
+public:
+    PointMoments3();
+    ~PointMoments3();
+
+    ///Add numPoints points in one pass over the data. Element e of point p is data[p * pointStride + e * elementStride].
+    ///Sums are taken about the first point, which keeps the one-pass scatter accurate for data far from the origin
+    void AddPoints(const double *data, const std::uint64_t numPoints, const std::uint64_t pointStride,
+        const std::uint64_t elementStride = 1);
+    ///Merge the moments of another set of points into these (Chan et al. pairwise update)
+    void Merge(const PointMoments3 &other);
+    ///Remove all points
+    void Clear();
+
+    ///Get the number of points added
+    inline const std::uint64_t GetCount() const { return m_count; }
+    ///Get the mean of the points
+    void GetMean(double (&mean)[3]) const;
+    ///Get the six unique terms of the scatter matrix (the sum of outer products of the centred points)
+    void GetScatter(double (&scatter)[6]) const;
+    ///Get the six unique terms of the covariance matrix, scaled by the number of points. Returns false if there are none
+    bool GetCovariance(double (&covar)[6]) const;
+
+private:
+    std::uint64_t m_count;
+    double m_mean[3];
+    double m_scatter[6];
+};
+
+///The eigenvalues and eigenvectors of a 3x3 symmetric matrix, found without heap allocation.
+///Matrices are given by their six unique terms, in the order xx, xy, xz, yy, yz, zz.
+class SymmetricEigen3x3 {
+public:
+    ///Solve the eigenproblem. Eigenvalues are returned in descending order, and the eigenvectors as the rows of
+    ///evecs (row-major) in the same order, as cv::eigen does. The eigenvalues are the closed-form roots of the
+    ///characteristic cubic, and each eigenvector a cross product of two rows of A - lambda*I; if two eigenvalues are
+    ///too close for that to be accurate, cyclic Jacobi rotations are used instead. Returns false for non-finite input
+    static bool Solve(const double (&a)[6], double (&evals)[3], double (&evecs)[9]);
+    ///Solve the eigenproblem with cyclic Jacobi rotations only. Outputs are ordered as in Solve
+    static bool SolveJacobi(const double (&a)[6], double (&evals)[3], double (&evecs)[9]);
+    ///Expand the six unique terms to a full row-major 3x3 matrix
+    static void Expand(const double (&a)[6], double (&full)[9]);
+
+private:
+    ///The largest number of Jacobi sweeps before giving up on convergence
+    static const int MaxJacobiSweeps = 50;
+};
+
+} // namespace image
+} // namespace sedeen
+#endif
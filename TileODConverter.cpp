@@ -0,0 +1,357 @@
+/*=============================================================================
+ *
+ *  Copyright (c) 2020 Sunnybrook Research Institute
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ *
+ *=============================================================================*/
+
+#include "TileODConverter.h"
+
+#include <chrono>
+#include <vector>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define TILEODCONVERTER_X86
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+//MSVC allows intrinsics of any instruction set without compiler options
+#define TILEODCONVERTER_TARGET_AVX2
+#else
+#define TILEODCONVERTER_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+namespace sedeen {
+namespace image {
+
+TileODConverter::TileODConverter(const double *odTable)
+    : TileODConverter(odTable, GetBestInstructionSet())
+{}//end constructor
+
+TileODConverter::TileODConverter(const double *odTable, const InstructionSet &instructionSet)
+    : m_instructionSet(SCALAR)
+{
+    for (int i = 0; i < 256; i++) {
+        m_odTable[i] = odTable[i];
+    }
+    //Use the requested instruction set only if it is supported
+    InstructionSet best = GetBestInstructionSet();
+    m_instructionSet = (instructionSet <= best) ? instructionSet : best;
+}//end constructor with instruction set
+
+TileODConverter::~TileODConverter(void) {
+}//end destructor
+
+TileODConverter::InstructionSet TileODConverter::GetBestInstructionSet() {
+#if defined(TILEODCONVERTER_X86)
+#if defined(_MSC_VER)
+    int info[4] = { 0 };
+    __cpuid(info, 0);
+    const int maxLeaf = info[0];
+    if (maxLeaf < 1) { return SCALAR; }
+    __cpuid(info, 1);
+    //AVX requires the OS to save the YMM registers (OSXSAVE, and XCR0 bits 1 and 2)
+    const bool hasOSXSAVE = ((info[2] & (1 << 27)) != 0);
+    const bool hasAVX = ((info[2] & (1 << 28)) != 0);
+    bool hasAVX2 = false;
+    if (hasOSXSAVE && hasAVX && (maxLeaf >= 7) && ((_xgetbv(0) & 0x6) == 0x6)) {
+        __cpuidex(info, 7, 0);
+        hasAVX2 = ((info[1] & (1 << 5)) != 0);
+    }
+#else
+    __builtin_cpu_init();
+    const bool hasAVX2 = (__builtin_cpu_supports("avx2") != 0);
+#endif
+    //There is no SSE path: four-wide table lookups and shuffles measured slower than the scalar loop
+    if (hasAVX2) { return AVX2; }
+#endif
+    return SCALAR;
+}//end GetBestInstructionSet
+
+const char* TileODConverter::GetInstructionSetName(const InstructionSet &instructionSet) {
+    switch (instructionSet) {
+    case AVX2:
+        return "AVX2";
+    default:
+        return "scalar";
+    }
+}//end GetInstructionSetName
+
+std::size_t TileODConverter::CompactInterleaved(const std::uint8_t *pixels, const std::size_t numPixels, const int numChannels,
+    const double ODthreshold, std::uint8_t *outRGB) const {
+    if ((pixels == nullptr) || (outRGB == nullptr) || (numChannels < 3)) { return 0; }
+    switch (m_instructionSet) {
+    case AVX2:
+        return CompactInterleavedAVX2(pixels, numPixels, numChannels, ODthreshold, outRGB);
+    default:
+        return CompactInterleavedScalar(pixels, numPixels, numChannels, ODthreshold, outRGB);
+    }
+}//end CompactInterleaved
+
+std::size_t TileODConverter::CompactPlanar(const std::uint8_t *red, const std::uint8_t *green, const std::uint8_t *blue,
+    const std::size_t numPixels, const double ODthreshold, std::uint8_t *outRGB) const {
+    if ((red == nullptr) || (green == nullptr) || (blue == nullptr) || (outRGB == nullptr)) { return 0; }
+    switch (m_instructionSet) {
+    case AVX2:
+        return CompactPlanarAVX2(red, green, blue, numPixels, ODthreshold, outRGB);
+    default:
+        return CompactPlanarScalar(red, green, blue, numPixels, ODthreshold, outRGB);
+    }
+}//end CompactPlanar
+
+std::size_t TileODConverter::CompactSelected(const std::uint8_t *pixels, const std::uint32_t *pixelIndices, const std::size_t numIndices,
+    const int numChannels, const std::size_t planeStride, const double ODthreshold, std::uint8_t *outRGB) const {
+    if ((pixels == nullptr) || (pixelIndices == nullptr) || (outRGB == nullptr)) { return 0; }
+    //Interleaved: RGB RGB RGB ... Planar: RRR... GGG... BBB...
+    const std::size_t pixelStride = (planeStride == 0) ? static_cast<std::size_t>(numChannels) : 1;
+    const std::size_t channelStride = (planeStride == 0) ? 1 : planeStride;
+    std::size_t numKept = 0;
+    for (std::size_t i = 0; i < numIndices; i++) {
+        const std::uint8_t *px = pixels + pixelIndices[i] * pixelStride;
+        const std::uint8_t r = px[0];
+        const std::uint8_t g = px[channelStride];
+        const std::uint8_t b = px[2 * channelStride];
+        //Write unconditionally, advance the output only if the pixel is kept
+        std::uint8_t *out = outRGB + 3 * numKept;
+        out[0] = r;
+        out[1] = g;
+        out[2] = b;
+        numKept += ((m_odTable[r] + m_odTable[g]) + m_odTable[b] > ODthreshold) ? 1 : 0;
+    }
+    return numKept;
+}//end CompactSelected
+
+void TileODConverter::CountChannelValues(const std::uint8_t *pixels, const std::size_t numPixels, const int numChannels,
+    std::uint64_t (&counts)[3][256]) {
+    if ((pixels == nullptr) || (numChannels < 3)) { return; }
+    for (std::size_t i = 0; i < numPixels; i++) {
+        const std::uint8_t *px = pixels + i * numChannels;
+        counts[0][px[0]]++;
+        counts[1][px[1]]++;
+        counts[2][px[2]]++;
+    }
+}//end CountChannelValues
+
+std::size_t TileODConverter::CompactInterleavedScalar(const std::uint8_t *pixels, const std::size_t numPixels, const int numChannels,
+    const double ODthreshold, std::uint8_t *outRGB) const {
+    std::size_t numKept = 0;
+    for (std::size_t i = 0; i < numPixels; i++) {
+        const std::uint8_t *px = pixels + i * numChannels;
+        std::uint8_t *out = outRGB + 3 * numKept;
+        out[0] = px[0];
+        out[1] = px[1];
+        out[2] = px[2];
+        numKept += ((m_odTable[px[0]] + m_odTable[px[1]]) + m_odTable[px[2]] > ODthreshold) ? 1 : 0;
+    }
+    return numKept;
+}//end CompactInterleavedScalar
+
+std::size_t TileODConverter::CompactPlanarScalar(const std::uint8_t *red, const std::uint8_t *green, const std::uint8_t *blue,
+    const std::size_t numPixels, const double ODthreshold, std::uint8_t *outRGB) const {
+    std::size_t numKept = 0;
+    for (std::size_t i = 0; i < numPixels; i++) {
+        std::uint8_t *out = outRGB + 3 * numKept;
+        out[0] = red[i];
+        out[1] = green[i];
+        out[2] = blue[i];
+        numKept += ((m_odTable[red[i]] + m_odTable[green[i]]) + m_odTable[blue[i]] > ODthreshold) ? 1 : 0;
+    }
+    return numKept;
+}//end CompactPlanarScalar
+
+#if defined(TILEODCONVERTER_X86)
+namespace {
+///Byte layouts of a block of four pixels as loaded into a 16-byte register
+enum BlockLayout {
+    INTERLEAVED3, //RGB RGB RGB RGB
+    INTERLEAVED4, //RGBX RGBX RGBX RGBX
+    PLANAR4       //RRRR GGGG BBBB
+};
+
+///Position of channel k of pixel j in a block
+inline int BlockOffset(const int layout, const int j, const int k) {
+    return (layout == INTERLEAVED3) ? (3 * j + k) : ((layout == INTERLEAVED4) ? (4 * j + k) : (4 * k + j));
+}//end BlockOffset
+
+///Byte shuffles that pack the R, G, B bytes of the pixels selected by a 4-bit mask to the front of a block
+const std::uint8_t* CompactShuffle(const int layout, const int mask) {
+    alignas(16) static std::uint8_t shuffles[3][16][16];
+    static const bool initialized = []() {
+        for (int l = 0; l < 3; l++) {
+            for (int m = 0; m < 16; m++) {
+                int kept = 0;
+                for (int j = 0; j < 4; j++) {
+                    if ((m >> j) & 1) {
+                        for (int k = 0; k < 3; k++) {
+                            shuffles[l][m][3 * kept + k] = static_cast<std::uint8_t>(BlockOffset(l, j, k));
+                        }
+                        kept++;
+                    }
+                }
+                //Zero the rest of the block
+                for (int b = 3 * kept; b < 16; b++) {
+                    shuffles[l][m][b] = 0x80;
+                }
+            }
+        }
+        return true;
+    }();
+    (void)initialized;
+    return shuffles[layout][mask];
+}//end CompactShuffle
+
+///Byte shuffles that rearrange an interleaved block to RRRR GGGG BBBB
+const std::uint8_t* PlanarizeShuffle(const int layout) {
+    alignas(16) static std::uint8_t shuffles[2][16];
+    static const bool initialized = []() {
+        for (int l = 0; l < 2; l++) {
+            for (int j = 0; j < 4; j++) {
+                for (int k = 0; k < 3; k++) {
+                    shuffles[l][4 * k + j] = static_cast<std::uint8_t>(BlockOffset(l, j, k));
+                }
+            }
+            for (int b = 12; b < 16; b++) {
+                shuffles[l][b] = 0x80;
+            }
+        }
+        return true;
+    }();
+    (void)initialized;
+    return shuffles[layout];
+}//end PlanarizeShuffle
+
+///Number of pixels selected by a 4-bit mask
+inline int MaskCount(const int mask) {
+    static const int counts[16] = { 0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4 };
+    return counts[mask & 0xF];
+}//end MaskCount
+
+///Sum the OD of the four pixels whose R, G and B values are in the low 4 bytes of r, g and b,
+///and compare it with the threshold. Returns a 4-bit mask of the pixels above it.
+TILEODCONVERTER_TARGET_AVX2
+inline int ThresholdFourAVX2(const double *odTable, const __m128i &r, const __m128i &g, const __m128i &b,
+    const __m256d &thresholdVec) {
+    __m256d odR = _mm256_i32gather_pd(odTable, _mm_cvtepu8_epi32(r), 8);
+    __m256d odG = _mm256_i32gather_pd(odTable, _mm_cvtepu8_epi32(g), 8);
+    __m256d odB = _mm256_i32gather_pd(odTable, _mm_cvtepu8_epi32(b), 8);
+    return _mm256_movemask_pd(_mm256_cmp_pd(_mm256_add_pd(_mm256_add_pd(odR, odG), odB), thresholdVec, _CMP_GT_OQ));
+}//end ThresholdFourAVX2
+} // namespace
+
+//Blocks of eight pixels: the two halves are rearranged to planar order and their OD values gathered,
+//four pixels at a time. A byte shuffle then packs the kept pixels of each half and one 16-byte store
+//writes them. Stores run up to 13 bytes past the kept pixels, and 16-byte loads past the last pixel,
+//so each loop stops early and leaves the tail to the scalar path.
+TILEODCONVERTER_TARGET_AVX2
+std::size_t TileODConverter::CompactInterleavedAVX2(const std::uint8_t *pixels, const std::size_t numPixels, const int numChannels,
+    const double ODthreshold, std::uint8_t *outRGB) const {
+    if (numChannels > 4) {
+        return CompactInterleavedScalar(pixels, numPixels, numChannels, ODthreshold, outRGB);
+    }
+    const int layout = (numChannels == 3) ? INTERLEAVED3 : INTERLEAVED4;
+    const std::size_t c = static_cast<std::size_t>(numChannels);
+    const __m256d thresholdVec = _mm256_set1_pd(ODthreshold);
+    const __m128i planarize = _mm_load_si128(reinterpret_cast<const __m128i*>(PlanarizeShuffle(layout)));
+    std::size_t numKept = 0;
+    std::size_t i = 0;
+    for (; i + 10 <= numPixels; i += 8) {
+        const std::uint8_t *px = pixels + i * c;
+        __m128i lo = _mm_loadu_si128(reinterpret_cast<const __m128i*>(px));
+        __m128i hi = _mm_loadu_si128(reinterpret_cast<const __m128i*>(px + 4 * c));
+        //R0-3 R4-7 G0-3 G4-7, and B0-3 B4-7
+        __m128i rg = _mm_unpacklo_epi32(_mm_shuffle_epi8(lo, planarize), _mm_shuffle_epi8(hi, planarize));
+        __m128i bx = _mm_unpackhi_epi32(_mm_shuffle_epi8(lo, planarize), _mm_shuffle_epi8(hi, planarize));
+        int mask = ThresholdFourAVX2(m_odTable, rg, _mm_srli_si128(rg, 8), bx, thresholdVec)
+            | (ThresholdFourAVX2(m_odTable, _mm_srli_si128(rg, 4), _mm_srli_si128(rg, 12), _mm_srli_si128(bx, 4), thresholdVec) << 4);
+        __m128i packedLo = _mm_shuffle_epi8(lo, _mm_load_si128(reinterpret_cast<const __m128i*>(CompactShuffle(layout, mask & 0xF))));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(outRGB + 3 * numKept), packedLo);
+        numKept += MaskCount(mask);
+        __m128i packedHi = _mm_shuffle_epi8(hi, _mm_load_si128(reinterpret_cast<const __m128i*>(CompactShuffle(layout, mask >> 4))));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(outRGB + 3 * numKept), packedHi);
+        numKept += MaskCount(mask >> 4);
+    }
+    numKept += CompactInterleavedScalar(pixels + i * c, numPixels - i, numChannels, ODthreshold, outRGB + 3 * numKept);
+    return numKept;
+}//end CompactInterleavedAVX2
+
+TILEODCONVERTER_TARGET_AVX2
+std::size_t TileODConverter::CompactPlanarAVX2(const std::uint8_t *red, const std::uint8_t *green, const std::uint8_t *blue,
+    const std::size_t numPixels, const double ODthreshold, std::uint8_t *outRGB) const {
+    const __m256d thresholdVec = _mm256_set1_pd(ODthreshold);
+    std::size_t numKept = 0;
+    std::size_t i = 0;
+    for (; i + 10 <= numPixels; i += 8) {
+        __m128i r = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(red + i));
+        __m128i g = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(green + i));
+        __m128i b = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(blue + i));
+        int mask = ThresholdFourAVX2(m_odTable, r, g, b, thresholdVec)
+            | (ThresholdFourAVX2(m_odTable, _mm_srli_si128(r, 4), _mm_srli_si128(g, 4), _mm_srli_si128(b, 4), thresholdVec) << 4);
+        //R0-3 G0-3 B0-3, and R4-7 G4-7 B4-7
+        __m128i rg = _mm_unpacklo_epi32(r, g);
+        __m128i lo = _mm_unpacklo_epi64(rg, b);
+        __m128i hi = _mm_unpackhi_epi64(rg, _mm_slli_si128(b, 4));
+        __m128i packedLo = _mm_shuffle_epi8(lo, _mm_load_si128(reinterpret_cast<const __m128i*>(CompactShuffle(PLANAR4, mask & 0xF))));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(outRGB + 3 * numKept), packedLo);
+        numKept += MaskCount(mask);
+        __m128i packedHi = _mm_shuffle_epi8(hi, _mm_load_si128(reinterpret_cast<const __m128i*>(CompactShuffle(PLANAR4, mask >> 4))));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(outRGB + 3 * numKept), packedHi);
+        numKept += MaskCount(mask >> 4);
+    }
+    numKept += CompactPlanarScalar(red + i, green + i, blue + i, numPixels - i, ODthreshold, outRGB + 3 * numKept);
+    return numKept;
+}//end CompactPlanarAVX2
+#else
+//Without x86 vector instructions, the vector paths are never selected
+std::size_t TileODConverter::CompactInterleavedAVX2(const std::uint8_t *pixels, const std::size_t numPixels, const int numChannels,
+    const double ODthreshold, std::uint8_t *outRGB) const {
+    return CompactInterleavedScalar(pixels, numPixels, numChannels, ODthreshold, outRGB);
+}//end CompactInterleavedAVX2
+
+std::size_t TileODConverter::CompactPlanarAVX2(const std::uint8_t *red, const std::uint8_t *green, const std::uint8_t *blue,
+    const std::size_t numPixels, const double ODthreshold, std::uint8_t *outRGB) const {
+    return CompactPlanarScalar(red, green, blue, numPixels, ODthreshold, outRGB);
+}//end CompactPlanarAVX2
+#endif
+
+double TileODConverter::MeasureThroughput(const double *odTable, const InstructionSet &instructionSet,
+    const std::size_t numPixels /* = 1 << 22 */) {
+    if ((odTable == nullptr) || (numPixels == 0)) { return 0.0; }
+    TileODConverter converter(odTable, instructionSet);
+    //Synthetic pixels from a linear congruential generator, so every run converts the same data
+    std::vector<std::uint8_t> pixels(3 * numPixels);
+    std::uint32_t state = 12345;
+    for (auto it = pixels.begin(); it != pixels.end(); ++it) {
+        state = state * 1664525u + 1013904223u;
+        *it = static_cast<std::uint8_t>(state >> 24);
+    }
+    std::vector<std::uint8_t> kept(3 * numPixels);
+    //Warm the caches once, then time a second pass
+    volatile std::size_t numKept = converter.CompactInterleaved(pixels.data(), numPixels, 3, 0.15, kept.data());
+    auto start = std::chrono::steady_clock::now();
+    numKept = converter.CompactInterleaved(pixels.data(), numPixels, 3, 0.15, kept.data());
+    auto stop = std::chrono::steady_clock::now();
+    (void)numKept;
+    double seconds = std::chrono::duration<double>(stop - start).count();
+    return (seconds > 0.0) ? static_cast<double>(numPixels) / seconds : 0.0;
+}//end MeasureThroughput
+
+} // namespace image
+} // namespace sedeen
@@ -0,0 +1,97 @@
+/*=============================================================================
+ *
+ *  Copyright (c) 2020 Sunnybrook Research Institute
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ *
+ *=============================================================================*/
+
+#ifndef SEDEEN_SRC_FILTER_TILEODCONVERTER_H
+#define SEDEEN_SRC_FILTER_TILEODCONVERTER_H
+
+#include <cstddef>
+#include <cstdint>
+
+namespace sedeen {
+namespace image {
+
+///Converts blocks of 8-bit RGB pixels to optical density through a lookup table, applies the OD-sum threshold,
+///and compacts the R, G, B values of the pixels above it into an output buffer (3 bytes per pixel).
+///An AVX2 path is chosen at run time when the processor supports it, with a scalar fallback.
+///Both paths sum the double precision table values as (R + G) + B, so they keep exactly the same pixels.
+class TileODConverter {
+public:
+    ///The instruction set a converter uses
+    enum InstructionSet {
+        SCALAR,
+        AVX2
+    };
+
+public:
+    ///Create a converter from a 256-entry table of optical density values, using the best supported instruction set.
+    ///The output buffers of all Compact methods must hold 3 bytes for every input pixel.
+    TileODConverter(const double *odTable);
+    ///Create a converter from a 256-entry table of optical density values, using the given instruction set if supported
+    TileODConverter(const double *odTable, const InstructionSet &instructionSet);
+    virtual ~TileODConverter();
+
+    ///Keep the pixels with OD sum above ODthreshold from interleaved pixels (3 or more channels, R, G, B first). Returns the number kept.
+    std::size_t CompactInterleaved(const std::uint8_t *pixels, const std::size_t numPixels, const int numChannels,
+        const double ODthreshold, std::uint8_t *outRGB) const;
+    ///Keep the pixels with OD sum above ODthreshold from separate R, G and B planes. Returns the number kept.
+    std::size_t CompactPlanar(const std::uint8_t *red, const std::uint8_t *green, const std::uint8_t *blue,
+        const std::size_t numPixels, const double ODthreshold, std::uint8_t *outRGB) const;
+    ///Keep the pixels with OD sum above ODthreshold from a list of pixel positions (planeStride is 0 for interleaved pixels). Returns the number kept.
+    std::size_t CompactSelected(const std::uint8_t *pixels, const std::uint32_t *pixelIndices, const std::size_t numIndices,
+        const int numChannels, const std::size_t planeStride, const double ODthreshold, std::uint8_t *outRGB) const;
+
+    ///Count the occurrences of each R, G and B value in interleaved pixels. Sums of OD follow exactly from the counts and the table.
+    static void CountChannelValues(const std::uint8_t *pixels, const std::size_t numPixels, const int numChannels,
+        std::uint64_t (&counts)[3][256]);
+
+    ///Get the instruction set this converter uses
+    inline const InstructionSet GetInstructionSet() const { return m_instructionSet; }
+    ///Get the best instruction set supported by this processor and build
+    static InstructionSet GetBestInstructionSet();
+    ///Get the name of an instruction set, for reports
+    static const char* GetInstructionSetName(const InstructionSet &instructionSet);
+
+    ///Benchmark: convert and threshold numPixels synthetic interleaved RGB pixels, return the throughput in pixels per second
+    static double MeasureThroughput(const double *odTable, const InstructionSet &instructionSet,
+        const std::size_t numPixels = 1 << 22);
+
+private:
+    std::size_t CompactInterleavedScalar(const std::uint8_t *pixels, const std::size_t numPixels, const int numChannels,
+        const double ODthreshold, std::uint8_t *outRGB) const;
+    std::size_t CompactInterleavedAVX2(const std::uint8_t *pixels, const std::size_t numPixels, const int numChannels,
+        const double ODthreshold, std::uint8_t *outRGB) const;
+    std::size_t CompactPlanarScalar(const std::uint8_t *red, const std::uint8_t *green, const std::uint8_t *blue,
+        const std::size_t numPixels, const double ODthreshold, std::uint8_t *outRGB) const;
+    std::size_t CompactPlanarAVX2(const std::uint8_t *red, const std::uint8_t *green, const std::uint8_t *blue,
+        const std::size_t numPixels, const double ODthreshold, std::uint8_t *outRGB) const;
+
+private:
+    ///Optical density table, aligned for vector loads
+    alignas(32) double m_odTable[256];
+    InstructionSet m_instructionSet;
+};
+
+} // namespace image
+} // namespace sedeen
+#endif
@@ -0,0 +1,105 @@
+/*=============================================================================
+ *
+ *  Copyright (c) 2020 Sunnybrook Research Institute
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ *
+ *=============================================================================*/
+
+#include "TilePrefetcher.h"
+
+namespace sedeen {
+namespace image {
+
+TilePrefetcher::TilePrefetcher(FetchFunction fetch, const size_t numRequests, const size_t prefetchDepth /* = 8 */)
+    : m_fetch(fetch),
+    m_numRequests(numRequests),
+    m_ring((prefetchDepth > 0) ? prefetchDepth : 1),
+    m_produced(0),
+    m_consumed(0),
+    m_stopRequested(false)
+{
+    //Start reading immediately
+    if (m_fetch && (m_numRequests > 0)) {
+        m_producerThread = std::thread(&TilePrefetcher::ProduceAll, this);
+    }
+}//end constructor
+
+TilePrefetcher::~TilePrefetcher(void) {
+    //Stop the producer if the consumer did not take every image
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopRequested = true;
+    }
+    m_slotFreed.notify_all();
+    if (m_producerThread.joinable()) {
+        m_producerThread.join();
+    }
+}//end destructor
+
+void TilePrefetcher::ProduceAll() {
+    const size_t capacity = m_ring.size();
+    for (size_t request = 0; request < m_numRequests; request++) {
+        //Wait for a free slot
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_slotFreed.wait(lock, [&]() { return m_stopRequested || (request - m_consumed < capacity); });
+            if (m_stopRequested) { return; }
+        }
+        //A failed read is passed on as a null image, so the consumer stays in step with the requests
+        RawImage fetched;
+        try {
+            fetched = m_fetch(request);
+        }
+        catch (...) {
+            fetched = RawImage();
+        }
+        //The consumer only reads this slot after seeing the new count under the lock
+        m_ring[request % capacity] = fetched;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_produced = request + 1;
+        }
+        m_imageReady.notify_one();
+    }
+}//end ProduceAll
+
+bool TilePrefetcher::Next(RawImage &image) {
+    size_t request = 0;
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        request = m_consumed;
+        if ((request >= m_numRequests) || !m_fetch) { return false; }
+        //Wait for the producer to fill the slot
+        m_imageReady.wait(lock, [&]() { return m_produced > request; });
+    }
+    const size_t slot = request % m_ring.size();
+    image = m_ring[slot];
+    //Release the slot's reference so the image can be freed when the consumer is done with it
+    m_ring[slot] = RawImage();
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_consumed = request + 1;
+    }
+    m_slotFreed.notify_one();
+    return true;
+}//end Next
+
+} // namespace image
+} // namespace sedeen
@@ -0,0 +1,88 @@
+/*=============================================================================
+ *
+ *  Copyright (c) 2020 Sunnybrook Research Institute
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ *
+ *=============================================================================*/
+
+#ifndef SEDEEN_SRC_FILTER_TILEPREFETCHER_H
+#define SEDEEN_SRC_FILTER_TILEPREFETCHER_H
+
+#include "Global.h"
+#include "Geometry.h"
+#include "Image.h"
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace sedeen {
+namespace image {
+
+///Reads images ahead of use on a producer thread, handing them to a single consumer in request order.
+///The producer and consumer share a bounded ring buffer, so reading and processing overlap. Either side blocks
+///(rather than spins) while the buffer is full or empty, so a waiting thread does not take a processor from the workers.
+class PATHCORE_IMAGE_API TilePrefetcher {
+public:
+    ///A function that reads the image at a position in the request list. It is only called from the producer thread.
+    typedef std::function<RawImage(const size_t)> FetchFunction;
+
+public:
+    TilePrefetcher(FetchFunction fetch, const size_t numRequests, const size_t prefetchDepth = 8);
+    virtual ~TilePrefetcher();
+
+    ///Wait for the next image in request order. Returns false when all requests have been consumed.
+    ///An image that could not be read is returned as a null image, which the consumer must treat as a failure.
+    bool Next(RawImage &image);
+
+    ///Get the number of requests
+    inline const size_t GetNumRequests() const { return m_numRequests; }
+    ///Get the maximum number of images read ahead of the consumer
+    inline const size_t GetPrefetchDepth() const { return m_ring.size(); }
+
+private:
+    ///Read each requested image in order, waiting whenever the ring buffer is full
+    void ProduceAll();
+
+private:
+    FetchFunction m_fetch;
+    const size_t m_numRequests;
+    ///Ring buffer slots, one per image that may be held ahead of the consumer
+    std::vector<RawImage> m_ring;
+    ///Guards the counts and the stop flag
+    std::mutex m_mutex;
+    ///Signalled when an image is produced, or the producer finishes
+    std::condition_variable m_imageReady;
+    ///Signalled when a slot is freed, or a stop is requested
+    std::condition_variable m_slotFreed;
+    ///The number of images the producer has placed in the ring buffer
+    size_t m_produced;
+    ///The number of images the consumer has taken from the ring buffer
+    size_t m_consumed;
+    ///Set to stop the producer early
+    bool m_stopRequested;
+    std::thread m_producerThread;
+};
+
+} // namespace image
+} // namespace sedeen
+#endif
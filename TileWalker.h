@@ -0,0 +1,143 @@
+/*=============================================================================
+ *
+ *  Copyright (c) 2020 Sunnybrook Research Institute
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ *  copies of the Software, and to permit persons to whom the Software is
+ *  furnished to do so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ *
+ *=============================================================================*/
+
+#ifndef SEDEEN_SRC_FILTER_TILEWALKER_H
+#define SEDEEN_SRC_FILTER_TILEWALKER_H
+
+#include "Global.h"
+#include "Geometry.h"
+#include "Image.h"
+
+#include "RGBSampleStore.h"
+
+#include <cstddef>
+
+namespace sedeen {
+namespace image {
+
+///Typed access to the channel values of a block of pixels, specialized at compile time for the pixel order,
+///the number of channels and the channel type. Index arithmetic folds to constants, so loops over pixels
+///contain no branches on the layout. Pixels are numbered in row-major order; R, G, B are the first three channels.
+template <typename ValueType, PixelOrder Order, int NumChannels>
+class TileWalker {
+public:
+    ///The type of a channel value (u8 or u16)
+    typedef ValueType Value;
+    ///The number of channels of each pixel
+    static const int Channels = NumChannels;
+    ///Whether the channels of a pixel are adjacent (RGB RGB ...) rather than in separate planes (RRR... GGG... BBB...)
+    static const bool IsInterleaved = (Order == PixelOrder::Interleaved);
+    ///The distance between the values of adjacent pixels in one channel
+    static const std::size_t PixelStride = IsInterleaved ? static_cast<std::size_t>(NumChannels) : 1;
+
+public:
+    TileWalker(const ValueType *data, const std::size_t numPixels) : m_data(data), m_numPixels(numPixels) {}
+
+    ///Get the position of channel c of pixel px in the data
+    inline const std::size_t Index(const std::size_t px, const int c) const {
+        return IsInterleaved ? (px * NumChannels + c) : (static_cast<std::size_t>(c) * m_numPixels + px);
+    }
+    ///Get the R value of pixel px
+    inline const ValueType R(const std::size_t px) const { return m_data[Index(px, 0)]; }
+    ///Get the G value of pixel px
+    inline const ValueType G(const std::size_t px) const { return m_data[Index(px, 1)]; }
+    ///Get the B value of pixel px
+    inline const ValueType B(const std::size_t px) const { return m_data[Index(px, 2)]; }
+
+    ///Get the values of channel c, starting at pixel 0 and PixelStride apart
+    inline const ValueType* ChannelData(const int c) const { return m_data + Index(0, c); }
+    ///Get the raw data
+    inline const ValueType* Data() const { return m_data; }
+    ///Get the distance between channel planes, or 0 for interleaved pixels
+    inline const std::size_t PlaneStride() const { return IsInterleaved ? 0 : m_numPixels; }
+    ///Get the number of pixels
+    inline const std::size_t NumPixels() const { return m_numPixels; }
+
+private:
+    const ValueType *m_data;
+    std::size_t m_numPixels;
+};
+
+///Get the optical density table indexed by a channel value of the given type
+template <typename ValueType>
+inline const double* GetODLookupTableFor();
+template <>
+inline const double* GetODLookupTableFor<u8>() { return RGBSampleStore::GetODLookupTable(); }
+template <>
+inline const double* GetODLookupTableFor<u16>() { return RGBSampleStore::GetWideODLookupTable(); }
+
+///Round a channel value to 8 bits, the precision of sample stores
+inline const u8 ToEightBit(const u8 v) { return v; }
+inline const u8 ToEightBit(const u16 v) { return static_cast<u8>((static_cast<u32>(v) * 255 + 32767) / 65535); }
+
+///Call visitor with the walker matching the pixel order and channel count, for channel values of type ValueType
+template <typename ValueType, typename Visitor>
+bool VisitTilePixelsOfType(const ValueType *data, const std::size_t numPixels, const PixelOrder order,
+    const int numChannels, Visitor &&visitor) {
+    if (order == PixelOrder::Interleaved) {
+        if (numChannels == 3) {
+            visitor(TileWalker<ValueType, PixelOrder::Interleaved, 3>(data, numPixels));
+            return true;
+        }
+        else if (numChannels == 4) {
+            visitor(TileWalker<ValueType, PixelOrder::Interleaved, 4>(data, numPixels));
+            return true;
+        }
+    }
+    else if (order == PixelOrder::Planar) {
+        if (numChannels == 3) {
+            visitor(TileWalker<ValueType, PixelOrder::Planar, 3>(data, numPixels));
+            return true;
+        }
+        else if (numChannels == 4) {
+            visitor(TileWalker<ValueType, PixelOrder::Planar, 4>(data, numPixels));
+            return true;
+        }
+    }
+    return false;
+}//end VisitTilePixelsOfType
+
+///Choose the walker for an image's pixel order, channel count (3 or 4) and bit depth (8 or 16) once, and call visitor with it.
+///Returns false without calling visitor if the image is empty or its layout has no walker, in which case values must be read one at a time.
+template <typename Visitor>
+bool VisitTilePixels(const RawImage &image, Visitor &&visitor) {
+    if (image.isNull()) { return false; }
+    std::size_t numPixels = static_cast<std::size_t>(image.width()) * static_cast<std::size_t>(image.height());
+    int numChannels = sedeen::image::channels(image);
+    //Channel values are stored contiguously from the first pixel, bytesPerChannel bytes each
+    const void *data = image.data();
+    if ((data == nullptr) || (numPixels == 0)) { return false; }
+    switch (sedeen::image::bytesPerChannel(image)) {
+    case 1:
+        return VisitTilePixelsOfType(static_cast<const u8*>(data), numPixels, image.order(), numChannels, visitor);
+    case 2:
+        return VisitTilePixelsOfType(static_cast<const u16*>(data), numPixels, image.order(), numChannels, visitor);
+    default:
+        return false;
+    }
+}//end VisitTilePixels
+
+} // namespace image
+} // namespace sedeen
+#endif